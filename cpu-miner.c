@@ -19,12 +19,22 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <time.h>
+#include <math.h>
 #ifdef WIN32
 #include <windows.h>
 #else
 #include <errno.h>
 #include <signal.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#ifdef HAVE_SYS_EPOLL_H
+#define WANT_PROXY 1
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <netdb.h>
+#endif
 #if HAVE_SYS_SYSCTL_H
 #include <sys/types.h>
 #if HAVE_SYS_PARAM_H
@@ -37,11 +47,29 @@
 #include <curl/curl.h>
 #include "compat.h"
 #include "miner.h"
+#include "elist.h"
 #include "sph_sha2.h"
 #include "sph_types.h"
 
 #define PROGRAM_NAME		"minerd"
 #define LP_SCANTIME		60
+#define NTIME_ROLL		300	/* seconds of ntime rolling when no limit is given */
+#define AUTOTUNE_SECONDS	3
+#define AUTOTUNE_CACHE		".minerd-autotune.json"
+#define CPU_RECHECK_INTERVAL	30
+#define MAX_INFLIGHT		64	/* stratum shares awaiting a reply */
+#define SHARE_ID_BASE		16	/* lower ids are used for other requests */
+#define SHARE_TIMEOUT		30	/* seconds before a share counts as lost */
+#define SHARE_CHECK		5	/* seconds between checks for lost shares */
+#define SHARE_BUFFER		64	/* shares held while their pool reconnects */
+#define SHARE_BUFFER_AGE	120	/* seconds a held share stays worth sending */
+#define SHARE_SEEN		256	/* shares remembered per pool to catch duplicates */
+#define MAX_POOLS		8
+#define SUGGEST_INTERVAL	60	/* seconds between difficulty suggestions */
+#define SPLIT_INTERVAL		60	/* seconds between --split rebalances */
+#define SPLIT_MIN_SHARES	20	/* accepted shares needed to rebalance */
+#define WORKIO_XFERS		8	/* concurrent getwork/GBT requests */
+#define WORKIO_POLL		100	/* ms between command checks on old curl */
 
 #ifdef __linux /* Linux specific policy and affinity management */
 #include <sched.h>
@@ -92,6 +120,7 @@ static inline void affine_to_cpu(int id, int cpu)
 enum workio_commands {
 	WC_GET_WORK,
 	WC_SUBMIT_WORK,
+	WC_QUIT,
 };
 
 struct workio_cmd {
@@ -100,6 +129,9 @@ struct workio_cmd {
 	union {
 		struct work	*work;
 	} u;
+	struct workio_cmd	*next;		/* in the workio thread's lists */
+	time_t			retry_at;
+	int			failures;
 };
 
 enum algos {
@@ -114,8 +146,6 @@ static const char *algo_names[] = {
 	[ALGO_ODO]		= "odo",
 };
 
-
-uint32_t g_odo_key=0;
 bool opt_debug = false;
 bool opt_protocol = false;
 static bool opt_benchmark = false;
@@ -133,10 +163,25 @@ static int opt_retries = -1;
 static int opt_fail_pause = 30;
 int opt_timeout = 0;
 static int opt_scantime = 5;
+static int opt_restart_latency = 100;
 static enum algos opt_algo = ALGO_SCRYPT;
 static int opt_scrypt_n = 1024;
 static int opt_n_threads;
+static int max_threads;
+static char *opt_control;
 static int num_processors;
+static bool opt_autotune = false;
+static int opt_odo_engine = 0;
+static bool use_physical_cores = false;
+static bool auto_threads = false;
+static int *thr_cpu;
+static int *cpu_list;
+static int cpu_count;
+static int active_threads;
+static int started_threads;
+static unsigned long layout_gen;
+static pthread_mutex_t thr_lock;
+static pthread_cond_t thr_cond;
 static char *rpc_url;
 static char *rpc_userpass;
 static char *rpc_user, *rpc_pass;
@@ -151,14 +196,31 @@ static int work_thr_id;
 int longpoll_thr_id = -1;
 int stratum_thr_id = -1;
 struct work_restart *work_restart = NULL;
-static struct stratum_ctx stratum;
+
+static int pool_count = 1;
+static int active_pool;		/* guarded by g_work_lock */
+static int pools_alive;
+static int opt_failback = 30;
+static bool opt_version_rolling = true;
+static bool opt_extranonce_subscribe = true;
+static double opt_share_rate;	/* shares per minute, 0 to leave it to the pool */
+static char *opt_proxy_listen;
+static bool opt_split;
 
 pthread_mutex_t applog_lock;
 static pthread_mutex_t stats_lock;
+static pthread_mutex_t share_lock;
+static double rtt_sum;
+static unsigned long rtt_count;
 
 static unsigned long accepted_count = 0L;
 static unsigned long rejected_count = 0L;
 static double *thr_hashrates;
+static const double restart_buckets[] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
+static unsigned long restart_hist[ARRAY_SIZE(restart_buckets) + 1];
+static double restart_max;
 
 #ifdef HAVE_GETOPT_LONG
 #include <getopt.h>
@@ -179,18 +241,32 @@ Options:\n\
                           scrypt:N  scrypt(N, 1, 1)\n\
                           sha256d   SHA-256d\n\
   -o, --url=URL         URL of mining server\n\
+      --backup-url=URL  Stratum server to fail over to (may be repeated)\n\
+      --share-rate=N    ask Stratum pools for a difficulty that yields about\n\
+                          N shares per minute (default: pool's choice)\n\
+      --failback=N      seconds a preferred pool must be up before switching\n\
+                          back to it (default: 30)\n\
+      --split=W[,W...]  divide the threads between -o and the backup URLs\n\
+                          in proportion to the weights W, e.g. 70,30\n\
   -O, --userpass=U:P    username:password pair for mining server\n\
   -u, --user=USERNAME   username for mining server\n\
   -p, --pass=PASSWORD   password for mining server\n\
       --cert=FILE       certificate for mining server using SSL\n\
   -x, --proxy=[PROTOCOL://]HOST[:PORT]  connect through a proxy\n\
   -t, --threads=N       number of miner threads (default: number of processors)\n\
+      --max-threads=N   upper bound for resizing the thread pool at run time\n\
+                          (default: the larger of -t and the processor count)\n\
+      --autotune        calibrate thread layout and kernel on first start\n\
+                          and reuse the result cached for this CPU model\n\
+      --odo-engine=NAME Odo kernel to use (default: scalar)\n\
   -r, --retries=N       number of times to retry if a network call fails\n\
                           (default: retry indefinitely)\n\
   -R, --retry-pause=N   time to pause between retries, in seconds (default: 30)\n\
   -T, --timeout=N       timeout for long polling, in seconds (default: none)\n\
   -s, --scantime=N      upper bound on time spent scanning current work when\n\
                           long polling is unavailable, in seconds (default: 5)\n\
+      --restart-latency=N  upper bound on the time a thread keeps hashing\n\
+                          stale work after a restart, in ms (default: 100)\n\
       --coinbase-addr=ADDR  payout address for solo mining\n\
       --coinbase-sig=TEXT  data to insert in the coinbase when possible\n\
       --no-longpoll     disable long polling support\n\
@@ -198,6 +274,9 @@ Options:\n\
       --no-gbt          disable getblocktemplate support\n\
       --no-stratum      disable X-Stratum support\n\
       --no-redirect     ignore requests to change the URL of the mining server\n\
+      --no-extranonce-subscribe  do not ask Stratum servers for\n\
+                          mining.set_extranonce\n\
+      --no-version-rolling  do not negotiate Stratum version rolling (BIP 310)\n\
   -q, --quiet           disable per-thread hashmeter output\n\
   -D, --debug           enable debug output\n\
   -P, --protocol-dump   verbose dump of protocol-level activities\n"
@@ -211,6 +290,19 @@ Options:\n\
 #endif
 "\
       --benchmark       run in offline benchmark mode\n\
+"
+#ifndef WIN32
+"\
+      --control=PATH    accept control commands on a Unix socket at PATH\n\
+"
+#endif
+#ifdef WANT_PROXY
+"\
+      --proxy-listen=[HOST:]PORT  serve Stratum to downstream miners, sharing\n\
+                          out our extranonce2 space\n\
+"
+#endif
+"\
   -c, --config=FILE     load a JSON-format configuration file\n\
   -V, --version         display version information and exit\n\
   -h, --help            display this help text and exit\n\
@@ -227,6 +319,8 @@ static char const short_options[] =
 
 static struct option const options[] = {
 	{ "algo", 1, NULL, 'a' },
+	{ "autotune", 0, NULL, 1017 },
+	{ "backup-url", 1, NULL, 1022 },
 #ifndef WIN32
 	{ "background", 0, NULL, 'B' },
 #endif
@@ -235,20 +329,34 @@ static struct option const options[] = {
 	{ "coinbase-addr", 1, NULL, 1013 },
 	{ "coinbase-sig", 1, NULL, 1015 },
 	{ "config", 1, NULL, 'c' },
+#ifndef WIN32
+	{ "control", 1, NULL, 1021 },
+#endif
 	{ "debug", 0, NULL, 'D' },
+	{ "failback", 1, NULL, 1023 },
 	{ "help", 0, NULL, 'h' },
+	{ "max-threads", 1, NULL, 1020 },
+	{ "no-extranonce-subscribe", 0, NULL, 1027 },
 	{ "no-gbt", 0, NULL, 1011 },
 	{ "no-getwork", 0, NULL, 1010 },
 	{ "no-longpoll", 0, NULL, 1003 },
 	{ "no-redirect", 0, NULL, 1009 },
 	{ "no-stratum", 0, NULL, 1007 },
+	{ "no-version-rolling", 0, NULL, 1024 },
+	{ "odo-engine", 1, NULL, 1018 },
 	{ "pass", 1, NULL, 'p' },
 	{ "protocol-dump", 0, NULL, 'P' },
 	{ "proxy", 1, NULL, 'x' },
+#ifdef WANT_PROXY
+	{ "proxy-listen", 1, NULL, 1026 },
+#endif
 	{ "quiet", 0, NULL, 'q' },
+	{ "restart-latency", 1, NULL, 1019 },
 	{ "retries", 1, NULL, 'r' },
 	{ "retry-pause", 1, NULL, 'R' },
 	{ "scantime", 1, NULL, 's' },
+	{ "share-rate", 1, NULL, 1025 },
+	{ "split", 1, NULL, 1028 },
 #ifdef HAVE_SYSLOG_H
 	{ "syslog", 0, NULL, 'S' },
 #endif
@@ -272,11 +380,48 @@ struct work {
 	char *job_id;
 	size_t xnonce2_len;
 	unsigned char *xnonce2;
+	int pool;
+	unsigned long session;	/* stratum session_seq the work belongs to */
+	unsigned long clean_seq;	/* stratum clean_seq of the job */
+	uint32_t odo_key;
+	uint32_t ntime_max;	/* ntime may be rolled up to this, 0 if not */
+	uint32_t version_mask;	/* version bits that may be rolled */
 };
 
 static struct work g_work;
 static time_t g_work_time;
 static pthread_mutex_t g_work_lock;
+static volatile unsigned long work_gen;	/* bumped when long polling
+					 * makes fetched work stale */
+
+/* Stratum pools in order of preference; pools[0] is the -o URL */
+struct pool {
+	struct stratum_ctx	ctx;
+	char			*user, *pass;	/* NULL to use -u/-p */
+	unsigned long		conn_seq;	/* ctx.job_seq when connecting */
+	time_t			up_since;	/* has a fresh job since, or 0 */
+	double			suggested_diff;	/* last mining.suggest_difficulty */
+	time_t			suggested;
+	unsigned long		suggested_accepted;
+
+	/* shares sent since the last clean job; guarded by share_lock */
+	uint64_t		seen[SHARE_SEEN];
+	int			seen_next;
+	unsigned long		seen_session, seen_clean;
+
+	/* --split; guarded by g_work_lock */
+	double			weight;
+	double			correction;	/* from the accepted work */
+	double			share;		/* of the miner threads */
+	struct work		work;
+	time_t			work_time;
+	/* guarded by stats_lock */
+	unsigned long		accepted, rejected;
+	double			accepted_diff;	/* since the last rebalance */
+	unsigned long		accepted_window;
+};
+
+static struct pool pools[MAX_POOLS];
 static bool submit_old = false;
 static char *lp_id;
 
@@ -342,6 +487,8 @@ static bool work_decode(const json_t *val, struct work *work)
 		work->data[i] = le32dec(work->data + i);
 	for (i = 0; i < ARRAY_SIZE(work->target); i++)
 		work->target[i] = le32dec(work->target + i);
+	work->odo_key = odo_key_at(swab32(work->data[17]));
+	work->ntime_max = 0;
 
 	return true;
 
@@ -349,10 +496,26 @@ err_out:
 	return false;
 }
 
+/* X-Roll-NTime: "N" forbids rolling, "expire=N" allows it for N seconds
+ * and anything else for the scan time */
+static void work_set_roll(struct work *work, const json_t *val)
+{
+	const char *s = json_string_value(json_object_get(val, "roll-ntime"));
+	int secs = 0;
+
+	if (s && strcasecmp(s, "N"))
+		secs = strncasecmp(s, "expire=", 7) ? opt_scantime : atoi(s + 7);
+	work->ntime_max = secs > 0 ? swab32(work->data[17]) + secs : 0;
+}
+
+static struct merkle_cache gbt_tree, gbt_wtree;	/* guarded by merkle_lock */
+static pthread_mutex_t merkle_lock;
+
 static bool gbt_work_decode(const json_t *val, struct work *work)
 {
 	int i, n;
 	uint32_t version, curtime, bits;
+	bool roll_time = false;
 	uint32_t prevhash[8];
 	uint32_t target[8];
 	int cbtx_size;
@@ -390,6 +553,8 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 				coinbase_append = true;
 			else if (!strcmp(s, "submit/coinbase"))
 				submit_coinbase = true;
+			else if (!strcmp(s, "time") || !strcmp(s, "time/increment"))
+				roll_time = true;
 		}
 	}
 
@@ -518,14 +683,15 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 				}
 				memrev(wtree[1+i], 32);
 			}
-			n = tx_count + 1;
-			while (n > 1) {
-				if (n % 2)
-					memcpy(wtree[n], wtree[n-1], 32);
-				n = (n + 1) / 2;
-				for (i = 0; i < n; i++)
-					sha256d(wtree[i], wtree[2*i], 64);
+			pthread_mutex_lock(&merkle_lock);
+			if (!merkle_update(&gbt_wtree, wtree + 1, tx_count)) {
+				pthread_mutex_unlock(&merkle_lock);
+				applog(LOG_ERR, "Out of memory for the merkle tree");
+				free(wtree);
+				goto out;
 			}
+			merkle_root(wtree[0], &gbt_wtree, wtree[0]);
+			pthread_mutex_unlock(&merkle_lock);
 			memset(wtree[1], 0, 32);  /* witness reserved value = 0 */
 			sha256d(cbtx+cbtx_size, wtree[0], 64);
 			cbtx_size += 32;
@@ -622,16 +788,14 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 		}
 	}
 	free(tx); tx = NULL;
-	n = 1 + tx_count;
-	while (n > 1) {
-		if (n % 2) {
-			memcpy(merkle_tree[n], merkle_tree[n-1], 32);
-			++n;
-		}
-		n /= 2;
-		for (i = 0; i < n; i++)
-			sha256d(merkle_tree[i], merkle_tree[2*i], 64);
+	pthread_mutex_lock(&merkle_lock);
+	if (!merkle_update(&gbt_tree, merkle_tree + 1, tx_count)) {
+		pthread_mutex_unlock(&merkle_lock);
+		applog(LOG_ERR, "Out of memory for the merkle tree");
+		goto out;
 	}
+	merkle_root(merkle_tree[0], &gbt_tree, merkle_tree[0]);
+	pthread_mutex_unlock(&merkle_lock);
 
 	/* assemble block header */
 	work->data[0] = swab32(version);
@@ -641,6 +805,13 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 		work->data[9 + i] = be32dec((uint32_t *)merkle_tree[0] + i);
 	work->data[17] = swab32(curtime);
 	work->data[18] = le32dec(&bits);
+	work->odo_key = odo_key_at(curtime);
+	work->ntime_max = 0;
+	if (roll_time) {
+		tmp = json_object_get(val, "maxtime");
+		work->ntime_max = json_is_integer(tmp) ? json_integer_value(tmp)
+		                                      : curtime + NTIME_ROLL;
+	}
 	memset(work->data + 19, 0x00, 52);
 	work->data[20] = 0x80000000;
 	work->data[31] = 0x00000280;
@@ -684,7 +855,17 @@ out:
 	return rc;
 }
 
-static void share_result(int result, const char *reason)
+static double tv_elapsed(const struct timeval *from, const struct timeval *to)
+{
+	return (to->tv_sec - from->tv_sec) + 1e-6 * (to->tv_usec - from->tv_usec);
+}
+
+static double ewma(double avg, double sample)
+{
+	return avg ? 0.8 * avg + 0.2 * sample : sample;
+}
+
+static void share_result(int result, const char *reason, double rtt)
 {
 	char s[345];
 	double hashrate;
@@ -692,65 +873,457 @@ static void share_result(int result, const char *reason)
 
 	hashrate = 0.;
 	pthread_mutex_lock(&stats_lock);
-	for (i = 0; i < opt_n_threads; i++)
+	for (i = 0; i < max_threads; i++)
 		hashrate += thr_hashrates[i];
 	result ? accepted_count++ : rejected_count++;
+	if (rtt >= 0) {
+		rtt_sum += rtt;
+		rtt_count++;
+	}
 	pthread_mutex_unlock(&stats_lock);
 	
 	sprintf(s, hashrate >= 1e6 ? "%.0f" : "%.2f", 1e-3 * hashrate);
-	applog(LOG_INFO, "accepted: %lu/%lu (%.2f%%), %s khash/s %s",
+	applog(LOG_INFO, "accepted: %lu/%lu (%.2f%%), %s khash/s, %.0f ms %s",
 		   accepted_count,
 		   accepted_count + rejected_count,
 		   100. * accepted_count / (accepted_count + rejected_count),
-		   s,
+		   s, 1e3 * rtt,
 		   result ? "(yay!!!)" : "(booooo)");
 
-	if (opt_debug && reason)
-		applog(LOG_DEBUG, "DEBUG: reject reason: %s", reason);
+	if (!result && reason)
+		applog(LOG_INFO, "reject reason: %s", reason);
+}
+
+/* Stratum shares waiting for a reply, indexed by request id */
+struct share_slot {
+	unsigned int		id;	/* 0 if free */
+	int			pool;
+	struct timeval		sent;
+	unsigned int		client;	/* proxy client, 0 for our own shares */
+	unsigned long		client_seq;
+	char			client_id[24];	/* the client's request id */
+	bool			buffered;	/* held during a reconnect */
+};
+
+/* Shares found while their pool was down, sent once it is back */
+struct held_share {
+	int			pool;
+	unsigned long		session;
+	uint32_t		prevhash[8];	/* as in work.data[1..8] */
+	time_t			found;
+	char			*params;
+};
+
+/* Share results on their way back to proxy clients */
+struct proxy_reply {
+	struct proxy_reply	*next;
+	unsigned int		client;
+	unsigned long		client_seq;
+	char			client_id[24];
+	bool			result;
+	char			reason[64];
+};
+
+static pthread_mutex_t proxy_lock;
+static struct proxy_reply *proxy_replies;
+static unsigned long proxy_accepted, proxy_rejected;	/* guarded by proxy_lock */
+static int proxy_wake[2] = { -1, -1 };
+static int proxy_count;	/* guarded by proxy_lock */
+
+/* Wakes the proxy thread to pick up a new job or share results */
+static void proxy_kick(void)
+{
+	if (proxy_wake[1] >= 0 && write(proxy_wake[1], "", 1) < 0 && opt_debug)
+		applog(LOG_DEBUG, "DEBUG: proxy wakeup failed (errno = %d)", errno);
 }
 
-static bool submit_upstream_work(CURL *curl, struct work *work)
+static void proxy_result(const struct share_slot *slot, bool result,
+	const char *reason)
 {
-	json_t *val, *res, *reason;
-	char data_str[2 * sizeof(work->data) + 1];
-	char s[345];
+	struct proxy_reply *r = calloc(1, sizeof(*r));
+	char *p;
+
+	if (!r)
+		return;
+	r->client = slot->client;
+	r->client_seq = slot->client_seq;
+	strcpy(r->client_id, slot->client_id);
+	r->result = result;
+	if (reason)
+		strncpy(r->reason, reason, sizeof(r->reason) - 1);
+	for (p = r->reason; *p; p++)
+		if (*p == '"' || *p == '\\' || (unsigned char)*p < ' ')
+			*p = '\'';
+
+	pthread_mutex_lock(&proxy_lock);
+	result ? proxy_accepted++ : proxy_rejected++;
+	r->next = proxy_replies;
+	proxy_replies = r;
+	pthread_mutex_unlock(&proxy_lock);
+	proxy_kick();
+}
+
+static struct share_slot inflight[MAX_INFLIGHT];
+static unsigned int next_share_id = SHARE_ID_BASE;
+static unsigned long lost_count;
+static struct held_share held[SHARE_BUFFER];
+static int held_count;
+static unsigned long held_accepted, held_dropped;	/* guarded by share_lock */
+static unsigned long dup_suppressed, stale_suppressed;	/* guarded by share_lock */
+
+/* Called with share_lock held */
+static void share_lost(struct share_slot *slot, const char *why)
+{
+	applog(LOG_WARNING, "share %u lost (%s)", slot->id, why);
+	if (slot->buffered)
+		held_dropped++;
+	if (slot->client)
+		proxy_result(slot, false, why);
+	else
+		lost_count++;
+	slot->id = 0;
+}
+
+/* Drops shares that have waited longer than SHARE_TIMEOUT, or with
+ * pool >= 0, all shares sent to that pool because its connection is gone. */
+static void expire_shares(int pool)
+{
+	struct timeval now;
 	int i;
-	bool rc = false;
 
-	/* pass if the previous hash is not the current previous hash */
-	if (!submit_old && memcmp(work->data + 1, g_work.data + 1, 32)) {
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&share_lock);
+	for (i = 0; i < MAX_INFLIGHT; i++) {
+		if (!inflight[i].id)
+			continue;
+		if (pool >= 0 && inflight[i].pool == pool)
+			share_lost(&inflight[i], "disconnected");
+		else if (pool >= 0)
+			continue;
+		else if (tv_elapsed(&inflight[i].sent, &now) > SHARE_TIMEOUT)
+			share_lost(&inflight[i], "timed out");
+	}
+	pthread_mutex_unlock(&share_lock);
+}
+
+/* Counts a reply to one of our own shares towards its pool; accepted
+ * shares weigh their difficulty, the pool's current one */
+static void pool_result(int id, bool result)
+{
+	struct pool *pool = &pools[id];
+	double diff;
+
+	pthread_mutex_lock(&pool->ctx.work_lock);
+	diff = pool->ctx.job.diff;
+	pthread_mutex_unlock(&pool->ctx.work_lock);
+	pthread_mutex_lock(&stats_lock);
+	if (result) {
+		pool->accepted++;
+		pool->accepted_diff += diff;
+		pool->accepted_window++;
+	} else
+		pool->rejected++;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* Matches a reply to a pending share; returns false for unknown ids */
+static bool share_reply(unsigned int id, bool result, const char *reason)
+{
+	struct share_slot *slot = &inflight[id % MAX_INFLIGHT];
+	struct timeval now;
+	unsigned int client;
+	int slot_pool;
+	double rtt;
+
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&share_lock);
+	if (!id || slot->id != id) {
+		pthread_mutex_unlock(&share_lock);
+		return false;
+	}
+	slot->id = 0;
+	rtt = tv_elapsed(&slot->sent, &now);
+	client = slot->client;
+	slot_pool = slot->pool;
+	if (client)
+		proxy_result(slot, result, reason);
+	if (slot->buffered)
+		result ? held_accepted++ : held_dropped++;
+	pthread_mutex_unlock(&share_lock);
+
+	if (!client) {
+		share_result(result, reason, rtt);
+		pool_result(slot_pool, result);
+	}
+	return true;
+}
+
+/* Sends mining.submit with the given params without waiting for the
+ * reply, which stratum_thread matches by id; from carries the proxy
+ * client the share came from, if any */
+static bool stratum_send_share(int pool_id, const char *params,
+	const struct share_slot *from)
+{
+	struct share_slot *slot;
+	unsigned int id;
+	char *req;
+	bool rc;
+
+	req = malloc(64 + strlen(params));
+	if (!req)
+		return false;
+
+	pthread_mutex_lock(&share_lock);
+	id = next_share_id++;
+	if (next_share_id < SHARE_ID_BASE)
+		next_share_id = SHARE_ID_BASE;
+	slot = &inflight[id % MAX_INFLIGHT];
+	if (slot->id)
+		share_lost(slot, "too many pending shares");
+	slot->id = id;
+	slot->pool = pool_id;
+	slot->client = from ? from->client : 0;
+	slot->buffered = from ? from->buffered : false;
+	if (from) {
+		slot->client_seq = from->client_seq;
+		strcpy(slot->client_id, from->client_id);
+	}
+	gettimeofday(&slot->sent, NULL);
+	pthread_mutex_unlock(&share_lock);
+
+	sprintf(req, "{\"method\": \"mining.submit\", \"params\": [%s], \"id\":%u}",
+		params, id);
+	rc = stratum_send_line(&pools[pool_id].ctx, req);
+	free(req);
+	if (unlikely(!rc)) {
+		applog(LOG_ERR, "stratum_submit stratum_send_line failed");
+		pthread_mutex_lock(&share_lock);
+		if (slot->id == id)
+			slot->id = 0;
+		pthread_mutex_unlock(&share_lock);
+	}
+	return rc;
+}
+
+/* Keeps a share found while its pool is down; takes over params */
+static bool share_hold(const struct work *work, char *params)
+{
+	struct held_share *h;
+
+	pthread_mutex_lock(&share_lock);
+	if (held_count == SHARE_BUFFER) {
+		free(held[0].params);
+		memmove(held, held + 1, --held_count * sizeof(*held));
+		held_dropped++;
+	}
+	h = &held[held_count++];
+	h->pool = work->pool;
+	h->session = work->session;
+	memcpy(h->prevhash, work->data + 1, sizeof(h->prevhash));
+	h->found = time(NULL);
+	h->params = params;
+	pthread_mutex_unlock(&share_lock);
+
+	applog(LOG_INFO, "holding share for job %s until %s is back",
+	       work->job_id, pools[work->pool].ctx.url);
+	return true;
+}
+
+/* Sends the shares held for a pool that are still valid on its current
+ * session and block, or with resend false, drops them all */
+static void share_release(struct pool *pool, bool resend)
+{
+	struct stratum_ctx *sctx = &pool->ctx;
+	struct share_slot from = { .buffered = true };
+	struct held_share h;
+	uint32_t prevhash[8];
+	unsigned long session;
+	time_t now = time(NULL);
+	int i, id = pool - pools, sent = 0, dropped = 0;
+	bool ok = true;
+
+	pthread_mutex_lock(&sctx->work_lock);
+	session = sctx->session_seq;
+	for (i = 0; i < 8; i++)
+		prevhash[i] = le32dec((uint32_t *)sctx->job.prevhash + i);
+	pthread_mutex_unlock(&sctx->work_lock);
+
+	pthread_mutex_lock(&share_lock);
+	for (i = 0; i < held_count; ) {
+		if (held[i].pool != id) {
+			i++;
+			continue;
+		}
+		h = held[i];
+		memmove(held + i, held + i + 1, (--held_count - i) * sizeof(*held));
+		if (resend && h.session == session && now - h.found < SHARE_BUFFER_AGE &&
+		    !memcmp(h.prevhash, prevhash, sizeof(prevhash))) {
+			pthread_mutex_unlock(&share_lock);
+			ok = stratum_send_share(id, h.params, &from);
+			pthread_mutex_lock(&share_lock);
+			/* the connection is gone again; keep this share and
+			 * the rest for the next one */
+			if (!ok && held_count < SHARE_BUFFER) {
+				held[held_count++] = h;
+				break;
+			}
+			if (ok)
+				sent++;
+			else {
+				held_dropped++;
+				dropped++;
+			}
+		} else {
+			held_dropped++;
+			dropped++;
+		}
+		free(h.params);
+		if (!ok)
+			break;
+	}
+	pthread_mutex_unlock(&share_lock);
+
+	if (sent || dropped)
+		applog(LOG_INFO, "%d held shares resent to %s, %d dropped as stale",
+		       sent, sctx->url, dropped);
+}
+
+/* FNV-1a over what makes a share unique within its job */
+static uint64_t share_key(const struct work *work)
+{
+	uint32_t v[3];
+	const unsigned char *p;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (p = (const unsigned char *)work->job_id; *p; p++)
+		h = (h ^ *p) * 0x100000001b3ULL;
+	for (i = 0; i < work->xnonce2_len; i++)
+		h = (h ^ work->xnonce2[i]) * 0x100000001b3ULL;
+	v[0] = work->data[17];
+	v[1] = work->data[19];
+	v[2] = work->data[0] & swab32(work->version_mask);
+	for (p = (const unsigned char *)v, i = 0; i < sizeof(v); i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h ? h : 1;
+}
+
+/* Drops a share whose job was superseded by a clean job or a new
+ * session, or that was already sent since the last clean job */
+static bool share_suppressed(const struct work *work)
+{
+	struct pool *pool = &pools[work->pool];
+	struct stratum_ctx *sctx = &pool->ctx;
+	unsigned long session, clean;
+	uint64_t key;
+	bool dup = false;
+	int i;
+
+	pthread_mutex_lock(&sctx->work_lock);
+	session = sctx->session_seq;
+	clean = sctx->clean_seq;
+	pthread_mutex_unlock(&sctx->work_lock);
+
+	if (work->session != session || work->clean_seq != clean) {
+		pthread_mutex_lock(&share_lock);
+		stale_suppressed++;
+		pthread_mutex_unlock(&share_lock);
+		if (opt_debug)
+			applog(LOG_DEBUG, "DEBUG: share for superseded job %s discarded",
+			       work->job_id);
+		return true;
+	}
+
+	key = share_key(work);
+	pthread_mutex_lock(&share_lock);
+	if (pool->seen_session != session || pool->seen_clean != clean) {
+		memset(pool->seen, 0, sizeof(pool->seen));
+		pool->seen_next = 0;
+		pool->seen_session = session;
+		pool->seen_clean = clean;
+	}
+	for (i = 0; i < SHARE_SEEN && !dup; i++)
+		dup = pool->seen[i] == key;
+	if (dup)
+		dup_suppressed++;
+	else
+		pool->seen[pool->seen_next++ % SHARE_SEEN] = key;
+	pthread_mutex_unlock(&share_lock);
+
+	if (dup)
+		applog(LOG_INFO, "duplicate share for job %s discarded", work->job_id);
+	return dup;
+}
+
+static bool stratum_submit(const struct work *work)
+{
+	struct pool *pool = &pools[work->pool];
+	const char *user = pool->user ? pool->user : rpc_user;
+	uint32_t ntime, nonce;
+	char ntimestr[9], noncestr[9], *xnonce2str, *params;
+	char versionstr[16] = "";
+	time_t up;
+
+	if (share_suppressed(work))
+		return true;
+
+	le32enc(&ntime, work->data[17]);
+	le32enc(&nonce, work->data[19]);
+	bin2hex(ntimestr, (const unsigned char *)(&ntime), 4);
+	bin2hex(noncestr, (const unsigned char *)(&nonce), 4);
+	xnonce2str = abin2hex(work->xnonce2, work->xnonce2_len);
+	if (work->version_mask)
+		sprintf(versionstr, ", \"%08x\"", swab32(work->data[0]) & work->version_mask);
+	params = malloc(128 + strlen(user) + strlen(work->job_id) + 2 * work->xnonce2_len);
+	sprintf(params, "\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"%s",
+		user, work->job_id, xnonce2str, ntimestr, noncestr, versionstr);
+	free(xnonce2str);
+
+	pthread_mutex_lock(&g_work_lock);
+	up = pool->up_since;
+	pthread_mutex_unlock(&g_work_lock);
+	if (!up || !stratum_send_share(work->pool, params, NULL))
+		return share_hold(work, params);
+	free(params);
+	return true;
+}
+
+/* pass if the previous hash is not the current previous hash */
+static bool work_is_stale(const struct work *work)
+{
+	const struct work *job = &g_work;
+
+	/* with --split, the work's own pool is the one to compare with */
+	if (opt_split && have_stratum && pools[work->pool].work_time)
+		job = &pools[work->pool].work;
+	if (!submit_old && memcmp(work->data + 1, job->data + 1, 32)) {
+		pthread_mutex_lock(&share_lock);
+		stale_suppressed++;
+		pthread_mutex_unlock(&share_lock);
 		if (opt_debug)
 			applog(LOG_DEBUG, "DEBUG: stale work detected, discarding");
 		return true;
 	}
+	return false;
+}
 
-	if (have_stratum) {
-		uint32_t ntime, nonce;
-		char ntimestr[9], noncestr[9], *xnonce2str, *req;
-
-		le32enc(&ntime, work->data[17]);
-		le32enc(&nonce, work->data[19]);
-		bin2hex(ntimestr, (const unsigned char *)(&ntime), 4);
-		bin2hex(noncestr, (const unsigned char *)(&nonce), 4);
-		xnonce2str = abin2hex(work->xnonce2, work->xnonce2_len);
-		req = malloc(256 + strlen(rpc_user) + strlen(work->job_id) + 2 * work->xnonce2_len);
-		sprintf(req,
-			"{\"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":4}",
-			rpc_user, work->job_id, xnonce2str, ntimestr, noncestr);
-		free(xnonce2str);
+/* Builds the JSON-RPC request that submits work, or returns NULL if the
+ * work is stale and not worth sending */
+static char *submit_upstream_req(struct work *work)
+{
+	json_t *val;
+	uint32_t data[ARRAY_SIZE(work->data)];
+	char data_str[2 * sizeof(work->data) + 1];
+	char *req;
+	int i;
 
-		rc = stratum_send_line(&stratum, req);
-		free(req);
-		if (unlikely(!rc)) {
-			applog(LOG_ERR, "submit_upstream_work stratum_send_line failed");
-			goto out;
-		}
-	} else if (work->txs) {
-		char *req;
+	if (work_is_stale(work))
+		return NULL;
 
-		for (i = 0; i < ARRAY_SIZE(work->data); i++)
-			be32enc(work->data + i, work->data[i]);
-		bin2hex(data_str, (unsigned char *)work->data, 80);
+	if (work->txs) {
+		for (i = 0; i < ARRAY_SIZE(data); i++)
+			be32enc(data + i, work->data[i]);
+		bin2hex(data_str, (unsigned char *)data, 80);
 		if (work->workid) {
 			char *params;
 			val = json_object();
@@ -768,61 +1341,49 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 				"{\"method\": \"submitblock\", \"params\": [\"%s%s\"], \"id\":1}\r\n",
 				data_str, work->txs);
 		}
-		val = json_rpc_call(curl, rpc_url, rpc_userpass, req, NULL, 0);
-		free(req);
-		if (unlikely(!val)) {
-			applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
-			goto out;
-		}
-
-		res = json_object_get(val, "result");
-		if (json_is_object(res)) {
-			char *res_str;
-			bool sumres = false;
-			void *iter = json_object_iter(res);
-			while (iter) {
-				if (json_is_null(json_object_iter_value(iter))) {
-					sumres = true;
-					break;
-				}
-				iter = json_object_iter_next(res, iter);
-			}
-			res_str = json_dumps(res, 0);
-			share_result(sumres, res_str);
-			free(res_str);
-		} else
-			share_result(json_is_null(res), json_string_value(res));
-
-		json_decref(val);
 	} else {
 		/* build hex string */
-		for (i = 0; i < ARRAY_SIZE(work->data); i++)
-			le32enc(work->data + i, work->data[i]);
-		bin2hex(data_str, (unsigned char *)work->data, sizeof(work->data));
+		for (i = 0; i < ARRAY_SIZE(data); i++)
+			le32enc(data + i, work->data[i]);
+		bin2hex(data_str, (unsigned char *)data, sizeof(data));
 
 		/* build JSON-RPC request */
-		sprintf(s,
+		req = malloc(128 + sizeof(data_str));
+		sprintf(req,
 			"{\"method\": \"getwork\", \"params\": [ \"%s\" ], \"id\":1}\r\n",
 			data_str);
+	}
+	return req;
+}
 
-		/* issue JSON-RPC request */
-		val = json_rpc_call(curl, rpc_url, rpc_userpass, s, NULL, 0);
-		if (unlikely(!val)) {
-			applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
-			goto out;
+/* Reports the server's verdict on submitted work */
+static void submit_upstream_result(const struct work *work, json_t *val,
+	double rtt)
+{
+	json_t *res, *reason;
+
+	res = json_object_get(val, "result");
+	if (work->txs && json_is_object(res)) {
+		char *res_str;
+		bool sumres = false;
+		void *iter = json_object_iter(res);
+		while (iter) {
+			if (json_is_null(json_object_iter_value(iter))) {
+				sumres = true;
+				break;
+			}
+			iter = json_object_iter_next(res, iter);
 		}
-
-		res = json_object_get(val, "result");
+		res_str = json_dumps(res, 0);
+		share_result(sumres, res_str, rtt);
+		free(res_str);
+	} else if (work->txs)
+		share_result(json_is_null(res), json_string_value(res), rtt);
+	else {
 		reason = json_object_get(val, "reject-reason");
-		share_result(json_is_true(res), reason ? json_string_value(reason) : NULL);
-
-		json_decref(val);
+		share_result(json_is_true(res), reason ? json_string_value(reason) : NULL,
+		             rtt);
 	}
-
-	rc = true;
-
-out:
-	return rc;
 }
 
 static const char *getwork_req =
@@ -838,55 +1399,51 @@ static const char *gbt_lp_req =
 	"{\"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": "
 	GBT_CAPABILITIES ", \"rules\": " GBT_RULES ", \"longpollid\": \"%s\"}], \"id\":0}\r\n";
 
-static bool get_upstream_work(CURL *curl, struct work *work)
+static const char *get_upstream_req(int *flags)
 {
-	json_t *val;
-	int err;
-	bool rc;
-	struct timeval tv_start, tv_end, diff;
+	*flags = have_gbt ? JSON_RPC_QUIET_404 : 0;
+	return have_gbt ? gbt_req : getwork_req;
+}
 
-start:
-	gettimeofday(&tv_start, NULL);
-	val = json_rpc_call(curl, rpc_url, rpc_userpass,
-			    have_gbt ? gbt_req : getwork_req,
-			    &err, have_gbt ? JSON_RPC_QUIET_404 : 0);
-	gettimeofday(&tv_end, NULL);
+/* Decodes the reply to get_upstream_req into work and releases it.
+ * Returns 1 on success, 0 on failure, or -1 if the request should be
+ * sent again, after falling back from getblocktemplate to getwork. */
+static int get_upstream_decode(json_t *val, int err, struct work *work)
+{
+	bool rc;
 
 	if (have_stratum) {
 		if (val)
 			json_decref(val);
-		return true;
+		return 1;
 	}
 
 	if (!have_gbt && !allow_getwork) {
 		applog(LOG_ERR, "No usable protocol");
 		if (val)
 			json_decref(val);
-		return false;
+		return 0;
 	}
 
 	if (have_gbt && allow_getwork && !val && err == CURLE_OK) {
 		applog(LOG_INFO, "getblocktemplate failed, falling back to getwork");
 		have_gbt = false;
-		goto start;
+		return -1;
 	}
 
 	if (!val)
-		return false;
+		return 0;
 
 	if (have_gbt) {
 		rc = gbt_work_decode(json_object_get(val, "result"), work);
 		if (!have_gbt) {
 			json_decref(val);
-			goto start;
+			return -1;
 		}
-	} else
+	} else {
 		rc = work_decode(json_object_get(val, "result"), work);
-
-	if (opt_debug && rc) {
-		timeval_subtract(&diff, &tv_end, &tv_start);
-		applog(LOG_DEBUG, "DEBUG: got new work in %d ms",
-		       diff.tv_sec * 1000 + diff.tv_usec / 1000);
+		if (rc)
+			work_set_roll(work, val);
 	}
 
 	json_decref(val);
@@ -912,118 +1469,450 @@ static void workio_cmd_free(struct workio_cmd *wc)
 	free(wc);
 }
 
-static bool workio_get_work(struct workio_cmd *wc, CURL *curl)
-{
-	struct work *ret_work;
-	int failures = 0;
-
-	ret_work = calloc(1, sizeof(*ret_work));
-	if (!ret_work)
-		return false;
-
-	/* obtain new work from bitcoin via JSON-RPC */
-	while (!get_upstream_work(curl, ret_work)) {
-		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
-			applog(LOG_ERR, "json_rpc_call failed, terminating workio thread");
-			free(ret_work);
-			return false;
-		}
+/* An HTTP request of the workio thread; the handle is idle while rpc is
+ * NULL and keeps its connection alive in between */
+struct workio_xfer {
+	CURL			*curl;
+	struct json_rpc_req	*rpc;
+	struct workio_cmd	*wc;	/* the submit, or NULL for a fetch */
+	char			*req;	/* owned by submits only */
+	unsigned long		gen;	/* work_gen when a fetch started */
+	struct timeval		start;
+};
 
-		/* pause, then restart work-request loop */
-		applog(LOG_ERR, "json_rpc_call failed, retry after %d seconds",
-			opt_fail_pause);
-		sleep(opt_fail_pause);
-	}
+struct workio_state {
+	struct workio_xfer	xfer[WORKIO_XFERS];
+	struct workio_cmd	*waiting;	/* get requests without work */
+	struct workio_cmd	*submits;	/* not sent yet, or to retry */
+	int			fetches;	/* in flight */
+	int			fetch_failures;
+	time_t			fetch_retry;	/* no fetch before this */
+	double			fetch_time;	/* average, in seconds */
+	struct work		*prefetched;
+	struct timeval		prefetched_at;
+	unsigned long		prefetched_gen;
+	struct timeval		prefetch_at;	/* fetch ahead then, if set */
+};
 
-	/* send work to requesting thread */
-	if (!tq_push(wc->thr->q, ret_work))
-		free(ret_work);
+static CURLM *workio_multi;
 
+/* Queues a command for the workio thread and wakes it up */
+static bool workio_push(struct workio_cmd *wc)
+{
+	if (!tq_push(thr_info[work_thr_id].q, wc))
+		return false;
+#if LIBCURL_VERSION_NUM >= 0x074400
+	curl_multi_wakeup(workio_multi);
+#endif
 	return true;
 }
 
-static bool workio_submit_work(struct workio_cmd *wc, CURL *curl)
+static void workio_quit(void)
 {
-	int failures = 0;
+	struct workio_cmd *wc = calloc(1, sizeof(*wc));
 
-	/* submit solution to bitcoin via JSON-RPC */
-	while (!submit_upstream_work(curl, wc->u.work)) {
-		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
-			applog(LOG_ERR, "...terminating workio thread");
-			return false;
-		}
-
-		/* pause, then restart work-request loop */
-		applog(LOG_ERR, "...retry after %d seconds",
-			opt_fail_pause);
-		sleep(opt_fail_pause);
+	if (wc) {
+		wc->cmd = WC_QUIT;
+		if (!workio_push(wc))
+			free(wc);
 	}
-
-	return true;
 }
 
-static void *workio_thread(void *userdata)
+static void workio_append(struct workio_cmd **list, struct workio_cmd *wc)
 {
-	struct thr_info *mythr = userdata;
-	CURL *curl;
-	bool ok = true;
-
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialization failed");
-		return NULL;
-	}
+	while (*list)
+		list = &(*list)->next;
+	wc->next = NULL;
+	*list = wc;
+}
 
-	while (ok) {
-		struct workio_cmd *wc;
+static int workio_count(const struct workio_cmd *wc)
+{
+	int n;
 
-		/* wait for workio_cmd sent to us, on our queue */
-		wc = tq_pop(mythr->q, NULL);
-		if (!wc) {
-			ok = false;
-			break;
-		}
+	for (n = 0; wc; wc = wc->next)
+		n++;
+	return n;
+}
 
-		/* process workio_cmd */
-		switch (wc->cmd) {
-		case WC_GET_WORK:
-			ok = workio_get_work(wc, curl);
-			break;
-		case WC_SUBMIT_WORK:
-			ok = workio_submit_work(wc, curl);
-			break;
+static double workio_scantime(void)
+{
+	return have_longpoll ? LP_SCANTIME : opt_scantime;
+}
 
-		default:		/* should never happen */
-			ok = false;
-			break;
-		}
+/* Answers a get request and plans to fetch the next work ahead of time,
+ * so that it is ready when the miners ask for it */
+static void workio_give(struct workio_state *io, struct workio_cmd *wc,
+	struct work *work)
+{
+	double lead = 2 * io->fetch_time + 1;
+	double ahead = workio_scantime() > lead ? workio_scantime() - lead : 0;
 
-		workio_cmd_free(wc);
+	if (!tq_push(wc->thr->q, work)) {
+		work_free(work);
+		free(work);
 	}
+	workio_cmd_free(wc);
+	gettimeofday(&io->prefetch_at, NULL);
+	io->prefetch_at.tv_sec += (time_t)ahead;
+	io->prefetch_at.tv_usec += (ahead - (time_t)ahead) * 1e6;
+	if (io->prefetch_at.tv_usec >= 1000000) {
+		io->prefetch_at.tv_sec++;
+		io->prefetch_at.tv_usec -= 1000000;
+	}
+}
 
-	tq_freeze(mythr->q);
-	curl_easy_cleanup(curl);
+/* Prefetched work is given out if long polling has not made it stale
+ * and miners would not refresh it yet */
+static struct work *workio_take_prefetched(struct workio_state *io)
+{
+	struct work *work = io->prefetched;
+	struct timeval now;
 
+	if (!work)
+		return NULL;
+	io->prefetched = NULL;
+	gettimeofday(&now, NULL);
+	if (io->prefetched_gen == work_gen &&
+	    tv_elapsed(&io->prefetched_at, &now) < workio_scantime())
+		return work;
+	work_free(work);
+	free(work);
 	return NULL;
 }
 
-static bool get_work(struct thr_info *thr, struct work *work)
+/* Returns false to stop the workio thread */
+static bool workio_command(struct workio_state *io, struct workio_cmd *wc)
 {
-	struct workio_cmd *wc;
-	struct work *work_heap;
+	struct work *work;
 
-	if (opt_benchmark) {
-		memset(work->data, 0x55, 76);
-		work->data[17] = swab32(time(NULL));
-		memset(work->data + 19, 0x00, 52);
-		work->data[20] = 0x80000000;
-		work->data[31] = 0x00000280;
-		memset(work->target, 0x00, sizeof(work->target));
+	switch (wc->cmd) {
+	case WC_GET_WORK:
+		work = workio_take_prefetched(io);
+		if (work)
+			workio_give(io, wc, work);
+		else
+			workio_append(&io->waiting, wc);
 		return true;
-	}
-
-	/* fill out work request message */
-	wc = calloc(1, sizeof(*wc));
+	case WC_SUBMIT_WORK:
+		wc->retry_at = 0;
+		workio_append(&io->submits, wc);
+		return true;
+	default:
+		workio_cmd_free(wc);
+		return false;
+	}
+}
+
+static struct workio_xfer *workio_idle(struct workio_state *io)
+{
+	int i;
+
+	for (i = 0; i < WORKIO_XFERS; i++)
+		if (!io->xfer[i].rpc)
+			return &io->xfer[i];
+	return NULL;
+}
+
+static bool workio_send(struct workio_xfer *x, struct workio_cmd *wc,
+	const char *req, int flags)
+{
+	x->rpc = json_rpc_begin(x->curl, rpc_url, rpc_userpass, req, flags);
+	if (!x->rpc)
+		return false;
+	x->wc = wc;
+	x->req = wc ? (char *)req : NULL;
+	x->gen = work_gen;
+	gettimeofday(&x->start, NULL);
+	curl_multi_add_handle(workio_multi, x->curl);
+	return true;
+}
+
+/* Starts the submits and fetches that are due, as far as handles allow.
+ * Each submit gets its own handle, so a slow one holds up neither the
+ * others nor the next work; one handle is always left for fetching. */
+static void workio_start(struct workio_state *io)
+{
+	struct workio_cmd **p = &io->submits, *wc;
+	struct workio_xfer *x;
+	struct timeval now;
+	time_t t = time(NULL);
+	const char *req;
+	int i, need, flags, submitting = 0;
+
+	for (i = 0; i < WORKIO_XFERS; i++)
+		if (io->xfer[i].wc)
+			submitting++;
+	while ((wc = *p) && submitting < WORKIO_XFERS - 1) {
+		if (wc->retry_at > t) {
+			p = &wc->next;
+			continue;
+		}
+		x = workio_idle(io);
+		if (!x)
+			break;
+		*p = wc->next;
+		req = submit_upstream_req(wc->u.work);
+		if (!req) {
+			workio_cmd_free(wc);
+			continue;
+		}
+		if (workio_send(x, wc, req, 0))
+			submitting++;
+		else {
+			free((char *)req);
+			workio_cmd_free(wc);
+		}
+	}
+
+	gettimeofday(&now, NULL);
+	need = workio_count(io->waiting) - io->fetches;
+	if (need <= 0 && !io->fetches && !io->prefetched && io->prefetch_at.tv_sec &&
+	    tv_elapsed(&io->prefetch_at, &now) >= 0) {
+		need = 1;
+		io->prefetch_at.tv_sec = 0;
+	}
+	for (; need > 0 && t >= io->fetch_retry && (x = workio_idle(io)); need--) {
+		req = get_upstream_req(&flags);
+		if (!workio_send(x, NULL, req, flags))
+			break;
+		io->fetches++;
+	}
+}
+
+/* Handles a finished request; returns false to stop the workio thread */
+static bool workio_done(struct workio_state *io, CURL *curl, CURLcode result)
+{
+	struct workio_xfer *x;
+	struct workio_cmd *wc;
+	struct work *work;
+	struct timeval now;
+	json_t *val;
+	double t;
+	int i, err, rc;
+
+	for (i = 0; i < WORKIO_XFERS && io->xfer[i].curl != curl; i++);
+	if (i == WORKIO_XFERS)
+		return true;
+	x = &io->xfer[i];
+	curl_multi_remove_handle(workio_multi, curl);
+	val = json_rpc_end(x->rpc, result, &err);
+	x->rpc = NULL;
+	gettimeofday(&now, NULL);
+	t = tv_elapsed(&x->start, &now);
+
+	wc = x->wc;
+	if (wc) {
+		free(x->req);
+		x->wc = NULL;
+		x->req = NULL;
+		if (val) {
+			submit_upstream_result(wc->u.work, val, t);
+			json_decref(val);
+			workio_cmd_free(wc);
+			return true;
+		}
+		applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
+		if (unlikely((opt_retries >= 0) && (++wc->failures > opt_retries))) {
+			applog(LOG_ERR, "...terminating workio thread");
+			workio_cmd_free(wc);
+			return false;
+		}
+		applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
+		wc->retry_at = time(NULL) + opt_fail_pause;
+		workio_append(&io->submits, wc);
+		return true;
+	}
+
+	io->fetches--;
+	work = calloc(1, sizeof(*work));
+	if (!work) {
+		if (val)
+			json_decref(val);
+		return false;
+	}
+	rc = get_upstream_decode(val, err, work);
+	if (rc <= 0) {
+		free(work);
+		if (rc < 0) {
+			gettimeofday(&io->prefetch_at, NULL);
+			return true;
+		}
+		if (unlikely((opt_retries >= 0) && (++io->fetch_failures > opt_retries))) {
+			applog(LOG_ERR, "json_rpc_call failed, terminating workio thread");
+			return false;
+		}
+		applog(LOG_ERR, "json_rpc_call failed, retry after %d seconds",
+			opt_fail_pause);
+		io->fetch_retry = time(NULL) + opt_fail_pause;
+		return true;
+	}
+
+	io->fetch_failures = 0;
+	io->fetch_time = ewma(io->fetch_time, t);
+	if (opt_debug)
+		applog(LOG_DEBUG, "DEBUG: got new work in %.0f ms", 1e3 * t);
+	if (io->waiting) {
+		wc = io->waiting;
+		io->waiting = wc->next;
+		workio_give(io, wc, work);
+	} else {
+		if (io->prefetched) {
+			work_free(io->prefetched);
+			free(io->prefetched);
+		}
+		io->prefetched = work;
+		io->prefetched_at = now;
+		io->prefetched_gen = x->gen;
+	}
+	return true;
+}
+
+/* Milliseconds until a retry or prefetch is due, at most a second */
+static int workio_timeout(const struct workio_state *io)
+{
+	struct timeval now;
+	const struct workio_cmd *wc;
+	double t = 1.;
+
+	gettimeofday(&now, NULL);
+	for (wc = io->submits; wc; wc = wc->next)
+		if (wc->retry_at - now.tv_sec < t)
+			t = wc->retry_at - now.tv_sec;
+	if (io->waiting && io->fetch_retry - now.tv_sec < t)
+		t = io->fetch_retry - now.tv_sec;
+	if (io->prefetch_at.tv_sec && -tv_elapsed(&io->prefetch_at, &now) < t)
+		t = -tv_elapsed(&io->prefetch_at, &now);
+	return t > 0 ? 1e3 * t : 0;
+}
+
+/* Waits for network activity, or with curl_multi_wakeup for a command */
+static void workio_wait(int timeout_ms)
+{
+#if LIBCURL_VERSION_NUM >= 0x074400
+	curl_multi_poll(workio_multi, NULL, 0, timeout_ms, NULL);
+#else
+	if (timeout_ms > WORKIO_POLL)
+		timeout_ms = WORKIO_POLL;
+#if LIBCURL_VERSION_NUM >= 0x071c00
+	curl_multi_wait(workio_multi, NULL, 0, timeout_ms, NULL);
+#else
+	{
+		fd_set rfds, wfds, efds;
+		struct timeval tv = { 0, 1000 * timeout_ms };
+		int maxfd = -1;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		curl_multi_fdset(workio_multi, &rfds, &wfds, &efds, &maxfd);
+		select(maxfd + 1, &rfds, &wfds, &efds, &tv);
+	}
+#endif
+#endif
+}
+
+/* Runs all getwork/GBT requests on one curl multi handle: submits and
+ * fetches proceed concurrently on persistent connections, and the next
+ * work is fetched before miners ask for it. */
+static void *workio_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+	struct workio_state io = {{{0}}};
+	struct workio_cmd *wc;
+	struct timespec abstime;
+	struct timeval now;
+	CURLMsg *msg;
+	int i, left, running = 0, timeout;
+	bool ok = true, done;
+
+	for (i = 0; i < WORKIO_XFERS; i++) {
+		io.xfer[i].curl = curl_easy_init();
+		if (unlikely(!io.xfer[i].curl)) {
+			applog(LOG_ERR, "CURL initialization failed");
+			ok = false;
+		}
+	}
+
+	while (ok) {
+		workio_start(&io);
+		curl_multi_perform(workio_multi, &running);
+		done = false;
+		while ((msg = curl_multi_info_read(workio_multi, &left))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			ok = workio_done(&io, msg->easy_handle, msg->data.result) && ok;
+			done = true;
+		}
+		if (!ok)
+			break;
+		timeout = done ? 0 : workio_timeout(&io);
+		if (running && timeout)
+			workio_wait(timeout);
+
+		/* wait on the queue itself only with nothing in flight */
+		gettimeofday(&now, NULL);
+		if (!running) {
+			now.tv_sec += timeout / 1000;
+			now.tv_usec += timeout % 1000 * 1000;
+		}
+		abstime.tv_sec = now.tv_sec + now.tv_usec / 1000000;
+		abstime.tv_nsec = now.tv_usec % 1000000 * 1000;
+		while (ok && (wc = tq_pop(mythr->q, &abstime))) {
+			ok = workio_command(&io, wc);
+			abstime.tv_sec = 0;
+		}
+	}
+
+	tq_freeze(mythr->q);
+	for (i = 0; i < WORKIO_XFERS; i++) {
+		if (io.xfer[i].rpc) {
+			curl_multi_remove_handle(workio_multi, io.xfer[i].curl);
+			json_rpc_end(io.xfer[i].rpc, CURLE_ABORTED_BY_CALLBACK, NULL);
+			free(io.xfer[i].req);
+			workio_cmd_free(io.xfer[i].wc);
+		}
+		if (io.xfer[i].curl)
+			curl_easy_cleanup(io.xfer[i].curl);
+	}
+	while ((wc = io.submits)) {
+		io.submits = wc->next;
+		workio_cmd_free(wc);
+	}
+	while ((wc = io.waiting)) {
+		io.waiting = wc->next;
+		workio_cmd_free(wc);
+	}
+	if (io.prefetched) {
+		work_free(io.prefetched);
+		free(io.prefetched);
+	}
+
+	return NULL;
+}
+
+static void benchmark_work(uint32_t *data, uint32_t *target)
+{
+	memset(data, 0x55, 76);
+	data[17] = swab32(time(NULL));
+	memset(data + 19, 0x00, 52);
+	data[20] = 0x80000000;
+	data[31] = 0x00000280;
+	memset(target, 0x00, 32);
+}
+
+static bool get_work(struct thr_info *thr, struct work *work)
+{
+	struct workio_cmd *wc;
+	struct work *work_heap;
+
+	if (opt_benchmark) {
+		benchmark_work(work->data, work->target);
+		return true;
+	}
+
+	/* fill out work request message */
+	wc = calloc(1, sizeof(*wc));
 	if (!wc)
 		return false;
 
@@ -1031,7 +1920,7 @@ static bool get_work(struct thr_info *thr, struct work *work)
 	wc->thr = thr;
 
 	/* send work request to workio thread */
-	if (!tq_push(thr_info[work_thr_id].q, wc)) {
+	if (!workio_push(wc)) {
 		workio_cmd_free(wc);
 		return false;
 	}
@@ -1052,6 +1941,10 @@ static bool submit_work(struct thr_info *thr, const struct work *work_in)
 {
 	struct workio_cmd *wc;
 	
+	/* stratum shares go out directly; the reply is handled asynchronously */
+	if (have_stratum)
+		return work_is_stale(work_in) || stratum_submit(work_in);
+
 	/* fill out work request message */
 	wc = calloc(1, sizeof(*wc));
 	if (!wc)
@@ -1066,7 +1959,7 @@ static bool submit_work(struct thr_info *thr, const struct work *work_in)
 	work_copy(wc->u.work, work_in);
 
 	/* send solution to workio thread */
-	if (!tq_push(thr_info[work_thr_id].q, wc))
+	if (!workio_push(wc))
 		goto err_out;
 
 	return true;
@@ -1076,37 +1969,78 @@ err_out:
 	return false;
 }
 
-static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
+/* Called with work_lock held.  Computes the Merkle roots for the next
+ * STRATUM_ROOTS extranonce2 values together, hashing only the coinbase
+ * tail after the precomputed midstate. */
+static void stratum_gen_roots(struct stratum_job *job, int xnonce2_fixed,
+	int xnonce2_size)
 {
+	size_t tail_len = job->coinbase_size - job->cb_prefix;
+	size_t x2 = job->xnonce2 - job->coinbase - job->cb_prefix;
+	unsigned char nodes[STRATUM_ROOTS * 64];
+	unsigned char *tails, *t;
+	int i, k;
+
+	tails = malloc(STRATUM_ROOTS * tail_len);
+	memcpy(tails, job->coinbase + job->cb_prefix, tail_len);
+	for (k = 1; k < STRATUM_ROOTS; k++) {
+		t = tails + k * tail_len;
+		memcpy(t, t - tail_len, tail_len);
+		for (i = xnonce2_fixed; i < xnonce2_size && !++t[x2 + i]; i++);
+	}
+	sha256d_lanes(job->roots[0], job->cb_midstate, job->cb_prefix,
+	              tails, tail_len, STRATUM_ROOTS);
+	free(tails);
+
+	for (i = 0; i < job->merkle_count; i++) {
+		for (k = 0; k < STRATUM_ROOTS; k++) {
+			memcpy(nodes + 64 * k, job->roots[k], 32);
+			memcpy(nodes + 64 * k + 32, job->merkle[i], 32);
+		}
+		sha256d_lanes(job->roots[0], NULL, 0, nodes, 64, STRATUM_ROOTS);
+	}
+
+	job->roots_next = 0;
+	job->roots_ready = STRATUM_ROOTS;
+}
+
+static void stratum_gen_work(struct pool *pool, struct work *work)
+{
+	struct stratum_ctx *sctx = &pool->ctx;
 	unsigned char merkle_root[64];
 	int i;
 
 	pthread_mutex_lock(&sctx->work_lock);
 
+	work->pool = pool - pools;
+	work->session = sctx->session_seq;
+	work->clean_seq = sctx->clean_seq;
+	work->odo_key = sctx->job.odo_key;
 	free(work->job_id);
 	work->job_id = strdup(sctx->job.job_id);
 	work->xnonce2_len = sctx->xnonce2_size;
 	work->xnonce2 = realloc(work->xnonce2, sctx->xnonce2_size);
 	memcpy(work->xnonce2, sctx->job.xnonce2, sctx->xnonce2_size);
 
-	/* Generate merkle root */
-	sha256d(merkle_root, sctx->job.coinbase, sctx->job.coinbase_size);
-	for (i = 0; i < sctx->job.merkle_count; i++) {
-		memcpy(merkle_root + 32, sctx->job.merkle[i], 32);
-		sha256d(merkle_root, merkle_root, 64);
-	}
-	
-	/* Increment extranonce2 */
-	for (i = 0; i < sctx->xnonce2_size && !++sctx->job.xnonce2[i]; i++);
+	/* Take the merkle root for this extranonce2 */
+	if (sctx->job.roots_next == sctx->job.roots_ready)
+		stratum_gen_roots(&sctx->job, sctx->xnonce2_fixed, sctx->xnonce2_size);
+	memcpy(merkle_root, sctx->job.roots[sctx->job.roots_next++], 32);
+
+
+	/* Increment extranonce2, leaving the part handed to proxy clients */
+	for (i = sctx->xnonce2_fixed; i < sctx->xnonce2_size && !++sctx->job.xnonce2[i]; i++);
 
 	/* Assemble block header */
 	memset(work->data, 0, 128);
 	work->data[0] = le32dec(sctx->job.version);
+	work->version_mask = sctx->version_mask;
 	for (i = 0; i < 8; i++)
 		work->data[1 + i] = le32dec((uint32_t *)sctx->job.prevhash + i);
 	for (i = 0; i < 8; i++)
 		work->data[9 + i] = be32dec((uint32_t *)merkle_root + i);
 	work->data[17] = le32dec(sctx->job.ntime);
+	work->ntime_max = be32dec(sctx->job.ntime) + NTIME_ROLL;
 	work->data[18] = le32dec(sctx->job.nbits);
 	work->data[20] = 0x80000000;
 	work->data[31] = 0x00000280;
@@ -1128,14 +2062,218 @@ static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
 	
 }
 
+static void record_restart_latency(int thr_id)
+{
+	struct timeval now, tv, diff;
+	double ms;
+	int i;
+
+	gettimeofday(&now, NULL);
+	tv = work_restart[thr_id].tv;
+	timeval_subtract(&diff, &now, &tv);
+	ms = 1e3 * diff.tv_sec + 1e-3 * diff.tv_usec;
+	for (i = 0; i < ARRAY_SIZE(restart_buckets) && ms > restart_buckets[i]; i++);
+
+	pthread_mutex_lock(&stats_lock);
+	restart_hist[i]++;
+	if (ms > restart_max)
+		restart_max = ms;
+	pthread_mutex_unlock(&stats_lock);
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "DEBUG: thread %d switched %.1f ms after restart",
+		       thr_id, ms);
+}
+
+#define RESTART_HIST_LEN	(32 * (ARRAY_SIZE(restart_buckets) + 2))
+
+static void format_restart_latency(char *s)
+{
+	int i, len;
+
+	len = sprintf(s, "restart latency (ms):");
+	pthread_mutex_lock(&stats_lock);
+	for (i = 0; i < ARRAY_SIZE(restart_buckets); i++)
+		len += sprintf(s + len, " <=%g:%lu", restart_buckets[i], restart_hist[i]);
+	len += sprintf(s + len, " >%g:%lu", restart_buckets[i - 1], restart_hist[i]);
+	sprintf(s + len, ", max %.1f", restart_max);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void show_restart_latency(void)
+{
+	char s[RESTART_HIST_LEN];
+
+	format_restart_latency(s);
+	applog(LOG_INFO, "%s", s);
+}
+
+/* Park miner thread thr_id while it is beyond the active thread count,
+ * and rebind it after a layout change.  Returns true if the layout has
+ * changed since the thread last looked, i.e. its nonce range moved. */
+static bool thread_layout(int thr_id, unsigned long *gen, int *n_active)
+{
+	bool parked = false, moved = false;
+	int cpu = -1;
+
+	pthread_mutex_lock(&thr_lock);
+	while (thr_id >= active_threads) {
+		if (!parked) {
+			parked = true;
+			pthread_mutex_lock(&stats_lock);
+			thr_hashrates[thr_id] = 0.;
+			pthread_mutex_unlock(&stats_lock);
+			if (!opt_quiet)
+				applog(LOG_INFO, "thread %d parked", thr_id);
+		}
+		pthread_cond_wait(&thr_cond, &thr_lock);
+	}
+	if (parked)
+		work_restart[thr_id].restart = 0;
+	if (*gen != layout_gen) {
+		*gen = layout_gen;
+		cpu = thr_cpu[thr_id];
+		moved = true;
+	}
+	*n_active = active_threads;
+	pthread_mutex_unlock(&thr_lock);
+
+	if (parked && !opt_quiet)
+		applog(LOG_INFO, "thread %d resumed", thr_id);
+	if (cpu >= 0) {
+		if (!opt_quiet)
+			applog(LOG_INFO, "Binding thread %d to cpu %d", thr_id, cpu);
+		affine_to_cpu(thr_id, cpu);
+	}
+	return moved;
+}
+
+/* True if the two only differ in locally rolled version bits or ntime */
+static bool work_same_job(const struct work *a, const struct work *b)
+{
+	return a->pool == b->pool &&
+	       !((a->data[0] ^ b->data[0]) & ~swab32(a->version_mask)) &&
+	       !memcmp(a->data + 1, b->data + 1, 64) && a->data[18] == b->data[18];
+}
+
+/* Steps the version bits the pool lets us roll (BIP 310) */
+static bool work_roll_version(struct work *work)
+{
+	uint32_t mask = work->version_mask;
+	uint32_t version = swab32(work->data[0]);
+	uint32_t bits = ((version | ~mask) + 1) & mask;
+
+	if (!bits)
+		return false;
+	work->data[0] = swab32((version & ~mask) | bits);
+	return true;
+}
+
+/* Rolls ntime forward by a second within the server's limit, but never
+ * into the next Odo epoch, whose key the work was not built for */
+static bool work_roll_ntime(struct work *work)
+{
+	uint32_t ntime = swab32(work->data[17]);
+
+	if (ntime >= work->ntime_max)
+		return false;
+	if (opt_algo == ALGO_ODO && odo_key_at(ntime + 1) != odo_key_at(ntime))
+		return false;
+	work->data[17] = swab32(ntime + 1);
+	return true;
+}
+
+/* Extends an exhausted nonce range of job: version bits first, then
+ * ntime, which starts the version bits over */
+static bool work_roll(struct work *work, const struct work *job)
+{
+	if (work_roll_version(work))
+		return true;
+	if (!work_roll_ntime(work))
+		return false;
+	work->data[0] = job->data[0];
+	return true;
+}
+
+/* Divides n miner threads between the pools by their --split share,
+ * giving every pool with a share at least one thread while there are
+ * enough; false if no pool has a share.  Called with g_work_lock held. */
+static bool split_counts(int n, int *count)
+{
+	double rem[MAX_POOLS], total = 0.;
+	int i, j, k, left = n;
+
+	for (i = 0; i < pool_count; i++)
+		total += pools[i].share;
+	if (total <= 0)
+		return false;
+	for (i = 0; i < pool_count; i++) {
+		count[i] = n * pools[i].share / total;
+		rem[i] = n * pools[i].share / total - count[i];
+		left -= count[i];
+	}
+	for (; left > 0; left--) {
+		for (i = j = 0; i < pool_count; i++)
+			if (rem[i] > rem[j])
+				j = i;
+		count[j]++;
+		rem[j] = -1.;
+	}
+	for (i = 0; i < pool_count; i++) {
+		if (count[i] || pools[i].share <= 0)
+			continue;
+		for (j = 0, k = 1; k < pool_count; k++)
+			if (count[k] > count[j])
+				j = k;
+		if (count[j] > 1) {
+			count[j]--;
+			count[i]++;
+		}
+	}
+	return true;
+}
+
+/* The pool whose job thread thr_id works on with --split, or -1 */
+static int split_pool(int thr_id, int n_active)
+{
+	int count[MAX_POOLS], i;
+
+	if (!opt_split || !split_counts(n_active, count))
+		return -1;
+	for (i = 0; i < pool_count; i++) {
+		if (thr_id < count[i])
+			return i;
+		thr_id -= count[i];
+	}
+	return -1;
+}
+
+/* Returns the job a miner thread should work on and when it arrived:
+ * that of its own pool with --split, else the active pool's.
+ * Called with g_work_lock held. */
+static struct work *thread_job(int thr_id, int n_active, time_t *since)
+{
+	int i = split_pool(thr_id, n_active);
+
+	if (i < 0 || !pools[i].work_time) {
+		*since = g_work_time;
+		return &g_work;
+	}
+	*since = pools[i].work_time;
+	return &pools[i].work;
+}
+
 static void *miner_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
 	int thr_id = mythr->id;
 	struct work work = {{0}};
 	uint32_t max_nonce;
-	uint32_t end_nonce = 0xffffffffU / opt_n_threads * (thr_id + 1) - 0x20;
+	uint32_t end_nonce;
+	unsigned long layout = 0;
+	int n_active;
 	unsigned char *scratchbuf = NULL;
+	struct odo_ctx *odo = NULL;
 	char s[16];
 	int i;
 	//char *tP;
@@ -1148,15 +2286,6 @@ static void *miner_thread(void *userdata)
 		drop_policy();
 	}
 
-	/* Cpu affinity only makes sense if the number of threads is a multiple
-	 * of the number of CPUs */
-	if (num_processors > 1 && opt_n_threads % num_processors == 0) {
-		if (!opt_quiet)
-			applog(LOG_INFO, "Binding thread %d to cpu %d",
-			       thr_id, thr_id % num_processors);
-		affine_to_cpu(thr_id, thr_id % num_processors);
-	}
-	
 	if (opt_algo == ALGO_SCRYPT) {
 		scratchbuf = scrypt_buffer_alloc(opt_scrypt_n);
 		if (!scratchbuf) {
@@ -1165,24 +2294,52 @@ static void *miner_thread(void *userdata)
 			exit(1);
 		}
 	}
+	if (opt_algo == ALGO_ODO) {
+		odo = malloc(sizeof(*odo));
+		if (!odo) {
+			applog(LOG_ERR, "Odo context allocation failed");
+			pthread_mutex_lock(&applog_lock);
+			exit(1);
+		}
+		odo_ctx_init(odo, 0);
+	}
 
 	while (1) {
 		unsigned long hashes_done;
 		struct timeval tv_start, tv_end, diff;
+		struct work *job = &g_work;
 		int64_t max64;
+		bool rolled;
+		bool moved;
 		int rc;
 
+		moved = thread_layout(thr_id, &layout, &n_active);
+		end_nonce = 0xffffffffU / n_active * (thr_id + 1) - 0x20;
+
 		if (have_stratum) {
-			while (time(NULL) >= g_work_time + 120)
-				sleep(1);
+			time_t since;
 			pthread_mutex_lock(&g_work_lock);
-			if (work.data[19] >= end_nonce && !memcmp(work.data, g_work.data, 76))
-				stratum_gen_work(&stratum, &g_work);
+			job = thread_job(thr_id, n_active, &since);
+			while (time(NULL) >= since + 120) {
+				pthread_mutex_unlock(&g_work_lock);
+				sleep(1);
+				pthread_mutex_lock(&g_work_lock);
+				job = thread_job(thr_id, n_active, &since);
+			}
+			/* an exhausted range is extended by rolling before
+			 * falling back to a new extranonce2 */
+			rolled = !moved && work.data[19] >= end_nonce &&
+			         work_same_job(&work, job) && work_roll(&work, job);
+			if (!rolled && (moved || work.data[19] >= end_nonce) &&
+			    work_same_job(&work, job))
+				stratum_gen_work(&pools[job->pool], job);
 		} else {
 			int min_scantime = have_longpoll ? LP_SCANTIME : opt_scantime;
 			/* obtain new work from internal workio thread */
 			pthread_mutex_lock(&g_work_lock);
-			if (!have_stratum &&
+			rolled = !moved && work.data[19] >= end_nonce &&
+			         work_same_job(&work, &g_work) && work_roll(&work, &g_work);
+			if (!have_stratum && !rolled &&
 			    (time(NULL) - g_work_time >= min_scantime ||
 			     work.data[19] >= end_nonce)) {
 				work_free(&g_work);
@@ -1199,14 +2356,22 @@ static void *miner_thread(void *userdata)
 				continue;
 			}
 		}
-		if (memcmp(work.data, g_work.data, 76)) {
+		if (moved || !work_same_job(&work, job)) {
 			work_free(&work);
-			work_copy(&work, &g_work);
-			work.data[19] = 0xffffffffU / opt_n_threads * thr_id;
+			work_copy(&work, job);
+			work.data[19] = 0xffffffffU / n_active * thr_id;
+		} else if (rolled) {
+			work.data[19] = 0xffffffffU / n_active * thr_id;
+			if (opt_debug)
+				applog(LOG_DEBUG, "DEBUG: thread %d rolled version %08x ntime %08x",
+				       thr_id, swab32(work.data[0]), swab32(work.data[17]));
 		} else
 			work.data[19]++;
 		pthread_mutex_unlock(&g_work_lock);
-		work_restart[thr_id].restart = 0;
+		if (work_restart[thr_id].restart) {
+			work_restart[thr_id].restart = 0;
+			record_restart_latency(thr_id);
+		}
 		
 		/* adjust max_nonce to meet target scan time */
 		if (have_stratum)
@@ -1224,7 +2389,8 @@ static void *miner_thread(void *userdata)
 				max64 = 0x1fffff;
 				break;
 			case ALGO_ODO:
-				max64 = 0x1fffff;
+				/* a short probe; the measured rate sizes the rest */
+				max64 = 0xff;
 				break;
 			}
 		}
@@ -1232,6 +2398,12 @@ static void *miner_thread(void *userdata)
 			max_nonce = end_nonce;
 		else
 			max_nonce = work.data[19] + max64;
+
+		/* batched kernels check for restarts once per batch; size it
+		 * so that a batch takes no longer than the latency budget */
+		max64 = thr_hashrates[thr_id] * opt_restart_latency / 1000;
+		work_restart[thr_id].batch = max64 < 1 ? 1 :
+		                             max64 > 0x10000 ? 0x10000 : max64;
 		
 		hashes_done = 0;
 		gettimeofday(&tv_start, NULL);
@@ -1252,8 +2424,14 @@ static void *miner_thread(void *userdata)
 			applog(LOG_INFO, "work.data:%s",tP);
 			free(tP);*/
 			
-			rc = scanhash_odo(thr_id, work.data, work.target,
-			                      max_nonce, &hashes_done,g_odo_key);
+			if (work.odo_key != odo->key) {
+				if (opt_debug)
+					applog(LOG_DEBUG, "DEBUG: thread %d: building Odo context for key %u",
+					       thr_id, work.odo_key);
+				odo_ctx_init(odo, work.odo_key);
+			}
+			rc = odo_engines[opt_odo_engine].scanhash(thr_id, work.data,
+			                      work.target, max_nonce, &hashes_done, odo);
 			break;
 
 		default:
@@ -1276,11 +2454,11 @@ static void *miner_thread(void *userdata)
 			applog(LOG_INFO, "thread %d: %lu hashes, %s khash/s",
 				thr_id, hashes_done, s);
 		}
-		if (opt_benchmark && thr_id == opt_n_threads - 1) {
+		if (opt_benchmark && thr_id == n_active - 1) {
 			double hashrate = 0.;
-			for (i = 0; i < opt_n_threads && thr_hashrates[i]; i++)
+			for (i = 0; i < n_active && thr_hashrates[i]; i++)
 				hashrate += thr_hashrates[i];
-			if (i == opt_n_threads) {
+			if (i == n_active) {
 				sprintf(s, hashrate >= 1e6 ? "%.0f" : "%.2f", 1e-3 * hashrate);
 				applog(LOG_INFO, "Total: %s khash/s", s);
 			}
@@ -1293,42 +2471,157 @@ static void *miner_thread(void *userdata)
 
 out:
 	tq_freeze(mythr->q);
+	free(odo);
 
 	return NULL;
 }
 
-static void restart_threads(void)
+static void restart_thread_range(int first, int n)
 {
+	struct timeval now;
 	int i;
 
-	for (i = 0; i < opt_n_threads; i++)
+	gettimeofday(&now, NULL);
+	for (i = first; i < first + n && i < max_threads; i++) {
+		if (work_restart[i].restart)
+			continue;
+		work_restart[i].tv = now;
 		work_restart[i].restart = 1;
+	}
 }
 
-static void *longpoll_thread(void *userdata)
+static void restart_threads(void)
 {
-	struct thr_info *mythr = userdata;
-	CURL *curl = NULL;
-	char *copy_start, *hdr_path = NULL, *lp_url = NULL;
-	bool need_slash = false;
+	restart_thread_range(0, max_threads);
+}
 
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialization failed");
-		goto out;
-	}
+/* Restarts the threads that work for pool id with --split */
+static void restart_pool_threads(int id)
+{
+	int count[MAX_POOLS], first = 0, n, i;
 
-start:
-	hdr_path = tq_pop(mythr->q, NULL);
-	if (!hdr_path)
-		goto out;
+	pthread_mutex_lock(&thr_lock);
+	n = active_threads;
+	pthread_mutex_unlock(&thr_lock);
+	pthread_mutex_lock(&g_work_lock);
+	if (!split_counts(n, count)) {
+		pthread_mutex_unlock(&g_work_lock);
+		return;
+	}
+	for (i = 0; i < id; i++)
+		first += count[i];
+	pthread_mutex_unlock(&g_work_lock);
+	restart_thread_range(first, count[id]);
+}
 
-	/* full URL */
-	if (strstr(hdr_path, "://")) {
-		lp_url = hdr_path;
-		hdr_path = NULL;
+/* Sets each pool's share of the miner threads from its --split weight
+ * among the pools that are up.  Every SPLIT_INTERVAL seconds, once
+ * enough shares have been accepted, the pools' parts of the accepted
+ * work (which counts hashes, whatever the difficulty) correct their
+ * shares, so that a pool losing or rejecting more shares than the others
+ * gets more threads and the accepted work follows the weights.  With
+ * force, the shares are recomputed now, e.g. after a pool went down. */
+static void split_rebalance(bool force)
+{
+	static time_t last;
+	double target[MAX_POOLS], work[MAX_POOLS];
+	double weights = 0., steady_weights = 0., steady_work = 0., ratio, sum = 0.;
+	unsigned long shares = 0;
+	int count[MAX_POOLS], before[MAX_POOLS], n, i;
+	bool had, measure, changed;
+	time_t now = time(NULL);
+	char s[32 * MAX_POOLS], *p;
+
+	if (!opt_split)
+		return;
+	pthread_mutex_lock(&g_work_lock);
+	measure = now - last >= SPLIT_INTERVAL;
+	if (!measure && !force) {
+		pthread_mutex_unlock(&g_work_lock);
+		return;
 	}
-	
+	if (measure)
+		last = now;
+	pthread_mutex_unlock(&g_work_lock);
+
+	pthread_mutex_lock(&thr_lock);
+	n = active_threads;
+	pthread_mutex_unlock(&thr_lock);
+
+	pthread_mutex_lock(&stats_lock);
+	for (i = 0; i < pool_count; i++) {
+		work[i] = pools[i].accepted_diff;
+		shares += pools[i].accepted_window;
+	}
+	if (measure && shares >= SPLIT_MIN_SHARES)
+		for (i = 0; i < pool_count; i++) {
+			pools[i].accepted_diff = 0.;
+			pools[i].accepted_window = 0;
+		}
+	else
+		measure = false;
+	pthread_mutex_unlock(&stats_lock);
+
+	pthread_mutex_lock(&g_work_lock);
+	had = split_counts(n, before);
+	for (i = 0; i < pool_count; i++) {
+		target[i] = pools[i].up_since ? pools[i].weight : 0.;
+		weights += target[i];
+		/* only pools up for the whole interval are measured */
+		if (target[i] && pools[i].up_since <= now - SPLIT_INTERVAL) {
+			steady_weights += target[i];
+			steady_work += work[i];
+		}
+	}
+	for (i = 0; i < pool_count; i++) {
+		if (measure && steady_work > 0 && target[i] &&
+		    pools[i].up_since <= now - SPLIT_INTERVAL) {
+			ratio = target[i] / steady_weights /
+			        fmax(work[i] / steady_work, 0.1 * target[i] / steady_weights);
+			pools[i].correction = fmin(2., fmax(0.5, pools[i].correction * sqrt(ratio)));
+		}
+		pools[i].share = weights ? target[i] / weights * pools[i].correction : 0.;
+		sum += pools[i].share;
+	}
+	for (i = 0; i < pool_count; i++)
+		pools[i].share = sum ? pools[i].share / sum : 0.;
+	changed = split_counts(n, count) &&
+	          (!had || memcmp(before, count, pool_count * sizeof(int)));
+	pthread_mutex_unlock(&g_work_lock);
+
+	if (!changed)
+		return;
+	for (i = 0, p = s; i < pool_count; i++)
+		if (count[i])
+			p += sprintf(p, "%s%d on pool %d", p == s ? "" : ", ", count[i], i);
+	applog(LOG_INFO, "Splitting miner threads: %s", s);
+	restart_threads();
+}
+
+static void *longpoll_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+	CURL *curl = NULL;
+	char *copy_start, *hdr_path = NULL, *lp_url = NULL;
+	bool need_slash = false;
+
+	curl = curl_easy_init();
+	if (unlikely(!curl)) {
+		applog(LOG_ERR, "CURL initialization failed");
+		goto out;
+	}
+
+start:
+	hdr_path = tq_pop(mythr->q, NULL);
+	if (!hdr_path)
+		goto out;
+
+	/* full URL */
+	if (strstr(hdr_path, "://")) {
+		lp_url = hdr_path;
+		hdr_path = NULL;
+	}
+	
 	/* absolute path, on current server */
 	else {
 		copy_start = (*hdr_path == '/') ? (hdr_path + 1) : hdr_path;
@@ -1372,10 +2665,11 @@ start:
 			work_free(&g_work);
 			if (have_gbt)
 				rc = gbt_work_decode(res, &g_work);
-			else
-				rc = work_decode(res, &g_work);
+			else if ((rc = work_decode(res, &g_work)))
+				work_set_roll(&g_work, val);
 			if (rc) {
 				time(&g_work_time);
+				work_gen++;
 				restart_threads();
 			}
 			pthread_mutex_unlock(&g_work_lock);
@@ -1383,6 +2677,7 @@ start:
 		} else {
 			pthread_mutex_lock(&g_work_lock);
 			g_work_time -= LP_SCANTIME;
+			work_gen++;
 			pthread_mutex_unlock(&g_work_lock);
 			if (err == CURLE_OPERATION_TIMEDOUT) {
 				restart_threads();
@@ -1412,7 +2707,18 @@ static bool stratum_handle_response(char *buf)
 {
 	json_t *val, *err_val, *res_val, *id_val;
 	json_error_t err;
-	bool ret = false;
+	const char *reason;
+	bool ret = false, accepted;
+	int id;
+
+	switch (stratum_parse_reply(buf, &id, &accepted, &reason)) {
+	case 0:
+		return false;
+	case 1:
+		if (!share_reply(id, accepted, reason) && opt_debug)
+			applog(LOG_DEBUG, "DEBUG: reply to unknown request %d", id);
+		return true;
+	}
 
 	val = JSON_LOADS(buf, &err);
 	if (!val) {
@@ -1427,8 +2733,12 @@ static bool stratum_handle_response(char *buf)
 	if (!id_val || json_is_null(id_val) || !res_val)
 		goto out;
 
-	share_result(json_is_true(res_val),
-		err_val ? json_string_value(json_array_get(err_val, 1)) : NULL);
+	id = json_is_string(id_val) ? atoi(json_string_value(id_val))
+	                            : json_integer_value(id_val);
+	if (!share_reply(id, json_is_true(res_val),
+	                 err_val ? json_string_value(json_array_get(err_val, 1)) : NULL) &&
+	    opt_debug)
+		applog(LOG_DEBUG, "DEBUG: reply to unknown request %d", id);
 
 	ret = true;
 out:
@@ -1438,32 +2748,226 @@ out:
 	return ret;
 }
 
+/* Called with g_work_lock held */
+static void switch_pool(int i)
+{
+	applog(LOG_WARNING, "Switching to pool %d: %s", i, pools[i].ctx.url);
+	active_pool = i;
+	stratum_gen_work(&pools[i], &g_work);
+	time(&g_work_time);
+}
+
+/* Called with g_work_lock held.  A ready pool takes over if the active
+ * one is down and no more preferred pool is ready, or if it is preferred
+ * to the active one and has been ready for opt_failback seconds. */
+static bool pool_takes_over(int id)
+{
+	int i;
+
+	if (id == active_pool || !pools[id].up_since)
+		return false;
+	if (pools[active_pool].up_since)
+		return id < active_pool &&
+		       time(NULL) - pools[id].up_since >= opt_failback;
+	for (i = 0; i < id; i++)
+		if (pools[i].up_since)
+			return false;
+	return true;
+}
+
+/* Publishes new jobs of the active pool and handles switching */
+static void pool_check(struct pool *pool)
+{
+	struct stratum_ctx *sctx = &pool->ctx;
+	int id = pool - pools;
+	bool new_job = false, restart = false, held, up = false, split_restart = false;
+
+	pthread_mutex_lock(&g_work_lock);
+	if (!pool->up_since && sctx->job_seq != pool->conn_seq) {
+		time(&pool->up_since);
+		up = true;
+	}
+	if (pool_takes_over(id)) {
+		switch_pool(id);
+		restart = true;
+	} else if (id == active_pool && pool->up_since &&
+	           (!g_work_time || strcmp(sctx->job.job_id, g_work.job_id) ||
+	            g_work.session != sctx->session_seq)) {
+		/* work from before a new session has a stale extranonce1 */
+		restart = sctx->job.clean || g_work.session != sctx->session_seq;
+		stratum_gen_work(pool, &g_work);
+		time(&g_work_time);
+		new_job = true;
+	}
+	/* with --split, every pool that is up has its own job */
+	if (opt_split && pool->up_since &&
+	    (!pool->work_time || strcmp(sctx->job.job_id, pool->work.job_id) ||
+	     pool->work.session != sctx->session_seq)) {
+		split_restart = !pool->work_time || sctx->job.clean ||
+		                pool->work.session != sctx->session_seq;
+		stratum_gen_work(pool, &pool->work);
+		time(&pool->work_time);
+	}
+	held = pool->up_since;
+	pthread_mutex_unlock(&g_work_lock);
+
+	pthread_mutex_lock(&share_lock);
+	held = held && held_count;
+	pthread_mutex_unlock(&share_lock);
+
+	if (held)
+		share_release(pool, true);
+
+	if (new_job || restart)
+		proxy_kick();
+	if (new_job && restart)
+		applog(LOG_INFO, "Stratum requested work restart");
+	if (up)
+		split_rebalance(true);
+	if (split_restart)
+		restart_pool_threads(id);
+	else if (restart && !opt_split)
+		restart_threads();
+}
+
+/* Hands the work over to the best remaining pool, if any */
+static void pool_down(struct pool *pool)
+{
+	int i, id = pool - pools;
+	bool restart = false;
+
+	expire_shares(id);
+	pthread_mutex_lock(&g_work_lock);
+	pool->up_since = 0;
+	if (id == active_pool) {
+		for (i = 0; i < pool_count; i++)
+			if (pools[i].up_since)
+				break;
+		/* with nowhere to switch, keep hashing the last job and
+		 * hold shares until the pool is back */
+		if (i < pool_count) {
+			switch_pool(i);
+			restart = true;
+		} else if (g_work_time)
+			applog(LOG_WARNING, "Mining on the last job while reconnecting");
+	}
+	pthread_mutex_unlock(&g_work_lock);
+
+	split_rebalance(true);
+	if (restart) {
+		if (!opt_split)
+			restart_threads();
+		proxy_kick();
+	}
+}
+
+/* Suggests the difficulty at which our hash rate yields opt_share_rate
+ * shares a minute, unless the pool already uses or was last asked for
+ * one within a factor of two */
+static void share_rate_check(struct pool *pool)
+{
+	struct stratum_ctx *sctx = &pool->ctx;
+	double hashrate = 0., diff, pool_diff, rate;
+	unsigned long accepted;
+	time_t now = time(NULL);
+	char req[128];
+	int i;
+
+	if (now - pool->suggested < SUGGEST_INTERVAL ||
+	    (pool - pools != active_pool && !opt_split))
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	for (i = 0; i < max_threads; i++)
+		hashrate += thr_hashrates[i];
+	accepted = opt_split ? pool->accepted : accepted_count;
+	pthread_mutex_unlock(&stats_lock);
+	if (opt_split) {
+		pthread_mutex_lock(&g_work_lock);
+		hashrate *= pool->share;
+		pthread_mutex_unlock(&g_work_lock);
+	}
+	if (hashrate <= 0)
+		return;
+
+	/* a share at difficulty 1 takes 2^32 hashes, or 2^16 for scrypt */
+	diff = hashrate * 60. / opt_share_rate /
+	       (opt_algo == ALGO_SCRYPT ? 65536. : 4294967296.);
+	pthread_mutex_lock(&sctx->work_lock);
+	pool_diff = sctx->next_diff;
+	pthread_mutex_unlock(&sctx->work_lock);
+
+	if (opt_debug && pool->suggested) {
+		rate = 60. * (accepted - pool->suggested_accepted) / (now - pool->suggested);
+		applog(LOG_DEBUG, "DEBUG: %.2f shares/min at difficulty %g, target %g at %g",
+		       rate, pool_diff, opt_share_rate, diff);
+	}
+	pool->suggested = now;
+	pool->suggested_accepted = accepted;
+	if ((diff < 2 * pool_diff && 2 * diff > pool_diff) ||
+	    (diff < 2 * pool->suggested_diff && 2 * diff > pool->suggested_diff))
+		return;
+
+	applog(LOG_INFO, "Suggesting difficulty %g to the pool", diff);
+	sprintf(req, "{\"id\": 4, \"method\": \"mining.suggest_difficulty\", \"params\": [%.8g]}",
+	        diff);
+	if (stratum_send_line(sctx, req))
+		pool->suggested_diff = diff;
+}
+
+/* Waits up to timeout seconds for input, expiring lost shares meanwhile */
+static bool stratum_wait_input(struct pool *pool, int timeout)
+{
+	static time_t last_check;
+	int slice;
+
+	for (; timeout > 0; timeout -= slice) {
+		if (time(NULL) - last_check >= SHARE_CHECK) {
+			expire_shares(-1);
+			time(&last_check);
+		}
+		pool_check(pool);
+		if (opt_share_rate)
+			share_rate_check(pool);
+		split_rebalance(false);
+		slice = timeout < SHARE_CHECK ? timeout : SHARE_CHECK;
+		if (stratum_socket_full(&pool->ctx, slice))
+			return true;
+	}
+	return false;
+}
+
 static void *stratum_thread(void *userdata)
 {
-	struct thr_info *mythr = userdata;
+	struct pool *pool = userdata;
+	struct stratum_ctx *sctx = &pool->ctx;
 	char *s;
 
-	stratum.url = tq_pop(mythr->q, NULL);
-	if (!stratum.url)
-		goto out;
-	applog(LOG_INFO, "Starting Stratum on %s", stratum.url);
+	if (pool == &pools[0]) {
+		sctx->url = tq_pop(thr_info[stratum_thr_id].q, NULL);
+		if (!sctx->url)
+			goto out;
+	}
+	applog(LOG_INFO, "Starting Stratum on %s", sctx->url);
 
 	while (1) {
 		int failures = 0;
 
-		while (!stratum.curl) {
-			pthread_mutex_lock(&g_work_lock);
-			g_work_time = 0;
-			pthread_mutex_unlock(&g_work_lock);
-			restart_threads();
-
-			if (!stratum_connect(&stratum, stratum.url) ||
-			    !stratum_subscribe(&stratum) ||
-			    !stratum_authorize(&stratum, rpc_user, rpc_pass)) {
-				stratum_disconnect(&stratum);
+		if (!sctx->curl)
+			pool_down(pool);
+		while (!sctx->curl) {
+			pool->conn_seq = sctx->job_seq;
+			pool->suggested_diff = 0;
+			pool->suggested = 0;
+			if (!stratum_connect(sctx, sctx->url) ||
+			    (opt_version_rolling && !stratum_configure(sctx)) ||
+			    !stratum_subscribe(sctx) ||
+			    (opt_extranonce_subscribe && !stratum_extranonce_subscribe(sctx)) ||
+			    !stratum_authorize(sctx, pool->user ? pool->user : rpc_user,
+			                       pool->pass ? pool->pass : rpc_pass)) {
+				stratum_disconnect(sctx);
 				if (opt_retries >= 0 && ++failures > opt_retries) {
-					applog(LOG_ERR, "...terminating workio thread");
-					tq_push(thr_info[work_thr_id].q, NULL);
+					applog(LOG_ERR, "...giving up on %s", sctx->url);
 					goto out;
 				}
 				applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
@@ -1471,34 +2975,31 @@ static void *stratum_thread(void *userdata)
 			}
 		}
 
-		if (stratum.job.job_id &&
-		    (!g_work_time || strcmp(stratum.job.job_id, g_work.job_id))) {
-			pthread_mutex_lock(&g_work_lock);
-			stratum_gen_work(&stratum, &g_work);
-			time(&g_work_time);
-			pthread_mutex_unlock(&g_work_lock);
-			if (stratum.job.clean) {
-				applog(LOG_INFO, "Stratum requested work restart");
-				restart_threads();
-			}
-		}
-		
-		if (!stratum_socket_full(&stratum, 120)) {
+		if (!stratum_wait_input(pool, 120)) {
 			applog(LOG_ERR, "Stratum connection timed out");
 			s = NULL;
 		} else
-			s = stratum_recv_line(&stratum);
+			s = stratum_recv_line(sctx);
 		if (!s) {
-			stratum_disconnect(&stratum);
+			stratum_disconnect(sctx);
 			applog(LOG_ERR, "Stratum connection interrupted");
 			continue;
 		}
-		if (!stratum_handle_method(&stratum, s))
+		if (!stratum_handle_method(sctx, s))
 			stratum_handle_response(s);
-		free(s);
+		else
+			pool_check(pool);
 	}
 
 out:
+	pool_down(pool);
+	share_release(pool, false);
+	pthread_mutex_lock(&g_work_lock);
+	if (!--pools_alive) {
+		applog(LOG_ERR, "...terminating workio thread");
+		workio_quit();
+	}
+	pthread_mutex_unlock(&g_work_lock);
 	return NULL;
 }
 
@@ -1576,6 +3077,7 @@ static void parse_arg(int key, char *arg, char *pname)
 {
 	char *p;
 	int v, i;
+	double d;
 
 	switch(key) {
 	case 'a':
@@ -1787,6 +3289,105 @@ static void parse_arg(int key, char *arg, char *pname)
 			show_usage_and_exit(1);
 		}
 		break;
+	case 1020:			/* --max-threads */
+		v = atoi(arg);
+		if (v < 1 || v > 9999)	/* sanity check */
+			show_usage_and_exit(1);
+		max_threads = v;
+		break;
+	case 1021:			/* --control */
+		free(opt_control);
+		opt_control = strdup(arg);
+		break;
+	case 1022: {			/* --backup-url */
+		struct pool *pool = &pools[pool_count];
+		char *ap, *hp;
+		if (pool_count == MAX_POOLS) {
+			fprintf(stderr, "%s: too many pools\n", pname);
+			show_usage_and_exit(1);
+		}
+		if (strncasecmp(arg, "stratum+tcp://", 14) &&
+		    strncasecmp(arg, "stratum+tcps://", 15)) {
+			fprintf(stderr, "%s: backup URL must be a Stratum URL -- '%s'\n",
+				pname, arg);
+			show_usage_and_exit(1);
+		}
+		ap = strstr(arg, "://") + 3;
+		hp = strrchr(ap, '@');
+		if (hp) {
+			p = memchr(ap, ':', hp - ap);
+			if (!p)
+				p = hp;
+			pool->user = calloc(p - ap + 1, 1);
+			memcpy(pool->user, ap, p - ap);
+			pool->pass = calloc(hp - p + 1, 1);
+			if (p < hp)
+				memcpy(pool->pass, p + 1, hp - p - 1);
+			hp++;
+		} else
+			hp = ap;
+		pool->ctx.url = malloc(strlen(arg) + 1);
+		sprintf(pool->ctx.url, "%.*s%s", (int)(ap - arg), arg, hp);
+		pool_count++;
+		break;
+	}
+	case 1026:			/* --proxy-listen */
+		free(opt_proxy_listen);
+		opt_proxy_listen = strdup(arg);
+		break;
+	case 1025:			/* --share-rate */
+		d = atof(arg);
+		if (d <= 0 || d > 6000)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_share_rate = d;
+		break;
+	case 1027:			/* --no-extranonce-subscribe */
+		opt_extranonce_subscribe = false;
+		break;
+	case 1024:			/* --no-version-rolling */
+		opt_version_rolling = false;
+		break;
+	case 1023:			/* --failback */
+		v = atoi(arg);
+		if (v < 0 || v > 99999)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_failback = v;
+		break;
+	case 1028: {			/* --split */
+		char *end;
+		for (i = 0, p = arg; i < MAX_POOLS; i++, p = end + 1) {
+			d = strtod(p, &end);
+			if (end == p || d < 0 || d > 1e6)
+				show_usage_and_exit(1);
+			pools[i].weight = d;
+			if (*end != ',')
+				break;
+		}
+		if (*end)
+			show_usage_and_exit(1);
+		opt_split = true;
+		break;
+	}
+	case 1019:			/* --restart-latency */
+		v = atoi(arg);
+		if (v < 1 || v > 60000)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_restart_latency = v;
+		break;
+	case 1017:
+		opt_autotune = true;
+		break;
+	case 1018:			/* --odo-engine */
+		for (i = 0; i < odo_engine_count; i++)
+			if (!strcmp(arg, odo_engines[i].name))
+				break;
+		if (i == odo_engine_count || !odo_engines[i].available()) {
+			fprintf(stderr, "%s: unavailable Odo engine -- '%s'\n",
+				pname, arg);
+			show_usage_and_exit(1);
+		}
+		opt_odo_engine = i;
+		break;
 	case 1015:			/* --coinbase-sig */
 		if (strlen(arg) + 1 > sizeof(coinbase_sig)) {
 			fprintf(stderr, "%s: coinbase signature too long\n", pname);
@@ -1831,6 +3432,21 @@ static void parse_config(json_t *config, char *pname, char *ref)
 				break;
 			parse_arg(options[i].val, s, pname);
 			free(s);
+		} else if (options[i].val == 1022 && json_is_array(val)) {
+			size_t j;
+			for (j = 0; j < json_array_size(val); j++) {
+				json_t *url = json_array_get(val, j);
+				if (!json_is_string(url))
+					break;
+				s = strdup(json_string_value(url));
+				parse_arg(options[i].val, s, pname);
+				free(s);
+			}
+			if (j < json_array_size(val)) {
+				fprintf(stderr, "%s: invalid argument for option '%s'\n",
+					pname, options[i].name);
+				exit(1);
+			}
 		} else if (!options[i].has_arg && json_is_true(val)) {
 			parse_arg(options[i].val, "", pname);
 		} else {
@@ -1863,87 +3479,1321 @@ static void parse_cmdline(int argc, char *argv[])
 	}
 }
 
-#ifndef WIN32
-static void signal_handler(int sig)
+/* Fill cores[] with the first logical CPU of each physical core and
+ * return their count, or 0 if the topology is unknown. */
+static int physical_cores(int *cores, int max)
 {
-	switch (sig) {
-	case SIGHUP:
-		applog(LOG_INFO, "SIGHUP received");
-		break;
-	case SIGINT:
-		applog(LOG_INFO, "SIGINT received, exiting");
-		exit(0);
-		break;
-	case SIGTERM:
-		applog(LOG_INFO, "SIGTERM received, exiting");
-		exit(0);
-		break;
+#ifdef __linux
+	int i, n = 0;
+
+	for (i = 0; i < num_processors && n < max; i++) {
+		char path[80];
+		FILE *f;
+		int first;
+
+		sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", i);
+		f = fopen(path, "r");
+		if (!f)
+			return 0;
+		if (fscanf(f, "%d", &first) != 1)
+			first = i;
+		fclose(f);
+		if (first == i)
+			cores[n++] = i;
 	}
-}
+	return n;
+#else
+	return 0;
 #endif
+}
 
+static void cpu_model(char *buf, size_t len)
+{
+#ifdef __linux
+	char line[256];
+	FILE *f;
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			char *p;
+			if (strncmp(line, "model name", 10) && strncmp(line, "cpu model", 9))
+				continue;
+			p = strchr(line, ':');
+			if (!p)
+				continue;
+			p++;
+			p += strspn(p, " \t");
+			p[strcspn(p, "\n")] = '\0';
+			snprintf(buf, len, "%s", p);
+			fclose(f);
+			return;
+		}
+		fclose(f);
+	}
+#endif
+	snprintf(buf, len, "unknown");
+}
 
-int main(int argc, char *argv[])
+static char *autotune_cache_path(void)
 {
-	struct thr_info *thr;
-	long flags;
-	int i;
+	const char *home = getenv("HOME");
+	char *path;
 
+	if (!home || !*home)
+		return NULL;
+	path = malloc(strlen(home) + sizeof(AUTOTUNE_CACHE) + 1);
+	sprintf(path, "%s/%s", home, AUTOTUNE_CACHE);
+	return path;
+}
 
-	rpc_user = strdup("");
-	rpc_pass = strdup("");
+#ifdef __linux
+static double cgroup_cpu_limit(const char *dir, bool v2)
+{
+	char path[PATH_MAX + 32];
+	long long quota = -1, period = 0;
+	FILE *f;
+
+	if (v2) {
+		char q[32];
+		snprintf(path, sizeof(path), "%s/cpu.max", dir);
+		f = fopen(path, "r");
+		if (!f)
+			return 0;
+		if (fscanf(f, "%31s %lld", q, &period) == 2 && strcmp(q, "max"))
+			quota = atoll(q);
+		fclose(f);
+	} else {
+		snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+		f = fopen(path, "r");
+		if (!f)
+			return 0;
+		if (fscanf(f, "%lld", &quota) != 1)
+			quota = -1;
+		fclose(f);
+		snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+		f = fopen(path, "r");
+		if (!f)
+			return 0;
+		if (fscanf(f, "%lld", &period) != 1)
+			period = 0;
+		fclose(f);
+	}
+	return quota > 0 && period > 0 ? (double)quota / period : 0;
+}
 
-	/* parse command line */
-	parse_cmdline(argc, argv);
+/* Smallest CPU limit found walking from cgroup cg up to the mount root */
+static double cgroup_walk(const char *root, const char *cg, bool v2)
+{
+	char dir[PATH_MAX];
+	double limit, best = 0;
+	size_t root_len = strlen(root);
+	char *p;
 
-	if (!opt_benchmark && !rpc_url) {
-		fprintf(stderr, "%s: no URL supplied\n", argv[0]);
-		show_usage_and_exit(1);
+	snprintf(dir, sizeof(dir), "%s%s", root, cg);
+	while (1) {
+		limit = cgroup_cpu_limit(dir, v2);
+		if (limit > 0 && (!best || limit < best))
+			best = limit;
+		p = strrchr(dir + root_len, '/');
+		if (!p)
+			break;
+		*p = '\0';
 	}
+	return best;
+}
 
-	if (!rpc_userpass) {
-		rpc_userpass = malloc(strlen(rpc_user) + strlen(rpc_pass) + 2);
-		if (!rpc_userpass)
-			return 1;
-		sprintf(rpc_userpass, "%s:%s", rpc_user, rpc_pass);
+/* CPU quota from cgroup v1 or v2, in CPUs, or 0 if unlimited */
+static double cgroup_cpu_quota(void)
+{
+	char line[PATH_MAX];
+	double limit, best = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		char *ctrl, *cg, *tok, *save;
+		bool has_cpu = false;
+
+		line[strcspn(line, "\n")] = '\0';
+		ctrl = strchr(line, ':');
+		if (!ctrl)
+			continue;
+		cg = strchr(++ctrl, ':');
+		if (!cg)
+			continue;
+		*cg++ = '\0';
+		if (!*ctrl) {
+			limit = cgroup_walk("/sys/fs/cgroup", cg, true);
+		} else {
+			for (tok = strtok_r(ctrl, ",", &save); tok;
+			     tok = strtok_r(NULL, ",", &save))
+				if (!strcmp(tok, "cpu"))
+					has_cpu = true;
+			if (!has_cpu)
+				continue;
+			limit = cgroup_walk("/sys/fs/cgroup/cpu,cpuacct", cg, false);
+			if (!limit)
+				limit = cgroup_walk("/sys/fs/cgroup/cpu", cg, false);
+		}
+		if (limit > 0 && (!best || limit < best))
+			best = limit;
 	}
+	fclose(f);
+	return best;
+}
+#endif
 
-	pthread_mutex_init(&applog_lock, NULL);
-	pthread_mutex_init(&stats_lock, NULL);
-	pthread_mutex_init(&g_work_lock, NULL);
-	pthread_mutex_init(&stratum.sock_lock, NULL);
-	pthread_mutex_init(&stratum.work_lock, NULL);
+/* Fill cpus[] with the CPUs we may run on and return the number of
+ * threads that the affinity mask and cgroup CPU quota can keep busy. */
+static int cpu_budget(int *cpus, int *n_cpus)
+{
+	int i, n = 0, budget;
+#ifdef __linux
+	cpu_set_t set;
+	double quota;
 
-	flags = opt_benchmark || (strncasecmp(rpc_url, "https://", 8) &&
-	                          strncasecmp(rpc_url, "stratum+tcps://", 15))
-	      ? (CURL_GLOBAL_ALL & ~CURL_GLOBAL_SSL)
-	      : CURL_GLOBAL_ALL;
-	if (curl_global_init(flags)) {
-		applog(LOG_ERR, "CURL initialization failed");
-		return 1;
+	if (!sched_getaffinity(0, sizeof(set), &set)) {
+		for (i = 0; i < CPU_SETSIZE && n < num_processors; i++)
+			if (CPU_ISSET(i, &set))
+				cpus[n++] = i;
 	}
+#endif
+	if (!n)
+		for (i = 0; i < num_processors; i++)
+			cpus[n++] = i;
+	*n_cpus = budget = n;
+#ifdef __linux
+	quota = cgroup_cpu_quota();
+	if (quota > 0 && (int)(quota + 0.999) < budget)
+		budget = (int)(quota + 0.999);
+#endif
+	return budget;
+}
 
-#ifndef WIN32
-	if (opt_background) {
-		i = fork();
-		if (i < 0) exit(1);
-		if (i > 0) exit(0);
-		i = setsid();
-		if (i < 0)
-			applog(LOG_ERR, "setsid() failed (errno = %d)", errno);
-		i = chdir("/");
-		if (i < 0)
-			applog(LOG_ERR, "chdir() failed (errno = %d)", errno);
-		signal(SIGHUP, signal_handler);
-		signal(SIGINT, signal_handler);
-		signal(SIGTERM, signal_handler);
+/* Assign miner threads to CPUs; called with thr_lock held */
+static void map_threads(void)
+{
+	int i, j, n = 0;
+	int *cores = NULL;
+
+	if (use_physical_cores) {
+		int n_cores;
+		cores = malloc(num_processors * sizeof(int));
+		n_cores = physical_cores(cores, num_processors);
+		for (i = 0; i < n_cores; i++)
+			for (j = 0; j < cpu_count; j++)
+				if (cores[i] == cpu_list[j]) {
+					cores[n++] = cores[i];
+					break;
+				}
 	}
-#endif
+	for (i = 0; i < max_threads; i++) {
+		if (n)
+			thr_cpu[i] = cores[i % n];
+		else if (cpu_count > 1 && (active_threads % cpu_count == 0 ||
+		         (auto_threads && active_threads < cpu_count)))
+			thr_cpu[i] = cpu_list[i % cpu_count];
+		else
+			thr_cpu[i] = -1;
+	}
+	free(cores);
+}
 
-#if defined(WIN32)
-	SYSTEM_INFO sysinfo;
-	GetSystemInfo(&sysinfo);
-	num_processors = sysinfo.dwNumberOfProcessors;
+/* Called with thr_lock held; the new thread waits for it in thread_layout() */
+static bool start_miner_thread(int i)
+{
+	struct thr_info *thr = &thr_info[i];
+
+	thr->id = i;
+	thr->q = tq_new();
+	if (!thr->q)
+		return false;
+	work_restart[i].restart = 0;
+
+	if (unlikely(pthread_create(&thr->pth, NULL, miner_thread, thr))) {
+		applog(LOG_ERR, "thread %d create failed", i);
+		tq_free(thr->q);
+		thr->q = NULL;
+		return false;
+	}
+	return true;
+}
+
+/* Activate the first `active' miner threads, starting any that have not
+ * run yet, and park the rest.  All per-thread arrays are allocated for
+ * max_threads up front, so they never move while threads use them. */
+static bool set_thread_layout(int active, const int *cpus, int n_cpus)
+{
+	bool rc = true;
+
+	pthread_mutex_lock(&thr_lock);
+	memcpy(cpu_list, cpus, n_cpus * sizeof(int));
+	cpu_count = n_cpus;
+	active_threads = active;
+	map_threads();
+	while (started_threads < active) {
+		if (!start_miner_thread(started_threads)) {
+			active_threads = started_threads;
+			rc = false;
+			break;
+		}
+		started_threads++;
+	}
+	layout_gen++;
+	pthread_cond_broadcast(&thr_cond);
+	pthread_mutex_unlock(&thr_lock);
+
+	return rc;
+}
+
+static bool resize_threads(int n)
+{
+	int *cpus, n_cpus, budget, active;
+	bool rc;
+
+	if (n < 1 || n > max_threads)
+		return false;
+	cpus = malloc(num_processors * sizeof(int));
+	budget = cpu_budget(cpus, &n_cpus);
+	active = auto_threads && budget < n ? budget : n;
+
+	pthread_mutex_lock(&thr_lock);
+	opt_n_threads = n;
+	pthread_mutex_unlock(&thr_lock);
+	rc = set_thread_layout(active, cpus, n_cpus);
+	restart_threads();
+	free(cpus);
+
+	applog(LOG_INFO, "Miner threads resized to %d, %d active", n, active_threads);
+	return rc;
+}
+
+static void *cpu_watch_thread(void *userdata)
+{
+	int *cpus = malloc(num_processors * sizeof(int));
+	int budget, n_cpus;
+
+	while (1) {
+		sleep(CPU_RECHECK_INTERVAL);
+		budget = cpu_budget(cpus, &n_cpus);
+		pthread_mutex_lock(&thr_lock);
+		if (budget > opt_n_threads)
+			budget = opt_n_threads;
+		if (budget == active_threads && n_cpus == cpu_count &&
+		    !memcmp(cpus, cpu_list, n_cpus * sizeof(int))) {
+			pthread_mutex_unlock(&thr_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&thr_lock);
+		applog(LOG_INFO, "CPU budget changed: %d of %d threads active on %d CPUs",
+		       budget, opt_n_threads, n_cpus);
+		set_thread_layout(budget, cpus, n_cpus);
+		restart_threads();
+	}
+
+	return NULL;
+}
+
+#ifndef WIN32
+static void control_command(int fd, char *cmd)
+{
+	char reply[RESTART_HIST_LEN + MAX_POOLS * 160];
+	int n;
+
+	cmd[strcspn(cmd, "\r\n")] = '\0';
+	if (!strcmp(cmd, "threads")) {
+		pthread_mutex_lock(&thr_lock);
+		sprintf(reply, "threads %d/%d (max %d)\n",
+			active_threads, opt_n_threads, max_threads);
+		pthread_mutex_unlock(&thr_lock);
+	} else if (sscanf(cmd, "threads %d", &n) == 1) {
+		if (resize_threads(n))
+			sprintf(reply, "ok\n");
+		else
+			sprintf(reply, "error: thread count must be 1-%d\n", max_threads);
+	} else if (!strcmp(cmd, "shares")) {
+		unsigned long h_accepted, h_dropped, dups, stales;
+		int i, pending = 0, h_count;
+		pthread_mutex_lock(&share_lock);
+		for (i = 0; i < MAX_INFLIGHT; i++)
+			pending += !!inflight[i].id;
+		h_count = held_count;
+		h_accepted = held_accepted;
+		h_dropped = held_dropped;
+		dups = dup_suppressed;
+		stales = stale_suppressed;
+		pthread_mutex_unlock(&share_lock);
+		pthread_mutex_lock(&stats_lock);
+		sprintf(reply, "accepted %lu rejected %lu lost %lu pending %d rtt %.1f ms"
+			" held %d (accepted %lu dropped %lu) discarded %lu stale %lu duplicate\n",
+			accepted_count, rejected_count, lost_count, pending,
+			rtt_count ? 1e3 * rtt_sum / rtt_count : 0.,
+			h_count, h_accepted, h_dropped, stales, dups);
+		pthread_mutex_unlock(&stats_lock);
+#ifdef WANT_PROXY
+	} else if (!strcmp(cmd, "proxy")) {
+		pthread_mutex_lock(&proxy_lock);
+		sprintf(reply, "clients %d accepted %lu rejected %lu\n",
+			proxy_count, proxy_accepted, proxy_rejected);
+		pthread_mutex_unlock(&proxy_lock);
+#endif
+	} else if (!strcmp(cmd, "connects")) {
+		char *p = reply;
+		for (n = 0; n < pool_count; n++) {
+			struct stratum_ctx *sctx = &pools[n].ctx;
+			pthread_mutex_lock(&sctx->sock_lock);
+			p += sprintf(p, "pool %d connects %lu last %.1f ms avg %.1f ms via %s\n",
+				     n, sctx->connects, sctx->connect_ms,
+				     sctx->connects ? sctx->connect_ms_sum / sctx->connects : 0.,
+				     sctx->last_addr[0] ? sctx->last_addr : "-");
+			pthread_mutex_unlock(&sctx->sock_lock);
+		}
+	} else if (!strcmp(cmd, "split")) {
+		int count[MAX_POOLS] = {0}, threads;
+		double share[MAX_POOLS];
+		char *p = reply;
+		pthread_mutex_lock(&thr_lock);
+		threads = active_threads;
+		pthread_mutex_unlock(&thr_lock);
+		pthread_mutex_lock(&g_work_lock);
+		split_counts(threads, count);
+		for (n = 0; n < pool_count; n++)
+			share[n] = pools[n].share;
+		pthread_mutex_unlock(&g_work_lock);
+		pthread_mutex_lock(&stats_lock);
+		for (n = 0; n < pool_count; n++)
+			p += sprintf(p, "pool %d weight %g share %.1f%% threads %d"
+				     " accepted %lu rejected %lu\n",
+				     n, pools[n].weight, 100. * share[n], count[n],
+				     pools[n].accepted, pools[n].rejected);
+		pthread_mutex_unlock(&stats_lock);
+	} else if (!strcmp(cmd, "restarts")) {
+		format_restart_latency(reply);
+		strcat(reply, "\n");
+	} else
+		sprintf(reply, "error: unknown command\n");
+
+	if (write(fd, reply, strlen(reply)) < 0 && opt_debug)
+		applog(LOG_DEBUG, "DEBUG: control reply failed (errno = %d)", errno);
+}
+
+static void *control_thread(void *userdata)
+{
+	struct sockaddr_un addr;
+	char buf[256];
+	ssize_t len;
+	int sock, fd;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		applog(LOG_ERR, "control socket failed (errno = %d)", errno);
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, opt_control, sizeof(addr.sun_path) - 1);
+	unlink(addr.sun_path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sock, 4) < 0) {
+		applog(LOG_ERR, "cannot listen on %s (errno = %d)", addr.sun_path, errno);
+		close(sock);
+		return NULL;
+	}
+
+	while (1) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR)
+				sleep(1);
+			continue;
+		}
+		len = read(fd, buf, sizeof(buf) - 1);
+		if (len > 0) {
+			buf[len] = '\0';
+			control_command(fd, buf);
+		}
+		close(fd);
+	}
+
+	return NULL;
+}
+#endif /* !WIN32 */
+
+#ifdef WANT_PROXY
+#define PROXY_LINE_MAX		4096		/* longest request from a client */
+#define PROXY_BACKLOG_MAX	(1 << 20)	/* unsent bytes before a client is dropped */
+
+/* A downstream miner connected to --proxy-listen.  Subscribed clients
+ * get our extranonce1 followed by a prefix of our extranonce2 space as
+ * their extranonce1, and mine the rest of it as their extranonce2. */
+struct proxy_client {
+	struct list_head	list;
+	int			fd;
+	unsigned int		prefix;		/* 0 until subscribed */
+	unsigned long		seq;		/* tells reused prefixes apart */
+	bool			authorized;
+	bool			closing;
+	bool			want_write;
+	uint32_t		version_mask;
+	size_t			rlen;
+	char			rbuf[PROXY_LINE_MAX];
+	size_t			wlen, wsize;
+	char			*wbuf;
+};
+
+static LIST_HEAD(proxy_list);
+static struct proxy_client **proxy_by_prefix;
+static unsigned int proxy_prefixes, proxy_next_prefix;
+static unsigned long proxy_seq;
+static int proxy_epfd, proxy_listen_fd;
+
+/* The upstream session the clients are subscribed to */
+static int proxy_pool = -1;
+static unsigned long proxy_session, proxy_job_seq;
+static int proxy_prefix_len;
+static size_t proxy_xnonce2_size;
+static char *proxy_xnonce1;
+static bool proxy_version_rolling;
+static uint32_t proxy_version_mask;
+static double proxy_diff;
+static char *proxy_notify;	/* the current job as a mining.notify line */
+
+static void proxy_close(struct proxy_client *c)
+{
+	epoll_ctl(proxy_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	list_del(&c->list);
+	if (c->prefix && proxy_by_prefix[c->prefix] == c)
+		proxy_by_prefix[c->prefix] = NULL;
+	pthread_mutex_lock(&proxy_lock);
+	proxy_count--;
+	pthread_mutex_unlock(&proxy_lock);
+	free(c->wbuf);
+	free(c);
+}
+
+static void proxy_flush(struct proxy_client *c)
+{
+	struct epoll_event ev;
+	ssize_t n;
+
+	while (c->wlen) {
+		n = send(c->fd, c->wbuf, c->wlen, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				c->closing = true;
+			break;
+		}
+		memmove(c->wbuf, c->wbuf + n, c->wlen - n);
+		c->wlen -= n;
+	}
+	if (!c->closing && !!c->wlen != c->want_write) {
+		c->want_write = !!c->wlen;
+		ev.events = EPOLLIN | (c->want_write ? EPOLLOUT : 0);
+		ev.data.ptr = c;
+		epoll_ctl(proxy_epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+}
+
+/* Queues a line for the client; one that cannot keep up is closed */
+static void proxy_send(struct proxy_client *c, const char *line)
+{
+	size_t len = strlen(line);
+
+	if (c->closing)
+		return;
+	if (c->wlen + len + 1 > PROXY_BACKLOG_MAX) {
+		applog(LOG_WARNING, "proxy: dropping client %u, too far behind", c->prefix);
+		c->closing = true;
+		return;
+	}
+	if (c->wlen + len + 1 > c->wsize) {
+		size_t size = c->wlen + len + 1 + PROXY_LINE_MAX;
+		char *buf = realloc(c->wbuf, size);
+		if (!buf) {
+			c->closing = true;
+			return;
+		}
+		c->wbuf = buf;
+		c->wsize = size;
+	}
+	memcpy(c->wbuf + c->wlen, line, len);
+	c->wbuf[c->wlen + len] = '\n';
+	c->wlen += len + 1;
+	proxy_flush(c);
+}
+
+static void proxy_reply(struct proxy_client *c, const char *id,
+	const char *result, const char *error)
+{
+	char buf[1024];
+
+	snprintf(buf, sizeof(buf), "{\"id\": %s, \"result\": %s, \"error\": %s}",
+		 id, result ? result : "null", error ? error : "null");
+	proxy_send(c, buf);
+}
+
+static void proxy_send_work(struct proxy_client *c, bool diff)
+{
+	char buf[128];
+
+	if (diff) {
+		sprintf(buf, "{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [%.10g]}",
+			proxy_diff);
+		proxy_send(c, buf);
+	}
+	proxy_send(c, proxy_notify);
+}
+
+/* Rebuilds the upstream job as a notify for clients: coinb1 ends before
+ * our extranonce1, coinb2 starts after our extranonce2 */
+static char *proxy_notify_line(const struct stratum_ctx *sctx)
+{
+	const struct stratum_job *job = &sctx->job;
+	size_t coinb1_size = job->xnonce2 - job->coinbase - sctx->xnonce1_size;
+	size_t coinb2_start = job->xnonce2 - job->coinbase + sctx->xnonce2_size;
+	char *s, *p;
+	int i;
+
+	s = malloc(256 + strlen(job->job_id) + 2 * job->coinbase_size +
+	           68 * job->merkle_count);
+	if (!s)
+		return NULL;
+	p = s + sprintf(s, "{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"%s\", \"",
+	                job->job_id);
+	bin2hex(p, job->prevhash, 32);
+	p += strlen(p);
+	p += sprintf(p, "\", \"");
+	bin2hex(p, job->coinbase, coinb1_size);
+	p += strlen(p);
+	p += sprintf(p, "\", \"");
+	bin2hex(p, job->coinbase + coinb2_start, job->coinbase_size - coinb2_start);
+	p += strlen(p);
+	p += sprintf(p, "\", [");
+	for (i = 0; i < job->merkle_count; i++) {
+		p += sprintf(p, i ? ", \"" : "\"");
+		bin2hex(p, job->merkle[i], 32);
+		p += strlen(p);
+		*p++ = '"';
+	}
+	sprintf(p, "], \"%08x\", \"%08x\", \"%08x\", %s], \"odokey\": %u}",
+		be32dec(job->version), be32dec(job->nbits), be32dec(job->ntime),
+		job->clean ? "true" : "false", job->odo_key);
+	return s;
+}
+
+/* Follows the active pool: a new session drops subscribed clients, since
+ * their extranonce1 is gone, and a new job is relayed to the rest */
+static void proxy_update(void)
+{
+	struct stratum_ctx *sctx;
+	struct proxy_client *c, *tmp;
+	char *notify = NULL;
+	bool new_session, new_diff = false;
+	int pool;
+
+	pthread_mutex_lock(&g_work_lock);
+	pool = pools[active_pool].up_since ? active_pool : -1;
+	pthread_mutex_unlock(&g_work_lock);
+	if (pool < 0)
+		return;
+
+	sctx = &pools[pool].ctx;
+	pthread_mutex_lock(&sctx->work_lock);
+	new_session = pool != proxy_pool || sctx->session_seq != proxy_session;
+	if (new_session) {
+		proxy_pool = pool;
+		proxy_session = sctx->session_seq;
+		proxy_prefix_len = sctx->xnonce2_fixed;
+		proxy_xnonce2_size = sctx->xnonce2_size;
+		free(proxy_xnonce1);
+		proxy_xnonce1 = abin2hex(sctx->xnonce1, sctx->xnonce1_size);
+		proxy_job_seq = sctx->job_seq - 1;
+	}
+	proxy_version_rolling = sctx->version_rolling;
+	proxy_version_mask = sctx->version_mask;
+	if (sctx->job_seq != proxy_job_seq) {
+		proxy_job_seq = sctx->job_seq;
+		new_diff = sctx->job.diff != proxy_diff;
+		proxy_diff = sctx->job.diff;
+		notify = proxy_notify_line(sctx);
+	}
+	pthread_mutex_unlock(&sctx->work_lock);
+
+	if (new_session) {
+		list_for_each_entry_safe(c, tmp, &proxy_list, list, struct proxy_client)
+			if (c->prefix)
+				proxy_close(c);
+		proxy_prefixes = 1U << (8 * proxy_prefix_len);
+		free(proxy_by_prefix);
+		proxy_by_prefix = calloc(proxy_prefixes, sizeof(*proxy_by_prefix));
+		if (!proxy_prefix_len)
+			applog(LOG_ERR, "proxy: extranonce2 too short to share with clients");
+	}
+	if (!notify)
+		return;
+
+	free(proxy_notify);
+	proxy_notify = notify;
+	list_for_each_entry_safe(c, tmp, &proxy_list, list, struct proxy_client) {
+		if (c->authorized)
+			proxy_send_work(c, new_diff);
+		if (c->closing)
+			proxy_close(c);
+	}
+}
+
+static void proxy_subscribe(struct proxy_client *c, const char *id)
+{
+	char buf[512];
+	unsigned int i;
+
+	if (!proxy_notify || !proxy_prefix_len) {
+		proxy_reply(c, id, NULL, "[20, \"Upstream not ready\", null]");
+		return;
+	}
+	if (!c->prefix) {
+		for (i = 1; i < proxy_prefixes; i++) {
+			proxy_next_prefix = proxy_next_prefix % (proxy_prefixes - 1) + 1;
+			if (!proxy_by_prefix[proxy_next_prefix])
+				break;
+		}
+		if (i == proxy_prefixes) {
+			proxy_reply(c, id, NULL, "[20, \"Too many clients\", null]");
+			return;
+		}
+		c->prefix = proxy_next_prefix;
+		c->seq = ++proxy_seq;
+		proxy_by_prefix[c->prefix] = c;
+	}
+	snprintf(buf, sizeof(buf), "[[[\"mining.notify\", \"%x\"]], \"%s%0*x\", %d]",
+		 c->prefix, proxy_xnonce1, 2 * proxy_prefix_len, c->prefix,
+		 (int)(proxy_xnonce2_size - proxy_prefix_len));
+	proxy_reply(c, id, buf, NULL);
+	if (c->authorized)
+		proxy_send_work(c, true);
+}
+
+static void proxy_configure(struct proxy_client *c, const char *id,
+	json_t *params)
+{
+	json_t *exts = json_array_get(params, 0);
+	const char *mask;
+	char buf[128];
+	int i, n = json_array_size(exts);
+
+	for (i = 0; i < n; i++)
+		if (!strcmp(json_string_value(json_array_get(exts, i)) ?: "", "version-rolling"))
+			break;
+	if (i == n || !proxy_version_rolling) {
+		proxy_reply(c, id, "{\"version-rolling\": false}", NULL);
+		return;
+	}
+	mask = json_string_value(json_object_get(json_array_get(params, 1),
+	                                         "version-rolling.mask"));
+	c->version_mask = proxy_version_mask & (mask ? strtoul(mask, NULL, 16) : ~0U);
+	sprintf(buf, "{\"version-rolling\": true, \"version-rolling.mask\": \"%08x\"}",
+		c->version_mask);
+	proxy_reply(c, id, buf, NULL);
+}
+
+static bool proxy_hex(const char *s, size_t len)
+{
+	return s && strlen(s) == len && strspn(s, "0123456789abcdefABCDEF") == len;
+}
+
+/* Forwards a share under our own account; the result comes back by way
+ * of share_reply() and proxy_result() */
+static void proxy_submit(struct proxy_client *c, const char *id,
+	json_t *params)
+{
+	struct share_slot from = {0};
+	const char *p[6], *user;
+	char buf[512];
+	int i, n = json_array_size(params);
+
+	if (!c->authorized || !c->prefix) {
+		proxy_reply(c, id, NULL, "[24, \"Unauthorized worker\", null]");
+		return;
+	}
+	for (i = 0; i < n && i < 6; i++)
+		p[i] = json_string_value(json_array_get(params, i));
+	if (n < 5 || n > 6 || !p[1] || strlen(p[1]) > 64 || strpbrk(p[1], "\"\\") ||
+	    !proxy_hex(p[2], 2 * (proxy_xnonce2_size - proxy_prefix_len)) ||
+	    !proxy_hex(p[3], 8) || !proxy_hex(p[4], 8) ||
+	    (n == 6 && (!proxy_hex(p[5], 8) ||
+	                strtoul(p[5], NULL, 16) & ~c->version_mask))) {
+		proxy_reply(c, id, NULL, "[20, \"Invalid parameters\", null]");
+		return;
+	}
+
+	user = pools[proxy_pool].user ? pools[proxy_pool].user : rpc_user;
+	snprintf(buf, sizeof(buf), "\"%s\", \"%s\", \"%0*x%s\", \"%s\", \"%s\"%s%s%s",
+		 user, p[1], 2 * proxy_prefix_len, c->prefix, p[2], p[3], p[4],
+		 n == 6 ? ", \"" : "", n == 6 ? p[5] : "", n == 6 ? "\"" : "");
+	from.client = c->prefix;
+	from.client_seq = c->seq;
+	strcpy(from.client_id, id);
+	if (!stratum_send_share(proxy_pool, buf, &from))
+		proxy_reply(c, id, NULL, "[20, \"Upstream unavailable\", null]");
+}
+
+static void proxy_request(struct proxy_client *c, const char *line)
+{
+	json_t *val, *id_val, *params;
+	json_error_t err;
+	const char *method, *s;
+	char id[24];
+
+	val = JSON_LOADS(line, &err);
+	if (!val) {
+		c->closing = true;
+		return;
+	}
+	method = json_string_value(json_object_get(val, "method"));
+	id_val = json_object_get(val, "id");
+	params = json_object_get(val, "params");
+
+	/* client ids are echoed back, so only plain ones are taken */
+	if (json_is_integer(id_val))
+		sprintf(id, "%lld", (long long)json_integer_value(id_val));
+	else if ((s = json_string_value(id_val)) &&
+	         strlen(s) < sizeof(id) - 2 && !strpbrk(s, "\"\\"))
+		sprintf(id, "\"%s\"", s);
+	else if (!id_val || json_is_null(id_val))
+		strcpy(id, "null");
+	else
+		method = NULL;
+
+	if (!method)
+		;
+	else if (!strcasecmp(method, "mining.submit"))
+		proxy_submit(c, id, params);
+	else if (!strcasecmp(method, "mining.subscribe"))
+		proxy_subscribe(c, id);
+	else if (!strcasecmp(method, "mining.authorize")) {
+		c->authorized = true;
+		proxy_reply(c, id, "true", NULL);
+		if (proxy_notify && c->prefix)
+			proxy_send_work(c, true);
+	} else if (!strcasecmp(method, "mining.configure"))
+		proxy_configure(c, id, params);
+	else if (!strcasecmp(method, "mining.suggest_difficulty"))
+		proxy_reply(c, id, "true", NULL);
+	else if (!strcasecmp(method, "mining.extranonce.subscribe"))
+		proxy_reply(c, id, "false", NULL);
+	else if (strcmp(id, "null"))
+		proxy_reply(c, id, NULL, "[20, \"Unsupported method\", null]");
+
+	json_decref(val);
+}
+
+static void proxy_read(struct proxy_client *c)
+{
+	char *start, *nl;
+	ssize_t n;
+
+	while (!c->closing) {
+		n = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - 1 - c->rlen, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0) {
+			c->closing = true;
+			break;
+		}
+		c->rlen += n;
+		start = c->rbuf;
+		while (!c->closing &&
+		       (nl = memchr(start, '\n', c->rbuf + c->rlen - start))) {
+			*nl = '\0';
+			if (nl > start && strspn(start, " \t\r") < nl - start)
+				proxy_request(c, start);
+			start = nl + 1;
+		}
+		c->rlen -= start - c->rbuf;
+		memmove(c->rbuf, start, c->rlen);
+		if (c->rlen == sizeof(c->rbuf) - 1)
+			c->closing = true;	/* line too long */
+	}
+}
+
+static void proxy_accept(void)
+{
+	struct proxy_client *c;
+	struct epoll_event ev;
+	int fd;
+
+	while ((fd = accept(proxy_listen_fd, NULL, NULL)) >= 0) {
+		c = calloc(1, sizeof(*c));
+		if (!c || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(proxy_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		list_add_tail(&c->list, &proxy_list);
+		pthread_mutex_lock(&proxy_lock);
+		proxy_count++;
+		pthread_mutex_unlock(&proxy_lock);
+	}
+}
+
+static void proxy_drain_replies(void)
+{
+	struct proxy_reply *r, *next;
+	struct proxy_client *c;
+	char err[128];
+
+	pthread_mutex_lock(&proxy_lock);
+	r = proxy_replies;
+	proxy_replies = NULL;
+	pthread_mutex_unlock(&proxy_lock);
+
+	for (; r; r = next) {
+		next = r->next;
+		c = r->client < proxy_prefixes ? proxy_by_prefix[r->client] : NULL;
+		if (c && c->seq == r->client_seq) {
+			sprintf(err, "[23, \"%s\", null]", r->reason[0] ? r->reason : "Rejected");
+			proxy_reply(c, r->client_id, r->result ? "true" : "false",
+			            r->result ? NULL : err);
+			if (c->closing)
+				proxy_close(c);
+		}
+		free(r);
+	}
+}
+
+static void *proxy_thread(void *userdata)
+{
+	struct epoll_event events[64];
+	struct proxy_client *c;
+	char buf[64];
+	int i, n;
+
+	while (1) {
+		n = epoll_wait(proxy_epfd, events, ARRAY_SIZE(events), 1000);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &proxy_listen_fd) {
+				proxy_accept();
+				continue;
+			}
+			if (events[i].data.ptr == proxy_wake) {
+				while (read(proxy_wake[0], buf, sizeof(buf)) > 0);
+				continue;
+			}
+			c = events[i].data.ptr;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				proxy_read(c);
+			if (events[i].events & EPOLLOUT)
+				proxy_flush(c);
+			if (c->closing)
+				proxy_close(c);
+		}
+		proxy_update();
+		proxy_drain_replies();
+	}
+
+	return NULL;
+}
+
+/* Listens on [HOST:]PORT and starts the proxy thread */
+static bool proxy_start(void)
+{
+	struct addrinfo hints, *res, *ai;
+	struct epoll_event ev;
+	struct rlimit rl;
+	char *host, *port;
+	pthread_t pth;
+	int one = 1, err;
+
+	host = strdup(opt_proxy_listen);
+	port = strrchr(host, ':');
+	if (port)
+		*port++ = '\0';
+	else {
+		port = host;
+		host = NULL;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	err = getaddrinfo(host && *host ? host : NULL, port, &hints, &res);
+	free(host ? host : port);
+	if (err) {
+		applog(LOG_ERR, "proxy: cannot resolve %s: %s", opt_proxy_listen,
+		       gai_strerror(err));
+		return false;
+	}
+	proxy_listen_fd = -1;
+	for (ai = res; ai && proxy_listen_fd < 0; ai = ai->ai_next) {
+		proxy_listen_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (proxy_listen_fd < 0)
+			continue;
+		setsockopt(proxy_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(proxy_listen_fd, ai->ai_addr, ai->ai_addrlen) < 0 ||
+		    listen(proxy_listen_fd, SOMAXCONN) < 0) {
+			close(proxy_listen_fd);
+			proxy_listen_fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (proxy_listen_fd < 0) {
+		applog(LOG_ERR, "proxy: cannot listen on %s (errno = %d)",
+		       opt_proxy_listen, errno);
+		return false;
+	}
+
+	/* every client costs a descriptor */
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	proxy_epfd = epoll_create1(0);
+	if (proxy_epfd < 0 || pipe(proxy_wake) < 0) {
+		applog(LOG_ERR, "proxy: setup failed (errno = %d)", errno);
+		return false;
+	}
+	fcntl(proxy_listen_fd, F_SETFL, O_NONBLOCK);
+	fcntl(proxy_wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(proxy_wake[1], F_SETFL, O_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = &proxy_listen_fd;
+	epoll_ctl(proxy_epfd, EPOLL_CTL_ADD, proxy_listen_fd, &ev);
+	ev.data.ptr = proxy_wake;
+	epoll_ctl(proxy_epfd, EPOLL_CTL_ADD, proxy_wake[0], &ev);
+
+	if (pthread_create(&pth, NULL, proxy_thread, NULL)) {
+		applog(LOG_ERR, "proxy thread create failed");
+		return false;
+	}
+	applog(LOG_INFO, "Stratum proxy listening on %s", opt_proxy_listen);
+	return true;
+}
+#endif /* WANT_PROXY */
+
+struct autotune_arg {
+	int		thr_id;
+	int		cpu;
+	int		engine;
+	pthread_t	pth;
+	unsigned long	hashes_done;
+};
+
+static void *autotune_thread(void *userdata)
+{
+	struct autotune_arg *arg = userdata;
+	uint32_t data[32], target[8];
+	unsigned char *scratchbuf = NULL;
+
+	if (arg->cpu >= 0)
+		affine_to_cpu(arg->thr_id, arg->cpu);
+
+	benchmark_work(data, target);
+	data[19] = 0x10000000U * (arg->thr_id & 0xf);
+
+	switch (opt_algo) {
+	case ALGO_SCRYPT:
+		scratchbuf = scrypt_buffer_alloc(opt_scrypt_n);
+		if (scratchbuf)
+			scanhash_scrypt(arg->thr_id, data, scratchbuf, target,
+			                0xffffffffU, &arg->hashes_done, opt_scrypt_n);
+		free(scratchbuf);
+		break;
+	case ALGO_SHA256D:
+		scanhash_sha256d(arg->thr_id, data, target, 0xffffffffU,
+		                 &arg->hashes_done);
+		break;
+	case ALGO_ODO: {
+		struct odo_ctx *odo = malloc(sizeof(*odo));
+		if (odo) {
+			odo_ctx_init(odo, 0);
+			odo_engines[arg->engine].scanhash(arg->thr_id, data, target,
+			                 0xffffffffU, &arg->hashes_done, odo);
+		}
+		free(odo);
+		break;
+	}
+	}
+
+	return NULL;
+}
+
+/* Hash on n_threads threads for AUTOTUNE_SECONDS and return the total rate */
+static double autotune_measure(int engine, int n_threads, const int *cores)
+{
+	struct autotune_arg *args;
+	struct timeval tv_start, tv_end, diff;
+	double hashes = 0.;
+	int i, started;
+
+	args = calloc(n_threads, sizeof(*args));
+	for (i = 0; i < n_threads; i++)
+		work_restart[i].restart = 0;
+
+	gettimeofday(&tv_start, NULL);
+	for (started = 0; started < n_threads; started++) {
+		args[started].thr_id = started;
+		args[started].engine = engine;
+		args[started].cpu = cores ? cores[started] : -1;
+		if (pthread_create(&args[started].pth, NULL, autotune_thread,
+		                   &args[started]))
+			break;
+	}
+	sleep(AUTOTUNE_SECONDS);
+	for (i = 0; i < started; i++)
+		work_restart[i].restart = 1;
+	for (i = 0; i < started; i++) {
+		pthread_join(args[i].pth, NULL);
+		hashes += args[i].hashes_done;
+	}
+	gettimeofday(&tv_end, NULL);
+	timeval_subtract(&diff, &tv_end, &tv_start);
+
+	free(args);
+	return hashes / (diff.tv_sec + 1e-6 * diff.tv_usec);
+}
+
+static bool autotune_apply(json_t *entry, bool keep_threads)
+{
+	const char *engine, *layout;
+	int i, threads;
+
+	threads = json_integer_value(json_object_get(entry, "threads"));
+	layout = json_string_value(json_object_get(entry, "layout"));
+	engine = json_string_value(json_object_get(entry, "engine"));
+	if (threads < 1 || !layout || !engine)
+		return false;
+	for (i = 0; i < odo_engine_count; i++)
+		if (!strcmp(engine, odo_engines[i].name))
+			break;
+	if (opt_algo == ALGO_ODO &&
+	    (i == odo_engine_count || !odo_engines[i].available()))
+		return false;
+
+	if (opt_algo == ALGO_ODO)
+		opt_odo_engine = i;
+	if (!keep_threads) {
+		opt_n_threads = threads;
+		use_physical_cores = !strcmp(layout, "physical");
+	}
+	return true;
+}
+
+static void autotune(void)
+{
+	char model[128], *key, *path, rate[32];
+	int *cores, n_cores, n_engines, engine, best_engine = opt_odo_engine;
+	bool keep_threads = opt_n_threads > 0;
+	bool best_physical = false;
+	int best_threads = 0;
+	double best = -1.;
+	json_t *cache, *entry;
+	json_error_t err;
+
+	cpu_model(model, sizeof(model));
+	key = malloc(strlen(model) + 64);
+	sprintf(key, "%s/%d/%s", model, num_processors, algo_names[opt_algo]);
+	if (keep_threads)
+		sprintf(key + strlen(key), "/t%d", opt_n_threads);
+
+	path = autotune_cache_path();
+	cache = path ? JSON_LOAD_FILE(path, &err) : NULL;
+	if (!json_is_object(cache)) {
+		if (cache)
+			json_decref(cache);
+		cache = json_object();
+	}
+	entry = json_object_get(cache, key);
+	if (entry && autotune_apply(entry, keep_threads)) {
+		applog(LOG_INFO, "Using cached autotune result for %s", model);
+		goto out;
+	}
+
+	applog(LOG_INFO, "Calibrating for %s, this takes a few seconds", model);
+
+	cores = calloc(num_processors, sizeof(int));
+	n_cores = keep_threads ? 0 : physical_cores(cores, num_processors);
+	if (n_cores >= num_processors)
+		n_cores = 0;
+	work_restart = calloc(keep_threads ? opt_n_threads : num_processors,
+	                      sizeof(*work_restart));
+
+	n_engines = opt_algo == ALGO_ODO ? odo_engine_count : 1;
+	for (engine = 0; engine < n_engines; engine++) {
+		int layout;
+		if (opt_algo == ALGO_ODO && !odo_engines[engine].available())
+			continue;
+		for (layout = 0; layout < (n_cores ? 2 : 1); layout++) {
+			int n = layout ? n_cores :
+			        keep_threads ? opt_n_threads : num_processors;
+			double r = autotune_measure(engine, n, layout ? cores : NULL);
+			sprintf(rate, r >= 1e6 ? "%.0f" : "%.2f", 1e-3 * r);
+			applog(LOG_INFO, "autotune: %s, %d threads (%s): %s khash/s",
+			       opt_algo == ALGO_ODO ? odo_engines[engine].name : algo_names[opt_algo],
+			       n, layout ? "physical" : "logical", rate);
+			if (r > best) {
+				best = r;
+				best_engine = engine;
+				best_threads = n;
+				best_physical = layout;
+			}
+		}
+	}
+
+	free(cores);
+	free(work_restart);
+	work_restart = NULL;
+
+	entry = json_object();
+	json_object_set_new(entry, "threads", json_integer(best_threads));
+	json_object_set_new(entry, "layout",
+		json_string(best_physical ? "physical" : "logical"));
+	json_object_set_new(entry, "engine", json_string(odo_engines[best_engine].name));
+	json_object_set_new(cache, key, entry);
+	autotune_apply(entry, keep_threads);
+	if (path && json_dump_file(cache, path, JSON_INDENT(2)))
+		applog(LOG_WARNING, "Failed to write autotune cache %s", path);
+
+	applog(LOG_INFO, "autotune: selected %d threads (%s)%s%s",
+	       opt_n_threads ? opt_n_threads : best_threads,
+	       use_physical_cores ? "physical" : "logical",
+	       opt_algo == ALGO_ODO ? ", engine " : "",
+	       opt_algo == ALGO_ODO ? odo_engines[opt_odo_engine].name : "");
+
+out:
+	json_decref(cache);
+	free(path);
+	free(key);
+}
+
+#ifndef WIN32
+static void signal_handler(int sig)
+{
+	switch (sig) {
+	case SIGHUP:
+		applog(LOG_INFO, "SIGHUP received");
+		break;
+	case SIGINT:
+		applog(LOG_INFO, "SIGINT received, exiting");
+		exit(0);
+		break;
+	case SIGTERM:
+		applog(LOG_INFO, "SIGTERM received, exiting");
+		exit(0);
+		break;
+	}
+}
+
+/* SIGUSR1 is blocked in every thread and taken here, outside of any lock
+ * the thread it would otherwise interrupt may hold */
+static void *signal_thread(void *userdata)
+{
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while (!sigwait(&set, &sig))
+		show_restart_latency();
+	return NULL;
+}
+#endif
+
+
+int main(int argc, char *argv[])
+{
+	struct thr_info *thr;
+	long flags;
+	int i;
+
+
+	rpc_user = strdup("");
+	rpc_pass = strdup("");
+
+	/* parse command line */
+	parse_cmdline(argc, argv);
+
+	if (!opt_benchmark && !rpc_url) {
+		fprintf(stderr, "%s: no URL supplied\n", argv[0]);
+		show_usage_and_exit(1);
+	}
+
+	if (!rpc_userpass) {
+		rpc_userpass = malloc(strlen(rpc_user) + strlen(rpc_pass) + 2);
+		if (!rpc_userpass)
+			return 1;
+		sprintf(rpc_userpass, "%s:%s", rpc_user, rpc_pass);
+	}
+
+	pthread_mutex_init(&applog_lock, NULL);
+	pthread_mutex_init(&stats_lock, NULL);
+	pthread_mutex_init(&share_lock, NULL);
+	pthread_mutex_init(&proxy_lock, NULL);
+	pthread_mutex_init(&g_work_lock, NULL);
+	pthread_mutex_init(&thr_lock, NULL);
+	pthread_mutex_init(&merkle_lock, NULL);
+	pthread_cond_init(&thr_cond, NULL);
+	for (i = 0; i < pool_count; i++) {
+		pthread_mutex_init(&pools[i].ctx.sock_lock, NULL);
+		pthread_mutex_init(&pools[i].ctx.work_lock, NULL);
+		pools[i].ctx.proxied = opt_proxy_listen != NULL;
+	}
+
+	flags = opt_benchmark || (strncasecmp(rpc_url, "https://", 8) &&
+	                          strncasecmp(rpc_url, "stratum+tcps://", 15))
+	      ? (CURL_GLOBAL_ALL & ~CURL_GLOBAL_SSL)
+	      : CURL_GLOBAL_ALL;
+	if (curl_global_init(flags)) {
+		applog(LOG_ERR, "CURL initialization failed");
+		return 1;
+	}
+
+#ifndef WIN32
+	if (opt_background) {
+		i = fork();
+		if (i < 0) exit(1);
+		if (i > 0) exit(0);
+		i = setsid();
+		if (i < 0)
+			applog(LOG_ERR, "setsid() failed (errno = %d)", errno);
+		i = chdir("/");
+		if (i < 0)
+			applog(LOG_ERR, "chdir() failed (errno = %d)", errno);
+		signal(SIGHUP, signal_handler);
+		signal(SIGINT, signal_handler);
+		signal(SIGTERM, signal_handler);
+	}
+	{
+		pthread_t pth;
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+		if (pthread_create(&pth, NULL, signal_thread, NULL))
+			applog(LOG_WARNING, "signal thread create failed");
+	}
+#endif
+
+#if defined(WIN32)
+	SYSTEM_INFO sysinfo;
+	GetSystemInfo(&sysinfo);
+	num_processors = sysinfo.dwNumberOfProcessors;
 #elif defined(_SC_NPROCESSORS_CONF)
 	num_processors = sysconf(_SC_NPROCESSORS_CONF);
 #elif defined(CTL_HW) && defined(HW_NCPU)
@@ -1955,32 +4805,49 @@ int main(int argc, char *argv[])
 #endif
 	if (num_processors < 1)
 		num_processors = 1;
+	auto_threads = !opt_n_threads;
+	if (opt_autotune)
+		autotune();
 	if (!opt_n_threads)
 		opt_n_threads = num_processors;
+	if (!max_threads)
+		max_threads = opt_n_threads > num_processors ? opt_n_threads : num_processors;
+	if (opt_n_threads > max_threads) {
+		applog(LOG_ERR, "--max-threads must not be lower than --threads");
+		return 1;
+	}
 
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog)
 		openlog("cpuminer", LOG_PID, LOG_USER);
 #endif
 
-	work_restart = calloc(opt_n_threads, sizeof(*work_restart));
+	/* per-thread state is sized for max_threads so that resizing
+	 * the pool never moves it */
+	work_restart = calloc(max_threads, sizeof(*work_restart));
 	if (!work_restart)
 		return 1;
 
-	thr_info = calloc(opt_n_threads + 3, sizeof(*thr));
+	thr_info = calloc(max_threads + 3, sizeof(*thr));
 	if (!thr_info)
 		return 1;
 	
-	thr_hashrates = (double *) calloc(opt_n_threads, sizeof(double));
+	thr_hashrates = (double *) calloc(max_threads, sizeof(double));
 	if (!thr_hashrates)
 		return 1;
 
+	thr_cpu = malloc(max_threads * sizeof(int));
+	cpu_list = malloc(num_processors * sizeof(int));
+	if (!thr_cpu || !cpu_list)
+		return 1;
+
 	/* init workio thread info */
-	work_thr_id = opt_n_threads;
+	work_thr_id = max_threads;
 	thr = &thr_info[work_thr_id];
 	thr->id = work_thr_id;
 	thr->q = tq_new();
-	if (!thr->q)
+	workio_multi = curl_multi_init();
+	if (!thr->q || !workio_multi)
 		return 1;
 
 	/* start work I/O thread */
@@ -1991,7 +4858,7 @@ int main(int argc, char *argv[])
 
 	if (want_longpoll && !have_stratum) {
 		/* init longpoll thread info */
-		longpoll_thr_id = opt_n_threads + 1;
+		longpoll_thr_id = max_threads + 1;
 		thr = &thr_info[longpoll_thr_id];
 		thr->id = longpoll_thr_id;
 		thr->q = tq_new();
@@ -2006,7 +4873,7 @@ int main(int argc, char *argv[])
 	}
 	if (want_stratum) {
 		/* init stratum thread info */
-		stratum_thr_id = opt_n_threads + 2;
+		stratum_thr_id = max_threads + 2;
 		thr = &thr_info[stratum_thr_id];
 		thr->id = stratum_thr_id;
 		thr->q = tq_new();
@@ -2014,7 +4881,8 @@ int main(int argc, char *argv[])
 			return 1;
 
 		/* start stratum thread */
-		if (unlikely(pthread_create(&thr->pth, NULL, stratum_thread, thr))) {
+		pools_alive = 1;
+		if (unlikely(pthread_create(&thr->pth, NULL, stratum_thread, &pools[0]))) {
 			applog(LOG_ERR, "stratum thread create failed");
 			return 1;
 		}
@@ -2022,25 +4890,80 @@ int main(int argc, char *argv[])
 		if (have_stratum)
 			tq_push(thr_info[stratum_thr_id].q, strdup(rpc_url));
 	}
-
-	/* start mining threads */
-	for (i = 0; i < opt_n_threads; i++) {
-		thr = &thr_info[i];
-
-		thr->id = i;
-		thr->q = tq_new();
-		if (!thr->q)
+	if (opt_split) {
+		double weights = 0.;
+		if (!have_stratum) {
+			applog(LOG_ERR, "--split requires a Stratum URL");
+			return 1;
+		}
+		for (i = 0; i < pool_count; i++) {
+			weights += pools[i].weight;
+			pools[i].correction = 1.;
+		}
+		if (!weights) {
+			applog(LOG_ERR, "--split needs a nonzero weight for a configured pool");
 			return 1;
+		}
+	}
+	if (have_stratum && pool_count > 1) {
+		/* backup pools connect right away and stay hot */
+		for (i = 1; i < pool_count; i++) {
+			pthread_t pth;
+			pthread_mutex_lock(&g_work_lock);
+			pools_alive++;
+			pthread_mutex_unlock(&g_work_lock);
+			if (pthread_create(&pth, NULL, stratum_thread, &pools[i])) {
+				applog(LOG_ERR, "stratum thread create failed");
+				return 1;
+			}
+		}
+	}
 
-		if (unlikely(pthread_create(&thr->pth, NULL, miner_thread, thr))) {
-			applog(LOG_ERR, "thread %d create failed", i);
+#ifdef WANT_PROXY
+	if (opt_proxy_listen) {
+		if (!have_stratum) {
+			applog(LOG_ERR, "--proxy-listen requires a Stratum URL");
 			return 1;
 		}
+		if (!proxy_start())
+			return 1;
+	}
+#endif
+
+	/* start mining threads */
+	{
+		int *cpus = malloc(num_processors * sizeof(int));
+		int n_cpus, active = opt_n_threads;
+		int budget = cpu_budget(cpus, &n_cpus);
+		if (budget < active) {
+			if (auto_threads)
+				active = budget;
+			else if (opt_debug)
+				applog(LOG_DEBUG, "DEBUG: %d threads exceed the CPU budget of %d",
+				       opt_n_threads, budget);
+		}
+		i = set_thread_layout(active, cpus, n_cpus);
+		free(cpus);
+		if (!i)
+			return 1;
+	}
+
+	if (auto_threads) {
+		pthread_t pth;
+		if (pthread_create(&pth, NULL, cpu_watch_thread, NULL))
+			applog(LOG_WARNING, "CPU budget watch thread create failed");
 	}
+#ifndef WIN32
+	if (opt_control) {
+		pthread_t pth;
+		if (pthread_create(&pth, NULL, control_thread, NULL))
+			applog(LOG_WARNING, "control thread create failed");
+	}
+#endif
 
 	applog(LOG_INFO, "%d miner threads started, "
 		"using '%s' algorithm.",
-		opt_n_threads,
+		active_threads,
 		algo_names[opt_algo]);
 
 	/* main loop - simply wait for workio thread to exit */
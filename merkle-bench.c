@@ -0,0 +1,197 @@
+/*
+ * Copyright 2026 zhangcongrong
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * merkle-bench: times the getblocktemplate merkle tree on large random
+ * templates, comparing the full scalar rebuild that gbt_work_decode used
+ * to do with merkle_update, and checks that both give the same root.
+ * For each size it measures a first build, a new coinbase on the same
+ * transactions, and an update that replaces and appends a few of them.
+ */
+
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/time.h>
+
+#include "miner.h"
+
+/* sha2.c also holds the scan functions, which refer to these */
+struct work_restart *work_restart;
+
+bool fulltest(const uint32_t *hash, const uint32_t *target)
+{
+	return false;
+}
+
+char *abin2hex(const unsigned char *p, size_t len)
+{
+	return NULL;
+}
+
+void applog(int prio, const char *fmt, ...)
+{
+}
+
+#define BENCH_ROUNDS	5	/* runs averaged per measurement */
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+static void random_hash(unsigned char *h)
+{
+	int i;
+
+	for (i = 0; i < 32; i++)
+		h[i] = rand();
+}
+
+/* The rebuild gbt_work_decode used to do; tree[0] is the coinbase hash */
+static void scalar_root(unsigned char *root, unsigned char (*tree)[32],
+	int count)
+{
+	unsigned char (*t)[32] = malloc(32 * (count + 2));
+	int i, n = 1 + count;
+
+	memcpy(t, tree, 32 * n);
+	while (n > 1) {
+		if (n % 2) {
+			memcpy(t[n], t[n - 1], 32);
+			++n;
+		}
+		n /= 2;
+		for (i = 0; i < n; i++)
+			sha256d(t[i], t[2 * i], 64);
+	}
+	memcpy(root, t[0], 32);
+	free(t);
+}
+
+static bool cached_root(unsigned char *root, struct merkle_cache *mc,
+	unsigned char (*tree)[32], int count)
+{
+	if (!merkle_update(mc, tree + 1, count))
+		return false;
+	merkle_root(root, mc, tree[0]);
+	return true;
+}
+
+static void merkle_free(struct merkle_cache *mc)
+{
+	int i;
+
+	for (i = 0; i < MERKLE_LEVELS; i++)
+		free(mc->node[i]);
+	memset(mc, 0, sizeof(*mc));
+}
+
+/* Replaces changes transactions and appends as many, as a new template
+ * after a few blocks' worth of mempool churn would */
+static int churn(unsigned char (*tree)[32], int count, int changes)
+{
+	int i;
+
+	for (i = 0; i < changes; i++)
+		random_hash(tree[1 + rand() % count]);
+	for (i = 0; i < changes; i++)
+		random_hash(tree[1 + count++]);
+	return count;
+}
+
+/* Returns false if a root differs from the scalar rebuild */
+static bool bench(int count)
+{
+	int changes = count / 100 + 1;
+	unsigned char (*tree)[32] = malloc(32 * (1 + count + BENCH_ROUNDS * 2 * changes));
+	unsigned char want[32], got[32];
+	struct merkle_cache mc = { 0 };
+	double t_scalar = 0, t_first = 0, t_coinbase = 0, t_churn = 0, t;
+	bool ok = true;
+	int r, n;
+
+	if (!tree) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (n = 0; n <= count; n++)
+		random_hash(tree[n]);
+
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		t = now();
+		scalar_root(want, tree, count);
+		t_scalar += now() - t;
+
+		merkle_free(&mc);
+		t = now();
+		ok = cached_root(got, &mc, tree, count) && ok;
+		t_first += now() - t;
+		ok = ok && !memcmp(got, want, 32);
+	}
+
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		random_hash(tree[0]);
+		t = now();
+		ok = cached_root(got, &mc, tree, count) && ok;
+		t_coinbase += now() - t;
+		scalar_root(want, tree, count);
+		ok = ok && !memcmp(got, want, 32);
+	}
+
+	for (r = 0, n = count; r < BENCH_ROUNDS; r++) {
+		n = churn(tree, n, changes);
+		t = now();
+		ok = cached_root(got, &mc, tree, n) && ok;
+		t_churn += now() - t;
+		scalar_root(want, tree, n);
+		ok = ok && !memcmp(got, want, 32);
+	}
+
+	printf("%7d %12.3f %12.3f %12.3f %12.3f  %s\n", count,
+	       1e3 * t_scalar / BENCH_ROUNDS, 1e3 * t_first / BENCH_ROUNDS,
+	       1e3 * t_coinbase / BENCH_ROUNDS, 1e3 * t_churn / BENCH_ROUNDS,
+	       ok ? "ok" : "ROOT MISMATCH");
+
+	merkle_free(&mc);
+	free(tree);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int sizes[] = { 1000, 2500, 5000, 10000, 20000 };
+	bool ok = true;
+	int i;
+
+	srand(1);
+	printf("milliseconds per template; churn replaces and appends 1%%\n");
+	printf("%7s %12s %12s %12s %12s\n",
+	       "txs", "scalar", "first build", "new coinbase", "churn");
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			if (atoi(argv[i]) < 1) {
+				fprintf(stderr, "Usage: %s [TRANSACTIONS...]\n", argv[0]);
+				return 1;
+			}
+			ok = bench(atoi(argv[i])) && ok;
+		}
+	} else {
+		for (i = 0; i < ARRAY_SIZE(sizes); i++)
+			ok = bench(sizes[i]) && ok;
+	}
+	return !ok;
+}
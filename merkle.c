@@ -0,0 +1,100 @@
+/*
+ * Copyright 2026 zhangcongrong
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "cpuminer-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "miner.h"
+
+/* Sets the count transaction hashes of the tree and rehashes only the
+ * nodes above those that changed, batched through sha256d_lanes. */
+bool merkle_update(struct merkle_cache *mc, unsigned char (*leaves)[32],
+	int count)
+{
+	unsigned char (*below)[32], *dirty, *pairs;
+	int *pos;
+	int L, i, j, k, a, b, n, old_n, n_below = 0, old_below = 0;
+	bool rc = false;
+
+	n = 1 + count;
+	dirty = calloc(n, 1);
+	pos = malloc((n / 2 + 1) * sizeof(*pos));
+	pairs = malloc(64 * (n / 2 + 1));
+	if (!dirty || !pos || !pairs)
+		goto out;
+
+	for (L = 0; L < MERKLE_LEVELS; L++) {
+		old_n = L < mc->levels ? mc->n[L] : 0;
+		if (n > mc->cap[L]) {
+			void *p = realloc(mc->node[L], 32 * n);
+			if (!p)
+				goto out;
+			mc->node[L] = p;
+			mc->cap[L] = n;
+		}
+		if (!L) {
+			for (i = 1; i < n; i++) {
+				dirty[i] = i >= old_n ||
+				           memcmp(mc->node[0][i], leaves[i - 1], 32);
+				if (dirty[i])
+					memcpy(mc->node[0][i], leaves[i - 1], 32);
+			}
+		} else {
+			below = mc->node[L - 1];
+			for (i = 1, k = 0; i < n; i++) {
+				a = 2 * i;
+				b = a + 1 < n_below ? a + 1 : a;
+				dirty[i] = i >= old_n || dirty[a] || dirty[b] ||
+				           (a + 1 < n_below) != (a + 1 < old_below);
+				if (!dirty[i])
+					continue;
+				memcpy(pairs + 64 * k, below[a], 32);
+				memcpy(pairs + 64 * k + 32, below[b], 32);
+				pos[k++] = i;
+			}
+			sha256d_lanes(pairs, NULL, 0, pairs, 64, k);
+			for (j = 0; j < k; j++)
+				memcpy(mc->node[L][pos[j]], pairs + 32 * j, 32);
+		}
+		mc->n[L] = n;
+		if (n == 1)
+			break;
+		old_below = old_n;
+		n_below = n;
+		n = (n + 1) / 2;
+	}
+	mc->levels = L + 1;
+	rc = true;
+
+out:
+	if (!rc)
+		mc->levels = 0;
+	free(dirty);
+	free(pos);
+	free(pairs);
+	return rc;
+}
+
+/* Root of the tree for the given first leaf. */
+void merkle_root(unsigned char *root, const struct merkle_cache *mc,
+	const unsigned char *leaf)
+{
+	unsigned char buf[64];
+	int L;
+
+	memcpy(buf, leaf, 32);
+	for (L = 0; L + 1 < mc->levels; L++) {
+		memcpy(buf + 32, mc->node[L][1], 32);
+		sha256d(buf, buf, 64);
+	}
+	memcpy(root, buf, 32);
+}
@@ -36,6 +36,8 @@ void *alloca (size_t);
 # endif
 #endif
 
+#include "odo_crypt.h"
+
 #ifdef HAVE_SYSLOG_H
 #include <syslog.h>
 #else
@@ -135,6 +137,26 @@ static inline void le32enc(void *pp, uint32_t x)
 void sha256_init(uint32_t *state);
 void sha256_transform(uint32_t *state, const uint32_t *block, int swap);
 void sha256d(unsigned char *hash, const unsigned char *data, int len);
+void sha256d_lanes(unsigned char *hash, const uint32_t *midstate,
+	int prefix_len, const unsigned char *tail, int tail_len, int n);
+
+#define MERKLE_LEVELS	32
+
+/* A transaction merkle tree kept from one template to the next.  Level 0
+ * holds the transaction hashes from index 1 on; the nodes at index 0,
+ * which depend on the coinbase, are left out, so that a new coinbase
+ * only needs its branch node[L][1] hashed in. */
+struct merkle_cache {
+	int levels;
+	int n[MERKLE_LEVELS];
+	int cap[MERKLE_LEVELS];
+	unsigned char (*node[MERKLE_LEVELS])[32];
+};
+
+bool merkle_update(struct merkle_cache *mc, unsigned char (*leaves)[32],
+	int count);
+void merkle_root(unsigned char *root, const struct merkle_cache *mc,
+	const unsigned char *leaf);
 
 #ifdef USE_ASM
 #if defined(__ARM_NEON__) || defined(__ALTIVEC__) || defined(__i386__) || defined(__x86_64__)
@@ -159,6 +181,30 @@ extern int scanhash_scrypt(int thr_id, uint32_t *pdata,
 	unsigned char *scratchbuf, const uint32_t *ptarget,
 	uint32_t max_nonce, unsigned long *hashes_done, int N);
 
+/* Everything Odo derives from the key, built once per key change */
+struct odo_ctx {
+	uint32_t key;
+	OdoCrypt crypt;
+	uint32_t h256[8];
+	uint32_t k256[64];
+};
+
+extern void odo_ctx_init(struct odo_ctx *ctx, uint32_t key);
+extern uint32_t odo_key_at(uint32_t ntime);
+extern int scanhash_odo(int thr_id, uint32_t *pdata, const uint32_t *ptarget,
+	uint32_t max_nonce, unsigned long *hashes_done, struct odo_ctx *ctx);
+
+struct odo_engine {
+	const char *name;
+	int (*available)(void);
+	int (*scanhash)(int thr_id, uint32_t *pdata, const uint32_t *ptarget,
+		uint32_t max_nonce, unsigned long *hashes_done,
+		struct odo_ctx *ctx);
+};
+
+extern const struct odo_engine odo_engines[];
+extern const int odo_engine_count;
+
 struct thr_info {
 	int		id;
 	pthread_t	pth;
@@ -167,12 +213,13 @@ struct thr_info {
 
 struct work_restart {
 	volatile unsigned long	restart;
-	char			padding[128 - sizeof(unsigned long)];
+	struct timeval		tv;	/* when restart was requested */
+	uint32_t		batch;	/* nonces between restart checks */
+	char			padding[128 - sizeof(unsigned long)
+				        - sizeof(struct timeval) - sizeof(uint32_t)];
 };
 
 
-extern uint32_t g_odo_key;
-
 extern bool opt_debug;
 extern bool opt_protocol;
 extern bool opt_redirect;
@@ -199,6 +246,10 @@ extern struct work_restart *work_restart;
 extern void applog(int prio, const char *fmt, ...);
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 	const char *rpc_req, int *curl_err, int flags);
+struct json_rpc_req;
+extern struct json_rpc_req *json_rpc_begin(CURL *curl, const char *url,
+	const char *userpass, const char *rpc_req, int flags);
+extern json_t *json_rpc_end(struct json_rpc_req *r, int rc, int *curl_err);
 void memrev(unsigned char *p, size_t len);
 extern void bin2hex(char *s, const unsigned char *p, size_t len);
 extern char *abin2hex(const unsigned char *p, size_t len);
@@ -210,19 +261,30 @@ extern int timeval_subtract(struct timeval *result, struct timeval *x,
 extern bool fulltest(const uint32_t *hash, const uint32_t *target);
 extern void diff_to_target(uint32_t *target, double diff);
 
+#define STRATUM_ROOTS	8
+
+/* Buffers are reused from job to job and only grow */
 struct stratum_job {
 	char *job_id;
+	size_t job_id_size;
 	unsigned char prevhash[32];
 	size_t coinbase_size;
+	size_t coinbase_alloc;
 	unsigned char *coinbase;
 	unsigned char *xnonce2;
+	size_t cb_prefix;		/* whole coinbase blocks before xnonce2 */
+	uint32_t cb_midstate[8];	/* SHA-256 state after cb_prefix bytes */
+	int roots_next, roots_ready;	/* Merkle roots for upcoming xnonce2 */
+	unsigned char roots[STRATUM_ROOTS][32];
 	int merkle_count;
-	unsigned char **merkle;
+	int merkle_alloc;
+	unsigned char (*merkle)[32];
 	unsigned char version[4];
 	unsigned char nbits[4];
 	unsigned char ntime[4];
 	bool clean;
 	double diff;
+	uint32_t odo_key;
 };
 
 struct stratum_ctx {
@@ -232,17 +294,39 @@ struct stratum_ctx {
 	char *curl_url;
 	char curl_err_str[CURL_ERROR_SIZE];
 	curl_socket_t sock;
+	int epfd;
+	bool want_write;
 	size_t sockbuf_size;
+	size_t sockbuf_start;	/* first unconsumed byte */
+	size_t sockbuf_scan;	/* newline search resumes here */
+	size_t sockbuf_end;	/* end of received data */
 	char *sockbuf;
+	size_t sendbuf_size;
+	size_t sendbuf_len;	/* queued output not yet sent */
+	char *sendbuf;
 	pthread_mutex_t sock_lock;
+	char last_addr[64];	/* numeric address that last connected */
+	unsigned long connects;
+	double connect_ms;	/* latest connect time */
+	double connect_ms_sum;
 
 	double next_diff;
+	uint32_t odo_key;	/* last key announced by the pool */
+	bool odo_key_sent;	/* the pool announces keys at all */
+	uint32_t odo_key_local;	/* key derived from the last job's ntime */
 
 	char *session_id;
 	size_t xnonce1_size;
 	unsigned char *xnonce1;
 	size_t xnonce2_size;
+	size_t xnonce2_fixed;	/* leading xnonce2 bytes we do not roll */
+	bool proxied;		/* those bytes prefix proxy clients' extranonce1 */
+	unsigned long session_seq;	/* bumped when the extranonce changes */
+	bool version_rolling;	/* negotiated with mining.configure */
+	uint32_t version_mask;
 	struct stratum_job job;
+	unsigned long job_seq;	/* bumped on every new job */
+	unsigned long clean_seq;	/* bumped when a job supersedes the others */
 	pthread_mutex_t work_lock;
 };
 
@@ -251,9 +335,13 @@ bool stratum_send_line(struct stratum_ctx *sctx, char *s);
 char *stratum_recv_line(struct stratum_ctx *sctx);
 bool stratum_connect(struct stratum_ctx *sctx, const char *url);
 void stratum_disconnect(struct stratum_ctx *sctx);
+bool stratum_configure(struct stratum_ctx *sctx);
 bool stratum_subscribe(struct stratum_ctx *sctx);
+bool stratum_extranonce_subscribe(struct stratum_ctx *sctx);
 bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *pass);
 bool stratum_handle_method(struct stratum_ctx *sctx, const char *s);
+int stratum_proxy_prefix(size_t xnonce2_size);
+int stratum_parse_reply(char *s, int *id, bool *result, const char **reason);
 
 struct thread_q;
 
@@ -0,0 +1,284 @@
+/*
+ * Copyright 2026 zhangcongrong
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * notify-bench: times stratum_handle_method on mining.notify lines of
+ * 0 to 16 Merkle branches, through the in-place parser and through the
+ * jansson fallback, and checks that both decode the same job.  The lines
+ * were captured from stratum-sim; a file with other captured lines, one
+ * per line, can be given instead.
+ */
+
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/time.h>
+
+#include "miner.h"
+
+/* The miner globals util.c refers to, as minerd leaves them for a
+ * Stratum pool */
+bool opt_debug = false;
+bool opt_protocol = false;
+bool opt_redirect = true;
+int opt_timeout = 300;
+bool want_longpoll = false;
+bool have_longpoll = false;
+bool have_gbt = false;
+bool allow_getwork = false;
+bool want_stratum = true;
+bool have_stratum = true;
+char *opt_cert;
+char *opt_proxy;
+long opt_proxy_type;
+bool use_syslog = false;
+pthread_mutex_t applog_lock;
+struct thr_info *thr_info;
+int longpoll_thr_id = -1;
+int stratum_thr_id = -1;
+struct work_restart *work_restart;
+
+#define NOTIFY_ROUNDS	10000	/* parses timed per line and path */
+#define MAX_LINE	65536
+
+static const char *captured[] = {
+	/* 0 Merkle branches */
+	"{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"0\", \""
+	"aeae222e11742b4458c8f443afd848edb6f8dd166159bdae4d92a215d771ba98\", "
+	"\"010000000100000000000000000000000000000000000000000000000000000000"
+	"00000000ffffffff0c0340420f\", \"ffffffff0100f2052a010000000151000000"
+	"00\", [], \"20000000\", \"1d00ffff\", \"6ad5cc47\", true], \"odokey\": 211}",
+	/* 1 Merkle branches */
+	"{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"0\", \""
+	"3f3f668579f991ce4fdaf917e09090cca5f637eeb02a11734e83f154b37a8346\", "
+	"\"010000000100000000000000000000000000000000000000000000000000000000"
+	"00000000ffffffff0c0340420f\", \"ffffffff0100f2052a010000000151000000"
+	"00\", [\"e1b46c09887aee6bdfe14d9d6da7ae80b71e9666c349e680c2cb9db1020"
+	"02cac\"], \"20000000\", \"1d00ffff\", \"6ad5cc47\", true], \"odokey\": 211}",
+	/* 2 Merkle branches */
+	"{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"0\", \""
+	"3f3f668579f991ce4fdaf917e09090cca5f637eeb02a11734e83f154b37a8346\", "
+	"\"010000000100000000000000000000000000000000000000000000000000000000"
+	"00000000ffffffff0c0340420f\", \"ffffffff0100f2052a010000000151000000"
+	"00\", [\"e1b46c09887aee6bdfe14d9d6da7ae80b71e9666c349e680c2cb9db1020"
+	"02cac\", \"38b531519421ff1a39f32ca251c44613d3c52034ebb83ba21bc807d03"
+	"aaafc12\"], \"20000000\", \"1d00ffff\", \"6ad5cc48\", true], \"odoke"
+	"y\": 211}",
+	/* 4 Merkle branches */
+	"{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"0\", \""
+	"0505d5a29604138830bea634b297863e7ed700aff4bcaa24c40b07e8c46e2703\", "
+	"\"010000000100000000000000000000000000000000000000000000000000000000"
+	"00000000ffffffff0c0340420f\", \"ffffffff0100f2052a010000000151000000"
+	"00\", [\"a65f7a3be1936b10b9cf7ed8056a1c2bcc072657ff435d1489f4a059b56"
+	"c7f3a\", \"d4f3d44a43043b57cfba7386211b1d6dcc6d60ab071166ab09ee244a8"
+	"1f6029f\", \"0fd5772390ec1ac5002ebeff496eb03c741cdf1313a00f1eb16ca26"
+	"a8cfbde40\", \"da684a9691bb9efd5bf3a562ab055dc4ad2c5c5e9eec9f9783dcd"
+	"ae51ee3e3cd\"], \"20000000\", \"1d00ffff\", \"6ad5cc48\", true], \"o"
+	"dokey\": 211}",
+	/* 6 Merkle branches */
+	"{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"0\", \""
+	"9696d0f9bfe96979102bfcdb0d70979a6a1d0540cab44d528b11436acda1619d\", "
+	"\"010000000100000000000000000000000000000000000000000000000000000000"
+	"00000000ffffffff0c0340420f\", \"ffffffff0100f2052a010000000151000000"
+	"00\", [\"57e495dae31b6f1b970c1ddf1a5fcdd6fb7e7caaed071ff84220c9f0bbb"
+	"0c2af\", \"15b554168e32cbf2f04957bd3c13c70e6ca9aed2958fb392009e29fa3"
+	"e3d7a45\", \"d21d8f43afd2c416192289262d98a5149c29ce7a80e8e24f8b56dac"
+	"157fed45f\", \"1491c0e83efcd34d5beddd8d37a8792cc693d1cd3f77e1199818a"
+	"9726eafb544\", \"29c715dab08e4e27eb081fb5262b4c3c93c9152aa9ecc470a57"
+	"efae02d9b0f7e\", \"a6809161911b98134ccd8d7b8c220bfed50ebc394fc65a191"
+	"ff05d496a6e3d7b\"], \"20000000\", \"1d00ffff\", \"6ad5cc49\", true],"
+	" \"odokey\": 211}",
+	/* 8 Merkle branches */
+	"{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"0\", \""
+	"5c5c9b166854dbd76fa7e3103f7719e8393c02e94ef2ee5d410945e682add5e0\", "
+	"\"010000000100000000000000000000000000000000000000000000000000000000"
+	"00000000ffffffff0c0340420f\", \"ffffffff0100f2052a010000000151000000"
+	"00\", [\"a8cf8ba87a12726031aa0e0a52e22fa588670c53110d648c09f7cc9894f"
+	"c29b1\", \"31f3b1d5494f6fefce9090610cbc9c3873b1ee9579ae4e5b6238d280f"
+	"d2974b8\", \"ee229479ce0fc3ce6466767a470621450dec60056fd2aa135b05a8a"
+	"54012f311\", \"a4791f2a5a9ef2e86fcf78a51ae8af34cb5f7991a449585494278"
+	"394800a363e\", \"ebd3b0e7169c8ba83ffaed6e8aa99959753c38da5ac8dc7ebec"
+	"b9f6d83594efc\", \"854402e6e5daaa83781bfe756a257619600ea5d14bfe7a929"
+	"95333a7bf3b29c9\", \"318ed4649a032c0c1532766c61636e69c084b2b098d5bcd"
+	"afb4e39b13ba105ab\", \"fb02f8cde5104a33f89dfb78a0a2afcd93ebba653239e"
+	"50e67727811fc2735d2\"], \"20000000\", \"1d00ffff\", \"6ad5cc49\", tr"
+	"ue], \"odokey\": 211}",
+	/* 12 Merkle branches */
+	"{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"0\", \""
+	"9b7e068a0ffba346d3c38002655c80b44cb045ae08d630351241c23b1ef67b91\", "
+	"\"010000000100000000000000000000000000000000000000000000000000000000"
+	"00000000ffffffff0c0340420f\", \"ffffffff0100f2052a010000000151000000"
+	"00\", [\"10dca3a7e09bdb071904e5cdd14af0e27253f5e1b3dc6264de3bfbcc8bd"
+	"dbcb8\", \"f47c779fdc2c9da27f4b791b20fc720a9b6682b9374d0c9f6418d12f6"
+	"be53961\", \"bcc3b432d983c50125d73320260edf3c656daa45cc927eb5cda11cf"
+	"68768f4d8\", \"627936599cb0429515f1682e8dfea6d33179061f99955061ac4ef"
+	"2c87822152c\", \"1193c00c2814f45c27a2517d40f4021579e59145ce68d74c376"
+	"f6928fefb4c96\", \"f359e91a4c61e08dbc07835fb953836c18e7e339a4ee236de"
+	"4a069a9d702cda9\", \"badd98a110f7601f51f28d336b67e8481d595a49944500d"
+	"558d8bfe2855f9451\", \"198836df76462635010d60ef9c39213b31f3f7c627f0e"
+	"adbd4be000f1a66c6c1\", \"fdbfcce8a794bf0d5e5aa72587d6c1f7d44f375af16"
+	"1dc839f2529303d19c78e\", \"bca3996a581614029eb129fcd00107ab18af6810d"
+	"26124a5db561d38c141c3c5\", \"5f5390cd7cb6faf85b568d01f7f9da60a80b364"
+	"95caad1ff4ff112ab541dbea4\", \"4c96e144387b8280330f00cc3ea4977109dc7"
+	"c45d4ddb9d84a7144b397ae56bb\"], \"20000000\", \"1d00ffff\", \"6ad5cc"
+	"4a\", true], \"odokey\": 211}",
+	/* 16 Merkle branches */
+	"{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"0\", \""
+	"0a2770fec90bcb219472bdc658bc2772ab03f70022d8f41c4f13d03d28352952\", "
+	"\"010000000100000000000000000000000000000000000000000000000000000000"
+	"00000000ffffffff0c0340420f\", \"ffffffff0100f2052a010000000151000000"
+	"00\", [\"6e8c923cbbfa8217d1e955cf9e028b7416b30ff55d9aa33c5e509fa5f20"
+	"db2a3\", \"d17c9a20d6a7b96a1e210acc05db5b0fd4c29c8749eab44ff74e7fe58"
+	"752770e\", \"0d9c97c88f78a432490fbba5b06616456c9d35d388e023205700160"
+	"1f351e929\", \"ac689bad9fcdaef041cdb5f1e41b14e3871223b813b897aa6bf56"
+	"bb1762b682f\", \"357f0d72aa4fd456cddd6d35486af058cc3c4b38aa3a05b5ed9"
+	"7529ddc911ae3\", \"6854f06819e4d74d48739733d333131d8c636d9494625939f"
+	"d17e465fb0ae82f\", \"e0cbf57c23ec83f1c81592d44b6c51611f03b68fa80fca4"
+	"39d26ff8f644a9500\", \"e07f5e7ffccf7c9fe3f315b865ab55749bd949d9d646c"
+	"321663b9c998ffcc951\", \"0aaac684f75e9efacbcbbf892e81f1a3122f296f55a"
+	"43bfa1e04fcdc18e74212\", \"26dafc46c69438abb5490f7f28da88e2b3a1ee369"
+	"a3da70852394f539f41f47b\", \"84ee0bf13683ff37ec6ea94fe00c4f4680189e0"
+	"3ac5685807fd5daf4e221fcdd\", \"3851cd806f5ba6d3980f7246ea39a00e84171"
+	"2170973c64e98f2819d81d36a5b\", \"1afa4e15b77d2ce268bdc9858606dd6c0e7"
+	"d090f98c4b41313be0f1ffbf42a38\", \"63338691dcec94b3552ca8682ed4d98dd"
+	"0770761f18c99da758ac92a00385077\", \"150d19803a0f739392696b4df7e5a28"
+	"44f275676952b83265767af8bb19f9368\", \"a45b0a796e46c60578c411b3b978e"
+	"a365f6f264fb947f1298f9f663d0753bc33\"], \"20000000\", \"1d00ffff\", "
+	"\"6ad5cc4a\", true], \"odokey\": 211}",
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+/* The same line with the method name escaped, which the in-place parser
+ * does not handle, so that it goes through jansson */
+static char *slow_line(const char *line)
+{
+	const char *p = strstr(line, "\"mining.notify\"");
+	char *s;
+
+	if (!p)
+		return NULL;
+	s = malloc(strlen(line) + 6);
+	sprintf(s, "%.*s\"mining.notif\\u0079\"%s", (int)(p - line), line,
+	        p + strlen("\"mining.notify\""));
+	return s;
+}
+
+static bool same_job(const struct stratum_job *a, const struct stratum_job *b)
+{
+	return !strcmp(a->job_id, b->job_id) &&
+	       !memcmp(a->prevhash, b->prevhash, 32) &&
+	       a->coinbase_size == b->coinbase_size &&
+	       !memcmp(a->coinbase, b->coinbase, a->coinbase_size) &&
+	       a->merkle_count == b->merkle_count &&
+	       !memcmp(a->merkle, b->merkle, 32 * a->merkle_count) &&
+	       !memcmp(a->version, b->version, 4) &&
+	       !memcmp(a->nbits, b->nbits, 4) &&
+	       !memcmp(a->ntime, b->ntime, 4) &&
+	       a->clean == b->clean;
+}
+
+static void copy_job(struct stratum_job *dst, const struct stratum_job *src)
+{
+	*dst = *src;
+	dst->job_id = strdup(src->job_id);
+	dst->coinbase = malloc(src->coinbase_size);
+	memcpy(dst->coinbase, src->coinbase, src->coinbase_size);
+	dst->merkle = malloc(32 * src->merkle_count + 1);
+	memcpy(dst->merkle, src->merkle, 32 * src->merkle_count);
+}
+
+static double time_parse(struct stratum_ctx *sctx, const char *line, bool *ok)
+{
+	double t = now();
+	int i;
+
+	for (i = 0; i < NOTIFY_ROUNDS; i++)
+		*ok = stratum_handle_method(sctx, line) && *ok;
+	return 1e6 * (now() - t) / NOTIFY_ROUNDS;
+}
+
+/* Returns false if the two paths disagree */
+static bool bench(struct stratum_ctx *sctx, const char *line)
+{
+	struct stratum_job fast;
+	char *slow = slow_line(line);
+	double t_fast, t_slow;
+	bool ok = slow != NULL;
+
+	if (!ok) {
+		fprintf(stderr, "not a mining.notify line: %.40s...\n", line);
+		return false;
+	}
+	t_fast = time_parse(sctx, line, &ok);
+	copy_job(&fast, &sctx->job);
+	t_slow = time_parse(sctx, slow, &ok);
+	ok = ok && same_job(&fast, &sctx->job);
+
+	printf("%8d %8zu %12.2f %12.2f  %s\n", sctx->job.merkle_count,
+	       strlen(line), t_fast, t_slow, ok ? "ok" : "JOBS DIFFER");
+
+	free(fast.job_id);
+	free(fast.coinbase);
+	free(fast.merkle);
+	free(slow);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned char xnonce1[4] = { 0x8d, 0xbf, 0x98, 0xaa };
+	struct stratum_ctx sctx;
+	static char line[MAX_LINE];
+	bool ok = true;
+	FILE *f;
+	int i;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [FILE]\n", argv[0]);
+		return 1;
+	}
+	pthread_mutex_init(&applog_lock, NULL);
+	memset(&sctx, 0, sizeof(sctx));
+	pthread_mutex_init(&sctx.work_lock, NULL);
+	sctx.xnonce1 = xnonce1;
+	sctx.xnonce1_size = sizeof(xnonce1);
+	sctx.xnonce2_size = 4;
+	sctx.next_diff = 1.0;
+
+	printf("microseconds per line\n");
+	printf("%8s %8s %12s %12s\n", "branches", "bytes", "in place", "jansson");
+	if (argc == 1) {
+		for (i = 0; i < ARRAY_SIZE(captured); i++)
+			ok = bench(&sctx, captured[i]) && ok;
+		return !ok;
+	}
+
+	f = fopen(argv[1], "r");
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strstr(line, "\"mining.notify\""))
+			ok = bench(&sctx, line) && ok;
+	}
+	fclose(f);
+	return !ok;
+}
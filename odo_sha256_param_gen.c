@@ -2,6 +2,7 @@
 // Created by cl on 2021/1/6.
 //
 
+#include <pthread.h>
 #include "odo_sha256_param_gen.h"
 
 static const uint32_t TABLE_SIZE_BITS = 14;
@@ -11,6 +12,12 @@ static const uint64_t T = 1609653714;
 
 extern void applog(int prio, const char *fmt, ...);
 
+// The key of the epoch a block with this timestamp belongs to
+uint32_t odo_key_at(uint32_t ntime)
+{
+    return ntime < T ? 0 : (ntime - T) / EPOCH_PERIOD;
+}
+
 void bubble_sort(uint32_t *arr, size_t n) {
     for (size_t i = 0; i < n - 1; i++)
         for (size_t j = 0; j < n - i - 1; j++) {
@@ -160,17 +167,20 @@ void gen_h256(uint64_t t, uint32_t sqrts[TABLE_SIZE], uint32_t h256_out[8])
 static uint32_t primes[16384];
 static uint32_t sqrts[16384];
 static uint32_t curts[16384];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void init_tables(void)
+{
+    get_first_table_size_primes(primes);
+    create_decimals_of_square_root_of_primes(primes, sqrts);
+    create_decimals_of_cube_roots_of_primes(primes, curts);
+    applog(6, "-------generate-----.");
+}
+
 void generate(uint64_t key, uint32_t h256_out[8], uint32_t k256_out[64])
 {
-    // TODO: Can be optimized (eg:pthread_once_t).
-    static int inited = 0;
-    if (!inited) {
-        inited = 1;
-        get_first_table_size_primes(primes);
-        create_decimals_of_square_root_of_primes(primes, sqrts);
-        create_decimals_of_cube_roots_of_primes(primes, curts);
-        applog(6, "-------generate-----.");
-    }
+    // miner threads build their contexts concurrently
+    pthread_once(&tables_once, init_tables);
 
     // uint32_t* primes = (uint32_t*)malloc(TABLE_SIZE * sizeof(uint32_t));
     // get_first_table_size_primes(primes);
@@ -13,4 +13,5 @@
 #include "bigint.h"
 #include "odo_sha256_param_gen.h"
 void generate(uint64_t key, uint32_t h256_out[8], uint32_t k256_out[64]);
+uint32_t odo_key_at(uint32_t ntime);
 #endif //DIGIBYTE_ODO_SHA256_PARAM_H
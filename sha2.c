@@ -229,6 +229,90 @@ void sha256d(unsigned char *hash, const unsigned char *data, int len)
 		be32enc((uint32_t *)hash + i, T[i]);
 }
 
+/* Block b of tail || SHA-256 padding, for a message of total_len bytes */
+static void sha256d_tail_block(uint32_t *W, const unsigned char *tail,
+	int tail_len, int total_len, int b)
+{
+	unsigned char buf[64];
+	int i, r = tail_len - 64 * b;
+
+	memset(buf, 0, 64);
+	if (r > 0)
+		memcpy(buf, tail + 64 * b, r > 64 ? 64 : r);
+	if (r >= 0 && r < 64)
+		buf[r] = 0x80;
+	for (i = 0; i < 16; i++)
+		W[i] = be32dec(buf + 4 * i);
+	if (r < 56)
+		W[15] = 8 * total_len;
+}
+
+static void sha256d_nway(unsigned char *hash, const uint32_t *midstate,
+	int prefix_len, const unsigned char *tail, int tail_len, int ways,
+	void (*transform)(uint32_t *state, const uint32_t *block, int swap))
+{
+	uint32_t S[8 * 8] __attribute__((aligned(128)));
+	uint32_t W[8 * 16] __attribute__((aligned(128)));
+	uint32_t T[16];
+	int nb = (tail_len + 8) / 64 + 1;
+	int b, i, j;
+
+	for (i = 0; i < 8; i++)
+		for (j = 0; j < ways; j++)
+			S[i * ways + j] = midstate[i];
+	for (b = 0; b < nb; b++) {
+		for (j = 0; j < ways; j++) {
+			sha256d_tail_block(T, tail + j * tail_len, tail_len,
+			                   prefix_len + tail_len, b);
+			for (i = 0; i < 16; i++)
+				W[i * ways + j] = T[i];
+		}
+		transform(S, W, 0);
+	}
+
+	memcpy(W, S, 8 * ways * sizeof(uint32_t));
+	for (i = 8; i < 16; i++)
+		for (j = 0; j < ways; j++)
+			W[i * ways + j] = sha256d_hash1[i];
+	for (i = 0; i < 8; i++)
+		for (j = 0; j < ways; j++)
+			S[i * ways + j] = sha256_h[i];
+	transform(S, W, 0);
+
+	for (j = 0; j < ways; j++)
+		for (i = 0; i < 8; i++)
+			be32enc(hash + 32 * j + 4 * i, S[i * ways + j]);
+}
+
+/*
+ * Double SHA-256 of n messages prefix || tail[k], where the tails are
+ * tail_len bytes each and stored back to back.  midstate is the state
+ * after the prefix (prefix_len must be a multiple of 64), or NULL if
+ * there is no prefix.  Runs the tails through the 8-way and 4-way
+ * kernels when available.
+ */
+void sha256d_lanes(unsigned char *hash, const uint32_t *midstate,
+	int prefix_len, const unsigned char *tail, int tail_len, int n)
+{
+	if (!midstate)
+		midstate = sha256_h;
+#ifdef HAVE_SHA256_8WAY
+	if (sha256_use_8way())
+		for (; n >= 8; n -= 8, hash += 8 * 32, tail += 8 * tail_len)
+			sha256d_nway(hash, midstate, prefix_len, tail, tail_len,
+			             8, sha256_transform_8way);
+#endif
+#ifdef HAVE_SHA256_4WAY
+	if (sha256_use_4way())
+		for (; n >= 4; n -= 4, hash += 4 * 32, tail += 4 * tail_len)
+			sha256d_nway(hash, midstate, prefix_len, tail, tail_len,
+			             4, sha256_transform_4way);
+#endif
+	for (; n > 0; n--, hash += 32, tail += tail_len)
+		sha256d_nway(hash, midstate, prefix_len, tail, tail_len,
+		             1, sha256_transform);
+}
+
 static inline void sha256d_preextend(uint32_t *W)
 {
 	W[16] = s1(W[14]) + W[ 9] + s0(W[ 1]) + W[ 0];
@@ -640,11 +724,17 @@ int scanhash_sha256d(int thr_id, uint32_t *pdata, const uint32_t *ptarget,
 }
 
 char testdata[100],ciper[100];
-void hashOdo(char* hash, char* pdata,uint32_t key){
+
+void odo_ctx_init(struct odo_ctx *ctx, uint32_t key)
+{
+	ctx->key = key;
+	OdoCrypt_init(&ctx->crypt, key);
+	generate(key, ctx->h256, ctx->k256);
+}
+
+void hashOdo(char* hash, char* pdata, struct odo_ctx *octx){
   
-	uint32_t h256[8], k256[64];
 	sph_sha256_context state; 
-	OdoCrypt ctx;
 	uint8_t cipher[100] = { 0 };
 	uint32_t data[20];
 	uint32_t * pp=(uint32_t*)pdata;
@@ -659,19 +749,17 @@ void hashOdo(char* hash, char* pdata,uint32_t key){
 	memcpy(cipher, (char*)data, 80);
 	cipher[80] = 1;
 
-	OdoCrypt_init(&ctx, key);
-	OdoCrypt_Encrypt(&ctx, cipher, cipher);
+	OdoCrypt_Encrypt(&octx->crypt, cipher, cipher);
 
 	memcpy(ciper, cipher, 80);
 
-	generate(key, h256, k256);
-	sph_odo_sha256_init(&state, h256, k256);
+	sph_odo_sha256_init(&state, octx->h256, octx->k256);
 	sph_sha256(&state, cipher, 80);
 	sph_sha256_close(&state, hash);
 	return;
 }
 int scanhash_odo(int thr_id, uint32_t *pdata, const uint32_t *ptarget,
-	uint32_t max_nonce, unsigned long *hashes_done,uint32_t key)
+	uint32_t max_nonce, unsigned long *hashes_done, struct odo_ctx *ctx)
 {
 	uint32_t data[64] __attribute__((aligned(128)));
 	uint32_t hash[8] __attribute__((aligned(32)));
@@ -717,32 +805,46 @@ int scanhash_odo(int thr_id, uint32_t *pdata, const uint32_t *ptarget,
 #endif
 
 	do {
-		pdata[19] = ++n;
+		uint32_t batch_end = max_nonce - n > work_restart[thr_id].batch
+		                   ? n + work_restart[thr_id].batch : max_nonce;
+		do {
+			pdata[19] = ++n;
 		
-		hashOdo((char*)hash, (char*)pdata,key);	
+			hashOdo((char*)hash, (char*)pdata, ctx);	
 		
-		if (hash[7] <= Htarg) {
-			char* s=abin2hex(hash, 32);
-			applog(LOG_ERR, "key:%x, nonce:%x, hash:%s",key, n , s);
-			free(s);
+			if (hash[7] <= Htarg) {
+				char* s=abin2hex(hash, 32);
+				applog(LOG_ERR, "key:%x, nonce:%x, hash:%s", ctx->key, n , s);
+				free(s);
 
-			s=abin2hex(testdata, 80);
-			applog(LOG_ERR, "testdata:%s",s);
-			free(s);
+				s=abin2hex(testdata, 80);
+				applog(LOG_ERR, "testdata:%s",s);
+				free(s);
 
-			s=abin2hex(ciper, 80);
-			applog(LOG_ERR, "cipher:%s",s);
-			free(s);
+				s=abin2hex(ciper, 80);
+				applog(LOG_ERR, "cipher:%s",s);
+				free(s);
 
-			if (fulltest(hash, ptarget)) {
-				applog(LOG_ERR, "Found nonce");
-				*hashes_done = n - first_nonce + 1;
-				return 1;
+				if (fulltest(hash, ptarget)) {
+					applog(LOG_ERR, "Found nonce");
+					*hashes_done = n - first_nonce + 1;
+					return 1;
+				}
 			}
-		}
+		} while (n < batch_end);
 	} while (n < max_nonce && !work_restart[thr_id].restart);
 	*hashes_done = n - first_nonce + 1;
 	pdata[19] = n;
 	return 0;
 }
 
+static int odo_engine_always(void)
+{
+	return 1;
+}
+
+/* Odo kernels selectable with --odo-engine and probed by --autotune */
+const struct odo_engine odo_engines[] = {
+	{ "scalar",	odo_engine_always,	scanhash_odo },
+};
+const int odo_engine_count = ARRAY_SIZE(odo_engines);
@@ -0,0 +1,947 @@
+/*
+ * Copyright 2026 zhangcongrong
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * stratum-sim: a local Stratum server for testing minerd without a pool.
+ *
+ * It sends jobs at a fixed rate, marks a share of them clean, rotates the
+ * Odo key, varies the difficulty, checks every submitted share with the
+ * real Odo hash, and can delay traffic and drop connections on purpose.
+ * Commands read from standard input drive it further; see usage().
+ */
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <jansson.h>
+#include "miner.h"
+#include "sph_sha2.h"
+#include "odo_sha256_param_gen.h"
+
+#define SIM_JOBS	16	/* jobs kept for checking shares */
+#define SIM_CLIENTS	64
+#define SIM_MERKLE_MAX	16
+#define SIM_LINE_MAX	4096
+#define SIM_NTIME_AHEAD	7200	/* how far shares may roll ntime */
+
+struct sim_job {
+	unsigned int id;
+	bool stale;		/* a later job was clean */
+	uint32_t version, nbits, ntime, key;
+	unsigned char prevhash[32];
+	int merkle_count;
+	unsigned char merkle[SIM_MERKLE_MAX][32];
+	size_t coinb1_size, coinb2_size;
+	unsigned char coinb1[64], coinb2[64];
+	double sent;
+	size_t nseen, seen_alloc;
+	uint64_t *seen;		/* leading bits of accepted share hashes */
+};
+
+struct sim_out {
+	struct sim_out *next;
+	double due;
+	size_t len, off;
+	char line[];
+};
+
+struct sim_client {
+	int fd;			/* -1 when the slot is free */
+	unsigned int num;
+	uint32_t xnonce1;
+	bool subscribed, authorized;
+	bool extranonce_sub;	/* takes mining.set_extranonce */
+	uint32_t version_mask;
+	double diff, prev_diff;
+	double drop_at;
+	double last_due;	/* of the newest queued line */
+	unsigned int last_job;	/* newest job it has found a share for */
+	size_t rlen;
+	char rbuf[SIM_LINE_MAX];
+	struct sim_out *out, **out_tail;
+};
+
+static int opt_port = 3333;
+static const char *opt_bind = "127.0.0.1";
+static double opt_notify = 30.0;
+static double opt_clean = 0.1;
+static int opt_key_period;
+static bool opt_key_field = true;
+static double opt_diff = 0.0001, opt_diff_max;
+static int opt_diff_period = 10;
+static int opt_xnonce2_size = 4;
+static int opt_merkle = 6;
+static double opt_latency, opt_jitter;
+static double opt_disconnect;
+static uint32_t opt_version_mask = 0x1fffe000;
+static bool opt_quiet;
+
+static struct sim_job jobs[SIM_JOBS];
+static unsigned int job_count;
+static double cur_diff;
+static uint32_t key_base;
+static struct sim_client clients[SIM_CLIENTS];
+static unsigned int client_count;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static volatile sig_atomic_t quit;
+static double down_until;	/* connections are refused until then */
+
+static struct {
+	unsigned long notifies, clean, connects, drops;
+	unsigned long valid, low, stale, dup, invalid;
+	double first_share_sum;
+	unsigned long first_share_count;
+} stats;
+
+static struct odo_ctx key_cache[2];
+static int key_cache_next;
+static bool key_cache_valid[2];
+
+/* Stands in for the one in util.c, which the Odo parameter code logs to */
+void applog(int prio, const char *fmt, ...)
+{
+	va_list ap;
+	time_t now = time(NULL);
+	struct tm tm;
+	char ts[32];
+
+	localtime_r(&now, &tm);
+	strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(stderr, "[%s] ", ts);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static double sim_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* xorshift64*, so that --seed reproduces a run */
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double rng01(void)
+{
+	return (rng() >> 11) / 9007199254740992.0;
+}
+
+static void sim_sha256d(unsigned char *hash, const unsigned char *data, size_t len)
+{
+	sph_sha256_context ctx;
+
+	sph_sha256_init(&ctx);
+	sph_sha256(&ctx, data, len);
+	sph_sha256_close(&ctx, hash);
+	sph_sha256_init(&ctx);
+	sph_sha256(&ctx, hash, 32);
+	sph_sha256_close(&ctx, hash);
+}
+
+static const struct odo_ctx *sim_key_ctx(uint32_t key)
+{
+	struct odo_ctx *ctx;
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (key_cache_valid[i] && key_cache[i].key == key)
+			return &key_cache[i];
+	ctx = &key_cache[key_cache_next];
+	key_cache_valid[key_cache_next] = true;
+	key_cache_next ^= 1;
+	ctx->key = key;
+	OdoCrypt_init(&ctx->crypt, key);
+	generate(key, ctx->h256, ctx->k256);
+	return ctx;
+}
+
+/* The Odo hash of a serialized 80-byte header, as hashOdo() computes it */
+static void sim_hash(uint32_t *hash, const unsigned char *header, uint32_t key)
+{
+	const struct odo_ctx *ctx = sim_key_ctx(key);
+	sph_sha256_context state;
+	unsigned char cipher[100] = { 0 };
+
+	memcpy(cipher, header, 80);
+	cipher[80] = 1;
+	OdoCrypt_Encrypt((OdoCrypt *)&ctx->crypt, (char *)cipher, (char *)cipher);
+	sph_odo_sha256_init(&state, (sph_u32 *)ctx->h256, (sph_u32 *)ctx->k256);
+	sph_sha256(&state, cipher, 80);
+	sph_sha256_close(&state, hash);
+}
+
+/* Difficulty of a hash: the difficulty-1 target over the hash */
+static double sim_hash_diff(const uint32_t *hash)
+{
+	double h = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		h = h * 4294967296.0 + le32dec(hash + i);
+	return h ? 4294901760.0 * 4294967296.0 * 4294967296.0 * 4294967296.0 *
+	           4294967296.0 * 4294967296.0 * 4294967296.0 / h : 1e300;
+}
+
+static void hexstr(char *s, const unsigned char *p, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	while (len--) {
+		*s++ = hex[*p >> 4];
+		*s++ = hex[*p++ & 15];
+	}
+	*s = '\0';
+}
+
+static bool hexval(uint32_t *v, const char *s, size_t len)
+{
+	char *end;
+
+	if (!s || strlen(s) != len)
+		return false;
+	*v = strtoul(s, &end, 16);
+	return *end == '\0';
+}
+
+static void client_queue(struct sim_client *cl, const char *fmt, ...)
+{
+	struct sim_out *o;
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	o = malloc(sizeof(*o) + len + 2);
+	if (!o)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(o->line, len + 1, fmt, ap);
+	va_end(ap);
+	o->line[len] = '\n';
+	o->len = len + 1;
+	o->off = 0;
+	o->due = sim_now() + (opt_latency + opt_jitter * rng01()) / 1000.0;
+	/* jitter delays lines but never reorders them */
+	if (o->due < cl->last_due)
+		o->due = cl->last_due;
+	cl->last_due = o->due;
+	o->next = NULL;
+	*cl->out_tail = o;
+	cl->out_tail = &o->next;
+}
+
+static void client_drop(struct sim_client *cl, const char *why)
+{
+	struct sim_out *o;
+
+	applog(LOG_INFO, "client %u: %s", cl->num, why);
+	close(cl->fd);
+	cl->fd = -1;
+	while ((o = cl->out)) {
+		cl->out = o->next;
+		free(o);
+	}
+	client_count--;
+	stats.drops++;
+}
+
+/* Sends whatever is due; returns false if the client was dropped */
+static bool client_flush(struct sim_client *cl, double now)
+{
+	struct sim_out *o;
+	ssize_t n;
+
+	while ((o = cl->out) && o->due <= now) {
+		n = send(cl->fd, o->line + o->off, o->len - o->off, MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return true;
+		if (n < 0) {
+			client_drop(cl, "send failed");
+			return false;
+		}
+		o->off += n;
+		if (o->off < o->len)
+			return true;
+		cl->out = o->next;
+		if (!cl->out)
+			cl->out_tail = &cl->out;
+		free(o);
+	}
+	return true;
+}
+
+static void client_send_diff(struct sim_client *cl, double diff)
+{
+	cl->prev_diff = cl->diff ? cl->diff : diff;
+	cl->diff = diff;
+	client_queue(cl, "{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [%.10g]}",
+		     diff);
+}
+
+static void client_send_job(struct sim_client *cl, const struct sim_job *job,
+	bool clean)
+{
+	char prevhash[65], coinb1[129], coinb2[129], merkle[SIM_MERKLE_MAX * 68 + 1];
+	char key[32] = "";
+	char *p = merkle;
+	int i;
+
+	hexstr(prevhash, job->prevhash, 32);
+	hexstr(coinb1, job->coinb1, job->coinb1_size);
+	hexstr(coinb2, job->coinb2, job->coinb2_size);
+	*p = '\0';
+	for (i = 0; i < job->merkle_count; i++) {
+		p += sprintf(p, i ? ", \"" : "\"");
+		hexstr(p, job->merkle[i], 32);
+		p += 64;
+		p += sprintf(p, "\"");
+	}
+	if (opt_key_field)
+		sprintf(key, ", \"odokey\": %u", job->key);
+	client_queue(cl, "{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"%x\", \"%s\", \"%s\", \"%s\", [%s], \"%08x\", \"%08x\", \"%08x\", %s]%s}",
+		     job->id, prevhash, coinb1, coinb2, merkle, job->version,
+		     job->nbits, job->ntime, clean ? "true" : "false", key);
+}
+
+static struct sim_job *job_find(unsigned int id)
+{
+	struct sim_job *job = &jobs[id % SIM_JOBS];
+
+	return job_count && id < job_count && id + SIM_JOBS >= job_count &&
+	       job->id == id ? job : NULL;
+}
+
+static void new_job(bool clean)
+{
+	struct sim_job *job;
+	unsigned int i;
+	uint32_t height = 1000000 + job_count;
+
+	if (!job_count)
+		clean = true;
+	if (clean)
+		for (i = 0; i < SIM_JOBS; i++)
+			jobs[i].stale = true;
+
+	job = &jobs[job_count % SIM_JOBS];
+	free(job->seen);
+	memset(job, 0, sizeof(*job));
+	job->id = job_count++;
+	job->version = 0x20000000;
+	job->nbits = 0x1d00ffff;
+	job->ntime = time(NULL);
+	job->key = opt_key_period ? key_base + job->id / opt_key_period
+	                          : odo_key_at(job->ntime);
+	job->sent = sim_now();
+
+	/* a new block only on clean jobs, like a real chain tip */
+	if (clean || job->id == 0) {
+		for (i = 0; i < 32; i++)
+			job->prevhash[i] = rng();
+	} else
+		memcpy(job->prevhash, jobs[(job->id - 1) % SIM_JOBS].prevhash, 32);
+	job->merkle_count = opt_merkle;
+	for (i = 0; i < (unsigned int)opt_merkle * 32; i++)
+		job->merkle[i / 32][i % 32] = rng();
+
+	/* coinbase: version, one input with the height and the extranonces
+	 * in its script, one output */
+	memcpy(job->coinb1, "\x01\x00\x00\x00\x01", 5);
+	memset(job->coinb1 + 5, 0, 32);
+	memset(job->coinb1 + 37, 0xff, 4);
+	job->coinb1[41] = 4 + 4 + opt_xnonce2_size;
+	job->coinb1[42] = 3;
+	job->coinb1[43] = height;
+	job->coinb1[44] = height >> 8;
+	job->coinb1[45] = height >> 16;
+	job->coinb1_size = 46;
+	memcpy(job->coinb2, "\xff\xff\xff\xff\x01\x00\xf2\x05\x2a\x01\x00\x00\x00"
+	       "\x01\x51\x00\x00\x00\x00", 19);
+	job->coinb2_size = 19;
+
+	if (opt_diff_max > opt_diff && job->id % opt_diff_period == 0)
+		cur_diff = exp(log(opt_diff) + rng01() * log(opt_diff_max / opt_diff));
+
+	for (i = 0; i < SIM_CLIENTS; i++) {
+		struct sim_client *cl = &clients[i];
+		if (cl->fd < 0 || !cl->subscribed || !cl->authorized)
+			continue;
+		if (cl->diff != cur_diff)
+			client_send_diff(cl, cur_diff);
+		client_send_job(cl, job, clean);
+	}
+	stats.notifies++;
+	if (clean)
+		stats.clean++;
+	if (!opt_quiet)
+		applog(LOG_INFO, "job %x%s, key %u, diff %.6g", job->id, clean ? " (clean)" : "",
+		       job->key, cur_diff);
+}
+
+static void client_reply(struct sim_client *cl, const char *id,
+	const char *result, int code, const char *reason)
+{
+	if (reason)
+		client_queue(cl, "{\"id\": %s, \"result\": %s, \"error\": [%d, \"%s\", null]}",
+			     id, result ? result : "null", code, reason);
+	else
+		client_queue(cl, "{\"id\": %s, \"result\": %s, \"error\": null}",
+			     id, result);
+}
+
+/* Checks a share; returns an error code and reason, or 0 if it is good */
+static int check_share(struct sim_client *cl, json_t *params, const char **reason)
+{
+	const char *p[6];
+	struct sim_job *job;
+	unsigned char cb[256], root[64], header[80];
+	uint32_t hash[8], ntime, nonce, version = 0, xn2;
+	uint64_t tag;
+	unsigned long job_id;
+	char *end;
+	double d;
+	size_t cb_len, i;
+	int n = json_array_size(params);
+	unsigned char *x;
+
+	if (!cl->authorized) {
+		*reason = "Unauthorized worker";
+		return 24;
+	}
+	for (i = 0; i < 6; i++)
+		p[i] = i < (size_t)n ? json_string_value(json_array_get(params, i)) : NULL;
+	if (n < 5 || n > 6 || !p[1] || !p[2] ||
+	    strlen(p[2]) != 2 * (size_t)opt_xnonce2_size ||
+	    !hexval(&ntime, p[3], 8) || !hexval(&nonce, p[4], 8) ||
+	    (n == 6 && !hexval(&version, p[5], 8))) {
+		*reason = "Invalid parameters";
+		return 20;
+	}
+	job_id = strtoul(p[1], &end, 16);
+	job = *p[1] && !*end ? job_find(job_id) : NULL;
+	if (!job || job->stale) {
+		*reason = "Stale share";
+		stats.stale++;
+		return 21;
+	}
+	if (n == 6 && (version & ~cl->version_mask)) {
+		*reason = "Invalid version bits";
+		return 20;
+	}
+	version = n == 6 ? (job->version & ~cl->version_mask) | version
+	               : job->version;
+	if (ntime < job->ntime || ntime > time(NULL) + SIM_NTIME_AHEAD) {
+		*reason = "Invalid ntime";
+		return 20;
+	}
+
+	/* rebuild the coinbase and Merkle root */
+	memcpy(cb, job->coinb1, job->coinb1_size);
+	cb_len = job->coinb1_size;
+	be32enc(cb + cb_len, cl->xnonce1);
+	cb_len += 4;
+	x = cb + cb_len;
+	for (i = 0; i < (size_t)opt_xnonce2_size; i++) {
+		if (!hexval(&xn2, (char[3]){ p[2][2 * i], p[2][2 * i + 1], 0 }, 2)) {
+			*reason = "Invalid parameters";
+			return 20;
+		}
+		x[i] = xn2;
+	}
+	cb_len += opt_xnonce2_size;
+	memcpy(cb + cb_len, job->coinb2, job->coinb2_size);
+	cb_len += job->coinb2_size;
+	sim_sha256d(root, cb, cb_len);
+	for (i = 0; i < (size_t)job->merkle_count; i++) {
+		memcpy(root + 32, job->merkle[i], 32);
+		sim_sha256d(root, root, 64);
+	}
+
+	/* serialize the header as the miner hashes it */
+	le32enc(header, version);
+	for (i = 0; i < 32; i++)
+		header[4 + i] = job->prevhash[(i & ~3) + 3 - (i & 3)];
+	memcpy(header + 36, root, 32);
+	le32enc(header + 68, ntime);
+	le32enc(header + 72, job->nbits);
+	le32enc(header + 76, nonce);
+	sim_hash(hash, header, job->key);
+
+	tag = (uint64_t)hash[7] << 32 | hash[6];
+	for (i = 0; i < job->nseen; i++)
+		if (job->seen[i] == tag) {
+			*reason = "Duplicate share";
+			stats.dup++;
+			return 22;
+		}
+
+	d = sim_hash_diff(hash);
+	if (d < cl->diff * 0.999 && d < cl->prev_diff * 0.999) {
+		*reason = "Low difficulty share";
+		stats.low++;
+		if (!opt_quiet)
+			applog(LOG_WARNING, "client %u: share diff %.6g below %.6g (key %u)",
+			       cl->num, d, cl->diff, job->key);
+		return 23;
+	}
+
+	if (job->nseen == job->seen_alloc) {
+		job->seen_alloc = job->seen_alloc ? 2 * job->seen_alloc : 64;
+		job->seen = realloc(job->seen, job->seen_alloc * sizeof(*job->seen));
+	}
+	job->seen[job->nseen++] = tag;
+	if (cl->last_job != job->id + 1) {
+		cl->last_job = job->id + 1;
+		stats.first_share_sum += sim_now() - job->sent;
+		stats.first_share_count++;
+	}
+	return 0;
+}
+
+static void client_request(struct sim_client *cl, const char *line)
+{
+	json_t *val, *id_val, *params;
+	json_error_t err;
+	const char *method, *reason;
+	char id[32];
+	int code;
+
+	val = JSON_LOADS(line, &err);
+	if (!val) {
+		client_drop(cl, "malformed request");
+		return;
+	}
+	method = json_string_value(json_object_get(val, "method"));
+	id_val = json_object_get(val, "id");
+	params = json_object_get(val, "params");
+	if (json_is_integer(id_val))
+		sprintf(id, "%lld", (long long)json_integer_value(id_val));
+	else
+		strcpy(id, "null");
+	if (!method)
+		goto out;
+
+	if (!strcmp(method, "mining.subscribe")) {
+		uint32_t sid;
+		/* the session id is the extranonce1, so any can be resumed */
+		if (hexval(&sid, json_string_value(json_array_get(params, 1)), 8)) {
+			cl->xnonce1 = sid;
+			applog(LOG_INFO, "client %u: resumed session %08x", cl->num, sid);
+		}
+		cl->subscribed = true;
+		client_queue(cl, "{\"id\": %s, \"result\": [[[\"mining.notify\", \"%08x\"]], \"%08x\", %d], \"error\": null}",
+			     id, cl->xnonce1, cl->xnonce1, opt_xnonce2_size);
+	} else if (!strcmp(method, "mining.authorize")) {
+		cl->authorized = true;
+		client_reply(cl, id, "true", 0, NULL);
+		if (cl->subscribed && job_count) {
+			client_send_diff(cl, cur_diff);
+			client_send_job(cl, &jobs[(job_count - 1) % SIM_JOBS], true);
+		}
+	} else if (!strcmp(method, "mining.configure")) {
+		cl->version_mask = opt_version_mask;
+		if (opt_version_mask)
+			client_queue(cl, "{\"id\": %s, \"result\": {\"version-rolling\": true, \"version-rolling.mask\": \"%08x\"}, \"error\": null}",
+				     id, opt_version_mask);
+		else
+			client_reply(cl, id, "{\"version-rolling\": false}", 0, NULL);
+	} else if (!strcmp(method, "mining.suggest_difficulty")) {
+		double d = json_number_value(json_array_get(params, 0));
+		client_reply(cl, id, "true", 0, NULL);
+		if (d > 0) {
+			applog(LOG_INFO, "client %u: suggested difficulty %.6g", cl->num, d);
+			client_send_diff(cl, d);
+		}
+	} else if (!strcmp(method, "mining.extranonce.subscribe")) {
+		cl->extranonce_sub = true;
+		client_reply(cl, id, "true", 0, NULL);
+	} else if (!strcmp(method, "mining.submit")) {
+		code = check_share(cl, params, &reason);
+		if (code) {
+			if (code == 20 || code == 24)
+				stats.invalid++;
+			client_reply(cl, id, "false", code, reason);
+		} else {
+			stats.valid++;
+			client_reply(cl, id, "true", 0, NULL);
+		}
+	} else
+		client_reply(cl, id, NULL, 20, "Unsupported method");
+out:
+	json_decref(val);
+}
+
+static void client_read(struct sim_client *cl)
+{
+	char *start, *nl;
+	ssize_t n;
+
+	n = recv(cl->fd, cl->rbuf + cl->rlen, sizeof(cl->rbuf) - 1 - cl->rlen, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (n <= 0) {
+		client_drop(cl, "disconnected");
+		return;
+	}
+	cl->rlen += n;
+	start = cl->rbuf;
+	while (cl->fd >= 0 &&
+	       (nl = memchr(start, '\n', cl->rbuf + cl->rlen - start))) {
+		*nl = '\0';
+		if (strspn(start, " \t\r") < (size_t)(nl - start))
+			client_request(cl, start);
+		start = nl + 1;
+	}
+	if (cl->fd < 0)
+		return;
+	cl->rlen -= start - cl->rbuf;
+	memmove(cl->rbuf, start, cl->rlen);
+	if (cl->rlen == sizeof(cl->rbuf) - 1)
+		client_drop(cl, "request too long");
+}
+
+static void client_accept(int listen_fd)
+{
+	static unsigned int next_num;
+	struct sim_client *cl = NULL;
+	int fd, i;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	if (sim_now() < down_until) {
+		close(fd);
+		return;
+	}
+	for (i = 0; i < SIM_CLIENTS && !cl; i++)
+		if (clients[i].fd < 0)
+			cl = &clients[i];
+	if (!cl) {
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	memset(cl, 0, sizeof(*cl));
+	cl->fd = fd;
+	cl->num = ++next_num;
+	cl->xnonce1 = rng();
+	cl->out_tail = &cl->out;
+	if (opt_disconnect)
+		cl->drop_at = sim_now() - opt_disconnect * log(1.0 - rng01());
+	client_count++;
+	stats.connects++;
+	applog(LOG_INFO, "client %u: connected, extranonce1 %08x", cl->num, cl->xnonce1);
+}
+
+static void print_stats(void)
+{
+	unsigned long shares = stats.valid + stats.low + stats.stale +
+	                       stats.dup + stats.invalid;
+
+	applog(LOG_INFO, "jobs %lu (%lu clean), connects %lu, disconnects %lu, clients %u",
+	       stats.notifies, stats.clean, stats.connects, stats.drops, client_count);
+	applog(LOG_INFO, "shares %lu: valid %lu, low difficulty %lu, stale %lu (%.2f%%), duplicate %lu, invalid %lu",
+	       shares, stats.valid, stats.low, stats.stale,
+	       shares ? 100.0 * stats.stale / shares : 0.0, stats.dup, stats.invalid);
+	if (stats.first_share_count)
+		applog(LOG_INFO, "first share after a job: %.3f s on average",
+		       stats.first_share_sum / stats.first_share_count);
+}
+
+/* One command from standard input */
+static void command(char *line)
+{
+	char *cmd = strtok(line, " \t\r\n"), *arg = strtok(NULL, " \t\r\n");
+	int i;
+
+	if (!cmd)
+		return;
+	if (!strcmp(cmd, "notify") || !strcmp(cmd, "clean"))
+		new_job(!strcmp(cmd, "clean"));
+	else if (!strcmp(cmd, "key") && arg) {
+		key_base = strtoul(arg, NULL, 10);
+		opt_key_period = opt_key_period ? opt_key_period : INT32_MAX;
+		key_base -= job_count / opt_key_period;
+		new_job(true);
+	} else if (!strcmp(cmd, "diff") && arg) {
+		opt_diff = cur_diff = strtod(arg, NULL);
+		opt_diff_max = 0;
+		new_job(false);
+	} else if (!strcmp(cmd, "drop") || (!strcmp(cmd, "down") && arg)) {
+		if (arg)
+			down_until = sim_now() + strtod(arg, NULL);
+		for (i = 0; i < SIM_CLIENTS; i++)
+			if (clients[i].fd >= 0)
+				client_drop(&clients[i], "dropped");
+	} else if (!strcmp(cmd, "extranonce")) {
+		for (i = 0; i < SIM_CLIENTS; i++) {
+			struct sim_client *cl = &clients[i];
+			if (cl->fd < 0 || !cl->extranonce_sub)
+				continue;
+			cl->xnonce1 = rng();
+			client_queue(cl, "{\"id\": null, \"method\": \"mining.set_extranonce\", \"params\": [\"%08x\", %d]}",
+				     cl->xnonce1, opt_xnonce2_size);
+			applog(LOG_INFO, "client %u: extranonce1 set to %08x",
+			       cl->num, cl->xnonce1);
+		}
+	} else if (!strcmp(cmd, "latency") && arg) {
+		opt_latency = strtod(arg, NULL);
+		arg = strtok(NULL, " \t\r\n");
+		opt_jitter = arg ? strtod(arg, NULL) : 0;
+	} else if (!strcmp(cmd, "stats"))
+		print_stats();
+	else if (!strcmp(cmd, "quit"))
+		quit = 1;
+	else
+		applog(LOG_WARNING, "unknown command: %s", cmd);
+}
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [OPTIONS]\n\
+Options:\n\
+  -p, --port=PORT           listen on PORT (default 3333)\n\
+  -b, --bind=ADDR           listen on IPv4 address ADDR (default 127.0.0.1)\n\
+  -n, --notify=SECONDS      interval between jobs (default 30)\n\
+  -c, --clean=RATIO         fraction of jobs with clean_jobs set (default 0.1)\n\
+  -k, --key-period=N        rotate the Odo key every N jobs; by default the key\n\
+                            follows the chain schedule for the job ntime\n\
+      --no-key              leave odokey out of mining.notify\n\
+  -d, --diff=D              share difficulty (default 0.0001)\n\
+      --diff-max=D          pick a new difficulty between --diff and D\n\
+      --diff-period=N       every N jobs (default 10)\n\
+  -x, --xnonce2-size=N      extranonce2 size in bytes (default 4)\n\
+  -m, --merkle=N            Merkle branch length (default 6)\n\
+  -l, --latency=MS          delay everything sent to clients by MS\n\
+  -j, --jitter=MS           plus up to MS more\n\
+  -D, --disconnect=SECONDS  drop each client after SECONDS on average\n\
+      --version-mask=HEX    version bits granted by mining.configure\n\
+                            (default 1fffe000, 0 refuses)\n\
+  -s, --seed=N              seed for jobs, jitter and disconnects\n\
+  -q, --quiet               do not log jobs and rejected shares\n\
+  -h, --help                display this help text and exit\n\
+\n\
+Commands on standard input:\n\
+  notify, clean             send a job now\n\
+  key N                     switch to Odo key N with a clean job\n\
+  diff D                    set a fixed difficulty\n\
+  extranonce                move clients that asked for it to a new\n\
+                            extranonce1 with mining.set_extranonce\n\
+  drop                      disconnect every client\n\
+  down SECONDS              disconnect every client and refuse new ones\n\
+                            for SECONDS\n\
+  latency MS [JITTER]       change the injected latency\n\
+  stats                     print share statistics\n\
+  quit                      print statistics and exit\n", prog);
+}
+
+static struct option options[] = {
+	{ "bind", 1, NULL, 'b' },
+	{ "clean", 1, NULL, 'c' },
+	{ "diff", 1, NULL, 'd' },
+	{ "diff-max", 1, NULL, 1001 },
+	{ "diff-period", 1, NULL, 1002 },
+	{ "disconnect", 1, NULL, 'D' },
+	{ "help", 0, NULL, 'h' },
+	{ "jitter", 1, NULL, 'j' },
+	{ "key-period", 1, NULL, 'k' },
+	{ "latency", 1, NULL, 'l' },
+	{ "merkle", 1, NULL, 'm' },
+	{ "no-key", 0, NULL, 1003 },
+	{ "notify", 1, NULL, 'n' },
+	{ "port", 1, NULL, 'p' },
+	{ "quiet", 0, NULL, 'q' },
+	{ "seed", 1, NULL, 's' },
+	{ "version-mask", 1, NULL, 1004 },
+	{ "xnonce2-size", 1, NULL, 'x' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfd[SIM_CLIENTS + 2];
+	struct sim_client *pcl[SIM_CLIENTS + 2];
+	struct sockaddr_in sin;
+	char cmdbuf[256];
+	size_t cmdlen = 0;
+	bool have_stdin = true;
+	double now, next_job, wake;
+	int listen_fd, one = 1, key, i, n, timeout;
+
+	memset(&sin, 0, sizeof(sin));
+	while ((key = getopt_long(argc, argv, "b:c:d:D:hj:k:l:m:n:p:qs:x:",
+	                          options, NULL)) != -1) {
+		switch (key) {
+		case 'b': opt_bind = optarg; break;
+		case 'c': opt_clean = atof(optarg); break;
+		case 'd': opt_diff = atof(optarg); break;
+		case 'D': opt_disconnect = atof(optarg); break;
+		case 'j': opt_jitter = atof(optarg); break;
+		case 'k': opt_key_period = atoi(optarg); break;
+		case 'l': opt_latency = atof(optarg); break;
+		case 'm': opt_merkle = atoi(optarg); break;
+		case 'n': opt_notify = atof(optarg); break;
+		case 'p': opt_port = atoi(optarg); break;
+		case 'q': opt_quiet = true; break;
+		case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+		case 'x': opt_xnonce2_size = atoi(optarg); break;
+		case 1001: opt_diff_max = atof(optarg); break;
+		case 1002: opt_diff_period = atoi(optarg); break;
+		case 1003: opt_key_field = false; break;
+		case 1004: opt_version_mask = strtoul(optarg, NULL, 16); break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (opt_notify <= 0 || opt_diff <= 0 || opt_diff_period < 1 ||
+	    opt_xnonce2_size < 1 || opt_xnonce2_size > 8 ||
+	    opt_merkle < 0 || opt_merkle > SIM_MERKLE_MAX || opt_key_period < 0 ||
+	    inet_pton(AF_INET, opt_bind, &sin.sin_addr) != 1) {
+		fprintf(stderr, "%s: invalid arguments\n", argv[0]);
+		return 1;
+	}
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(opt_port);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(listen_fd, 16) < 0) {
+		fprintf(stderr, "%s: cannot listen on %s:%d: %s\n", argv[0],
+		        opt_bind, opt_port, strerror(errno));
+		return 1;
+	}
+	for (i = 0; i < SIM_CLIENTS; i++)
+		clients[i].fd = -1;
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	cur_diff = opt_diff;
+	key_base = odo_key_at(time(NULL));
+	applog(LOG_INFO, "listening on 127.0.0.1:%d", opt_port);
+	new_job(true);
+	next_job = sim_now() + opt_notify;
+
+	while (!quit) {
+		now = sim_now();
+		if (now >= next_job) {
+			new_job(rng01() < opt_clean);
+			next_job += opt_notify;
+			if (next_job < now)
+				next_job = now + opt_notify;
+		}
+
+		/* flush due output, inject disconnects, find the next wakeup */
+		wake = next_job;
+		n = 0;
+		pfd[n].fd = listen_fd;
+		pfd[n].events = POLLIN;
+		pcl[n++] = NULL;
+		if (have_stdin) {
+			pfd[n].fd = STDIN_FILENO;
+			pfd[n].events = POLLIN;
+			pcl[n++] = NULL;
+		}
+		for (i = 0; i < SIM_CLIENTS; i++) {
+			struct sim_client *cl = &clients[i];
+			if (cl->fd < 0)
+				continue;
+			if (cl->drop_at && now >= cl->drop_at) {
+				client_drop(cl, "injected disconnect");
+				continue;
+			}
+			if (!client_flush(cl, now))
+				continue;
+			if (cl->drop_at && cl->drop_at < wake)
+				wake = cl->drop_at;
+			pfd[n].fd = cl->fd;
+			pfd[n].events = POLLIN;
+			if (cl->out && cl->out->due <= now)
+				pfd[n].events |= POLLOUT;
+			else if (cl->out && cl->out->due < wake)
+				wake = cl->out->due;
+			pcl[n++] = cl;
+		}
+
+		timeout = (wake - now) * 1000 + 1;
+		if (poll(pfd, n, timeout < 0 ? 0 : timeout) <= 0)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			if (!pfd[i].revents)
+				continue;
+			if (pcl[i]) {
+				if (pcl[i]->fd >= 0 && (pfd[i].revents & ~POLLOUT))
+					client_read(pcl[i]);
+			} else if (pfd[i].fd == listen_fd)
+				client_accept(listen_fd);
+			else {
+				ssize_t r = read(STDIN_FILENO, cmdbuf + cmdlen,
+				                 sizeof(cmdbuf) - 1 - cmdlen);
+				char *nl;
+				if (r <= 0) {
+					have_stdin = false;
+					continue;
+				}
+				cmdlen += r;
+				cmdbuf[cmdlen] = '\0';
+				while ((nl = strchr(cmdbuf, '\n'))) {
+					*nl = '\0';
+					command(cmdbuf);
+					cmdlen -= nl + 1 - cmdbuf;
+					memmove(cmdbuf, nl + 1, cmdlen + 1);
+				}
+				if (cmdlen == sizeof(cmdbuf) - 1)
+					cmdlen = 0;
+			}
+		}
+	}
+
+	print_stats();
+	return 0;
+}
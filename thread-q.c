@@ -0,0 +1,165 @@
+/*
+ * Copyright 2010 Jeff Garzik
+ * Copyright 2012-2020 pooler
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "cpuminer-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "miner.h"
+
+#define TQ_SLOTS	1024	/* messages a thread queue holds */
+
+/* A slot is free for the push numbered seq, or holds the message of
+ * push seq - 1 */
+struct tq_slot {
+	unsigned long		seq;
+	void			*data;
+};
+
+/* Bounded multi-producer, single-consumer ring.  Producers claim slots
+ * with a compare-and-swap on head and take the mutex only to wake a
+ * consumer that has gone to sleep on the condition variable. */
+struct thread_q {
+	struct tq_slot		slot[TQ_SLOTS];
+	unsigned long		head;		/* next push */
+	unsigned long		tail;		/* next pop, consumer only */
+
+	bool frozen;
+	int			sleeping;
+
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+};
+
+struct thread_q *tq_new(void)
+{
+	struct thread_q *tq;
+	int i;
+
+	tq = calloc(1, sizeof(*tq));
+	if (!tq)
+		return NULL;
+
+	for (i = 0; i < TQ_SLOTS; i++)
+		tq->slot[i].seq = i;
+	pthread_mutex_init(&tq->mutex, NULL);
+	pthread_cond_init(&tq->cond, NULL);
+
+	return tq;
+}
+
+void tq_free(struct thread_q *tq)
+{
+	if (!tq)
+		return;
+
+	pthread_cond_destroy(&tq->cond);
+	pthread_mutex_destroy(&tq->mutex);
+
+	memset(tq, 0, sizeof(*tq));	/* poison */
+	free(tq);
+}
+
+static void tq_wake(struct thread_q *tq)
+{
+	pthread_mutex_lock(&tq->mutex);
+	pthread_cond_signal(&tq->cond);
+	pthread_mutex_unlock(&tq->mutex);
+}
+
+static void tq_freezethaw(struct thread_q *tq, bool frozen)
+{
+	__atomic_store_n(&tq->frozen, frozen, __ATOMIC_SEQ_CST);
+	tq_wake(tq);
+}
+
+void tq_freeze(struct thread_q *tq)
+{
+	tq_freezethaw(tq, true);
+}
+
+void tq_thaw(struct thread_q *tq)
+{
+	tq_freezethaw(tq, false);
+}
+
+/* Waits for a free slot while the ring is full */
+bool tq_push(struct thread_q *tq, void *data)
+{
+	struct tq_slot *slot;
+	unsigned long pos, seq;
+
+	if (__atomic_load_n(&tq->frozen, __ATOMIC_ACQUIRE))
+		return false;
+
+	pos = __atomic_load_n(&tq->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &tq->slot[pos % TQ_SLOTS];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&tq->head, &pos, pos + 1,
+			                                true, __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+				break;
+			continue;
+		}
+		if ((long)(seq - pos) < 0)
+			sched_yield();
+		pos = __atomic_load_n(&tq->head, __ATOMIC_RELAXED);
+	}
+	slot->data = data;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+	/* pairs with the store to sleeping in tq_pop */
+	if (__atomic_load_n(&tq->sleeping, __ATOMIC_SEQ_CST))
+		tq_wake(tq);
+
+	return true;
+}
+
+static bool tq_ready(struct thread_q *tq)
+{
+	struct tq_slot *slot = &tq->slot[tq->tail % TQ_SLOTS];
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == tq->tail + 1;
+}
+
+void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
+{
+	struct tq_slot *slot;
+	void *rval;
+
+	if (!tq_ready(tq)) {
+		pthread_mutex_lock(&tq->mutex);
+		__atomic_store_n(&tq->sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!tq_ready(tq)) {
+			if (abstime)
+				pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
+			else
+				pthread_cond_wait(&tq->cond, &tq->mutex);
+		}
+		__atomic_store_n(&tq->sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&tq->mutex);
+		if (!tq_ready(tq))
+			return NULL;
+	}
+
+	slot = &tq->slot[tq->tail % TQ_SLOTS];
+	rval = slot->data;
+	__atomic_store_n(&slot->seq, tq->tail + TQ_SLOTS, __ATOMIC_RELEASE);
+	tq->tail++;
+
+	return rval;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright 2026 zhangcongrong
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * tq-bench: many producer threads push into one thread queue while a
+ * single consumer pops, first with the mutex-protected list that thread
+ * queues used to be and then with the ring in thread-q.c.  Every message
+ * is checked to arrive once and in order per producer.
+ */
+
+#include "cpuminer-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "miner.h"
+#include "elist.h"
+
+/* The previous thread queue, kept for comparison */
+
+struct list_ent {
+	void			*data;
+	struct list_head	q_node;
+};
+
+struct list_q {
+	struct list_head	q;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+};
+
+static void *list_new(void)
+{
+	struct list_q *lq = calloc(1, sizeof(*lq));
+
+	if (!lq)
+		return NULL;
+	INIT_LIST_HEAD(&lq->q);
+	pthread_mutex_init(&lq->mutex, NULL);
+	pthread_cond_init(&lq->cond, NULL);
+	return lq;
+}
+
+static void list_free(void *q)
+{
+	struct list_q *lq = q;
+
+	pthread_cond_destroy(&lq->cond);
+	pthread_mutex_destroy(&lq->mutex);
+	free(lq);
+}
+
+static bool list_push(void *q, void *data)
+{
+	struct list_q *lq = q;
+	struct list_ent *ent;
+
+	ent = calloc(1, sizeof(*ent));
+	if (!ent)
+		return false;
+	ent->data = data;
+	INIT_LIST_HEAD(&ent->q_node);
+
+	pthread_mutex_lock(&lq->mutex);
+	list_add_tail(&ent->q_node, &lq->q);
+	pthread_cond_signal(&lq->cond);
+	pthread_mutex_unlock(&lq->mutex);
+	return true;
+}
+
+static void *list_pop(void *q, const struct timespec *abstime)
+{
+	struct list_q *lq = q;
+	struct list_ent *ent;
+	void *rval = NULL;
+
+	pthread_mutex_lock(&lq->mutex);
+	if (list_empty(&lq->q))
+		pthread_cond_wait(&lq->cond, &lq->mutex);
+	if (!list_empty(&lq->q)) {
+		ent = list_entry(lq->q.next, struct list_ent, q_node);
+		rval = ent->data;
+		list_del(&ent->q_node);
+		free(ent);
+	}
+	pthread_mutex_unlock(&lq->mutex);
+	return rval;
+}
+
+static void *ring_new(void)
+{
+	return tq_new();
+}
+
+static void ring_free(void *q)
+{
+	tq_free(q);
+}
+
+static bool ring_push(void *q, void *data)
+{
+	return tq_push(q, data);
+}
+
+static void *ring_pop(void *q, const struct timespec *abstime)
+{
+	return tq_pop(q, abstime);
+}
+
+struct queue_ops {
+	const char *name;
+	void *(*new)(void);
+	void (*free)(void *q);
+	bool (*push)(void *q, void *data);
+	void *(*pop)(void *q, const struct timespec *abstime);
+};
+
+static const struct queue_ops queues[] = {
+	{ "mutex list", list_new, list_free, list_push, list_pop },
+	{ "ring", ring_new, ring_free, ring_push, ring_pop },
+};
+
+struct producer {
+	pthread_t pth;
+	const struct queue_ops *ops;
+	void *q;
+	uintptr_t id;
+	long messages;
+};
+
+#define SEQ_BITS	24	/* low bits of a message hold its sequence */
+
+static void *producer_thread(void *arg)
+{
+	struct producer *p = arg;
+	long i;
+
+	for (i = 1; i <= p->messages; i++)
+		if (!p->ops->push(p->q, (void *)(p->id << SEQ_BITS | i))) {
+			fprintf(stderr, "push failed\n");
+			exit(1);
+		}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+/* Returns the number of messages that arrived out of order */
+static long run(const struct queue_ops *ops, int producers, long messages,
+	double *ns)
+{
+	struct producer *p = calloc(producers, sizeof(*p));
+	long *last = calloc(producers, sizeof(*last));
+	long got = 0, total = producers * messages, bad = 0;
+	void *q = ops->new();
+	double start;
+	uintptr_t v;
+	int i;
+
+	if (!p || !last || !q) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	start = now();
+	for (i = 0; i < producers; i++) {
+		p[i].ops = ops;
+		p[i].q = q;
+		p[i].id = i;
+		p[i].messages = messages;
+		if (pthread_create(&p[i].pth, NULL, producer_thread, &p[i])) {
+			fprintf(stderr, "thread create failed\n");
+			exit(1);
+		}
+	}
+	while (got < total) {
+		v = (uintptr_t)ops->pop(q, NULL);
+		if (!v)
+			continue;
+		i = v >> SEQ_BITS;
+		if ((long)(v & ((1 << SEQ_BITS) - 1)) != last[i] + 1)
+			bad++;
+		last[i] = v & ((1 << SEQ_BITS) - 1);
+		got++;
+	}
+	*ns = 1e9 * (now() - start) / total;
+	for (i = 0; i < producers; i++)
+		pthread_join(p[i].pth, NULL);
+	ops->free(q);
+	free(last);
+	free(p);
+	return bad;
+}
+
+int main(int argc, char *argv[])
+{
+	int producers = argc > 1 ? atoi(argv[1]) : 64;
+	long messages = argc > 2 ? atol(argv[2]) : 20000;
+	long bad, errors = 0;
+	double ns;
+	int i;
+
+	if (argc > 3 || producers < 1 || messages < 1 ||
+	    messages >= 1 << SEQ_BITS) {
+		fprintf(stderr, "Usage: %s [PRODUCERS [MESSAGES]]\n"
+			"Defaults: 64 producers pushing 20000 messages each\n",
+			argv[0]);
+		return 1;
+	}
+
+	printf("%d producers, %ld messages each\n", producers, messages);
+	for (i = 0; i < ARRAY_SIZE(queues); i++) {
+		bad = run(&queues[i], producers, messages, &ns);
+		printf("%-12s %8.1f ns/message%s\n", queues[i].name, ns,
+		       bad ? "  OUT OF ORDER" : "");
+		errors += bad;
+	}
+	return errors != 0;
+}
@@ -33,16 +33,24 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
 #endif
 #include "compat.h"
 #include "miner.h"
-#include "elist.h"
 
+#define CONNECT_TIMEOUT		30	/* seconds */
+#define CONNECT_ATTEMPT_DELAY	250	/* ms between racing connection attempts */
 
 struct header_info {
 	char		*lp_path;
 	char		*reason;
 	char		*stratum_url;
+	char		*roll_ntime;
 	size_t		content_length;
 };
 
@@ -53,20 +61,6 @@ struct data_buffer {
 	struct header_info	*headers;
 };
 
-struct tq_ent {
-	void			*data;
-	struct list_head	q_node;
-};
-
-struct thread_q {
-	struct list_head	q;
-
-	bool frozen;
-
-	pthread_mutex_t		mutex;
-	pthread_cond_t		cond;
-};
-
 void applog(int prio, const char *fmt, ...)
 {
 	va_list ap;
@@ -282,6 +276,11 @@ static size_t resp_hdr_cb(void *ptr, size_t size, size_t nmemb, void *user_data)
 		val = NULL;
 	}
 
+	if (!strcasecmp("X-Roll-NTime", key)) {
+		hi->roll_ntime = val;	/* steal memory reference */
+		val = NULL;
+	}
+
 	if (!strcasecmp("Content-Length", key))
 		hi->content_length = strtoul(val, NULL, 10);
 
@@ -335,22 +334,31 @@ static int sockopt_keepalive_cb(void *userdata, curl_socket_t fd,
 }
 #endif
 
-json_t *json_rpc_call(CURL *curl, const char *url,
-		      const char *userpass, const char *rpc_req,
-		      int *curl_err, int flags)
+/* A JSON-RPC request between json_rpc_begin and json_rpc_end */
+struct json_rpc_req {
+	CURL			*curl;
+	int			flags;
+	struct data_buffer	all_data;
+	struct header_info	hi;
+	struct curl_slist	*headers;
+	char			curl_err_str[CURL_ERROR_SIZE];
+};
+
+/* Sets up curl for a JSON-RPC request without performing it, so that it
+ * can be run by curl_easy_perform or added to a multi handle; rpc_req
+ * must stay valid until json_rpc_end. */
+struct json_rpc_req *json_rpc_begin(CURL *curl, const char *url,
+		      const char *userpass, const char *rpc_req, int flags)
 {
-	json_t *val, *err_val, *res_val;
-	int rc;
-	long http_rc;
-	struct data_buffer all_data = {0};
-	char *json_buf;
-	json_error_t err;
-	struct curl_slist *headers = NULL;
-	char curl_err_str[CURL_ERROR_SIZE];
+	struct json_rpc_req *r;
 	long timeout = (flags & JSON_RPC_LONGPOLL) ? opt_timeout : 30;
-	struct header_info hi = {0};
 
-	all_data.headers = &hi;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->curl = curl;
+	r->flags = flags;
+	r->all_data.headers = &r->hi;
 	/* it is assumed that 'curl' is freshly [re]initialized at this pt */
 
 	if (opt_protocol)
@@ -363,13 +371,13 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
 	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &all_data);
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &r->all_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, r->curl_err_str);
 	if (opt_redirect)
 		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &r->hi);
 	if (opt_proxy) {
 		curl_easy_setopt(curl, CURLOPT_PROXY, opt_proxy);
 		curl_easy_setopt(curl, CURLOPT_PROXYTYPE, opt_proxy_type);
@@ -381,55 +389,72 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 #if LIBCURL_VERSION_NUM >= 0x070f06
 	if (flags & JSON_RPC_LONGPOLL)
 		curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockopt_keepalive_cb);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073b00
+	curl_easy_setopt(curl, CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS,
+			 (long)CONNECT_ATTEMPT_DELAY);
 #endif
 	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, rpc_req);
 
 	if (opt_protocol)
 		applog(LOG_DEBUG, "JSON protocol request:\n%s\n", rpc_req);
 
-	headers = curl_slist_append(headers, "Content-Type: application/json");
-	headers = curl_slist_append(headers, "User-Agent: " USER_AGENT);
-	headers = curl_slist_append(headers, "X-Mining-Extensions: midstate");
-	headers = curl_slist_append(headers, "Accept:"); /* disable Accept hdr*/
-	headers = curl_slist_append(headers, "Expect:"); /* disable Expect hdr*/
+	r->headers = curl_slist_append(r->headers, "Content-Type: application/json");
+	r->headers = curl_slist_append(r->headers, "User-Agent: " USER_AGENT);
+	r->headers = curl_slist_append(r->headers, "X-Mining-Extensions: midstate");
+	r->headers = curl_slist_append(r->headers, "Accept:"); /* disable Accept hdr*/
+	r->headers = curl_slist_append(r->headers, "Expect:"); /* disable Expect hdr*/
 
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, r->headers);
+
+	return r;
+}
+
+/* Takes the outcome rc of a request set up by json_rpc_begin, frees it
+ * and returns the response, or NULL on failure */
+json_t *json_rpc_end(struct json_rpc_req *r, int rc, int *curl_err)
+{
+	CURL *curl = r->curl;
+	int flags = r->flags;
+	json_t *val, *err_val, *res_val;
+	long http_rc;
+	char *json_buf;
+	json_error_t err;
 
-	rc = curl_easy_perform(curl);
 	if (curl_err != NULL)
 		*curl_err = rc;
 	if (rc) {
 		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
 		if (!((flags & JSON_RPC_LONGPOLL) && rc == CURLE_OPERATION_TIMEDOUT) &&
 		    !((flags & JSON_RPC_QUIET_404) && http_rc == 404))
-			applog(LOG_ERR, "HTTP request failed: %s", curl_err_str);
+			applog(LOG_ERR, "HTTP request failed: %s", r->curl_err_str);
 		if (curl_err && (flags & JSON_RPC_QUIET_404) && http_rc == 404)
 			*curl_err = CURLE_OK;
 		goto err_out;
 	}
 
 	/* If X-Stratum was found, activate Stratum */
-	if (want_stratum && hi.stratum_url &&
-	    !strncasecmp(hi.stratum_url, "stratum+tcp://", 14)) {
+	if (want_stratum && r->hi.stratum_url &&
+	    !strncasecmp(r->hi.stratum_url, "stratum+tcp://", 14)) {
 		have_stratum = true;
-		tq_push(thr_info[stratum_thr_id].q, hi.stratum_url);
-		hi.stratum_url = NULL;
+		tq_push(thr_info[stratum_thr_id].q, r->hi.stratum_url);
+		r->hi.stratum_url = NULL;
 	}
 
 	/* If X-Long-Polling was found, activate long polling */
-	if (!have_longpoll && want_longpoll && hi.lp_path && !have_gbt &&
+	if (!have_longpoll && want_longpoll && r->hi.lp_path && !have_gbt &&
 	    allow_getwork && !have_stratum) {
 		have_longpoll = true;
-		tq_push(thr_info[longpoll_thr_id].q, hi.lp_path);
-		hi.lp_path = NULL;
+		tq_push(thr_info[longpoll_thr_id].q, r->hi.lp_path);
+		r->hi.lp_path = NULL;
 	}
 
-	if (!all_data.buf) {
+	if (!r->all_data.buf) {
 		applog(LOG_ERR, "Empty data received in json_rpc_call.");
 		goto err_out;
 	}
 
-	json_buf = hack_json_numbers(all_data.buf);
+	json_buf = hack_json_numbers(r->all_data.buf);
 	errno = 0; /* needed for Jansson < 2.1 */
 	val = JSON_LOADS(json_buf, &err);
 	free(json_buf);
@@ -463,24 +488,42 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		goto err_out;
 	}
 
-	if (hi.reason)
-		json_object_set_new(val, "reject-reason", json_string(hi.reason));
+	if (r->hi.reason)
+		json_object_set_new(val, "reject-reason", json_string(r->hi.reason));
+	if (r->hi.roll_ntime)
+		json_object_set_new(val, "roll-ntime", json_string(r->hi.roll_ntime));
+	free(r->hi.roll_ntime);
 
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
+	databuf_free(&r->all_data);
+	curl_slist_free_all(r->headers);
 	curl_easy_reset(curl);
+	free(r);
 	return val;
 
 err_out:
-	free(hi.lp_path);
-	free(hi.reason);
-	free(hi.stratum_url);
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
+	free(r->hi.lp_path);
+	free(r->hi.reason);
+	free(r->hi.stratum_url);
+	free(r->hi.roll_ntime);
+	databuf_free(&r->all_data);
+	curl_slist_free_all(r->headers);
 	curl_easy_reset(curl);
+	free(r);
 	return NULL;
 }
 
+json_t *json_rpc_call(CURL *curl, const char *url,
+		      const char *userpass, const char *rpc_req,
+		      int *curl_err, int flags)
+{
+	struct json_rpc_req *r;
+
+	r = json_rpc_begin(curl, url, userpass, rpc_req, flags);
+	if (!r)
+		return NULL;
+	return json_rpc_end(r, curl_easy_perform(curl), curl_err);
+}
+
 void memrev(unsigned char *p, size_t len)
 {
 	unsigned char c, *q;
@@ -891,161 +934,249 @@ void diff_to_target(uint32_t *target, double diff)
 	}
 }
 
+#define RBUFSIZE 2048
+
 #ifdef WIN32
 #define socket_blocks() (WSAGetLastError() == WSAEWOULDBLOCK)
 #else
 #define socket_blocks() (errno == EAGAIN || errno == EWOULDBLOCK)
 #endif
 
-static bool send_line(struct stratum_ctx *sctx, char *s)
+#ifndef HAVE_SYS_EPOLL_H
+static bool socket_wait(curl_socket_t sock, bool write, int timeout_ms)
 {
-	ssize_t len, sent = 0;
-	
-	len = strlen(s);
-	s[len++] = '\n';
+	struct timeval tv;
+	fd_set fds;
 
-	while (len > 0) {
-		struct timeval timeout = {0, 0};
-		ssize_t n;
-		fd_set wd;
+	FD_ZERO(&fds);
+	FD_SET(sock, &fds);
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = timeout_ms % 1000 * 1000;
+	if (select(sock + 1, write ? NULL : &fds, write ? &fds : NULL, NULL, &tv) > 0)
+		return true;
+	return false;
+}
+#endif
 
-		FD_ZERO(&wd);
-		FD_SET(sctx->sock, &wd);
-		if (select(sctx->sock + 1, NULL, &wd, NULL, &timeout) < 1)
-			return false;
+#ifdef HAVE_SYS_EPOLL_H
+/* Called with sock_lock held */
+static void stratum_watch(struct stratum_ctx *sctx, bool write)
+{
+	struct epoll_event ev;
+
+	if (write == sctx->want_write)
+		return;
+	ev.events = EPOLLIN | (write ? EPOLLOUT : 0);
+	ev.data.ptr = sctx;
+	if (!epoll_ctl(sctx->epfd, EPOLL_CTL_MOD, sctx->sock, &ev))
+		sctx->want_write = write;
+}
+#endif
+
+/* Called with sock_lock held.  Sends as much of the queued output as the
+ * socket takes without blocking and keeps the rest for later. */
+static bool stratum_flush(struct stratum_ctx *sctx)
+{
+	size_t sent = 0;
+
+	if (!sctx->curl)
+		return false;
+
+	while (sent < sctx->sendbuf_len) {
+		ssize_t n;
 #if LIBCURL_VERSION_NUM >= 0x071202
-		CURLcode rc = curl_easy_send(sctx->curl, s + sent, len, (size_t *)&n);
+		CURLcode rc = curl_easy_send(sctx->curl, sctx->sendbuf + sent,
+		                             sctx->sendbuf_len - sent, (size_t *)&n);
 		if (rc != CURLE_OK) {
 			if (rc != CURLE_AGAIN)
 #else
-		n = send(sctx->sock, s + sent, len, 0);
+		n = send(sctx->sock, sctx->sendbuf + sent, sctx->sendbuf_len - sent, 0);
 		if (n < 0) {
 			if (!socket_blocks())
 #endif
 				return false;
-			n = 0;
+			break;
 		}
 		sent += n;
-		len -= n;
+	}
+	if (sent) {
+		sctx->sendbuf_len -= sent;
+		memmove(sctx->sendbuf, sctx->sendbuf + sent, sctx->sendbuf_len);
 	}
 
+#ifdef HAVE_SYS_EPOLL_H
+	stratum_watch(sctx, sctx->sendbuf_len > 0);
+#endif
 	return true;
 }
 
 bool stratum_send_line(struct stratum_ctx *sctx, char *s)
 {
+	size_t len = strlen(s);
 	bool ret = false;
 
-	if (true)
-		applog(LOG_ERR, "> %s", s);
+	if (opt_protocol)
+		applog(LOG_DEBUG, "> %s", s);
 
 	pthread_mutex_lock(&sctx->sock_lock);
-	ret = send_line(sctx, s);
+	if (sctx->sendbuf_len + len + 1 > sctx->sendbuf_size) {
+		size_t size = sctx->sendbuf_len + len + 1 + RBUFSIZE;
+		char *buf = realloc(sctx->sendbuf, size);
+		if (!buf)
+			goto out;
+		sctx->sendbuf = buf;
+		sctx->sendbuf_size = size;
+	}
+	memcpy(sctx->sendbuf + sctx->sendbuf_len, s, len);
+	sctx->sendbuf[sctx->sendbuf_len + len] = '\n';
+	sctx->sendbuf_len += len + 1;
+
+	ret = stratum_flush(sctx);
+#ifndef HAVE_SYS_EPOLL_H
+	/* nobody else watches for writability; drain the queue here */
+	while (ret && sctx->sendbuf_len) {
+		ret = socket_wait(sctx->sock, true, 30000) && stratum_flush(sctx);
+	}
+#endif
+out:
 	pthread_mutex_unlock(&sctx->sock_lock);
 
 	return ret;
 }
 
-static bool socket_full(curl_socket_t sock, int timeout)
+/* Waits up to timeout_ms for the socket to become readable, flushing
+ * queued output as it drains.  Returns 1 if readable, 0 on timeout and
+ * -1 on error. */
+static int stratum_wait(struct stratum_ctx *sctx, int timeout_ms)
 {
-	struct timeval tv;
-	fd_set rd;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	struct timeval end, now;
+	int n;
+
+	gettimeofday(&end, NULL);
+	end.tv_sec += timeout_ms / 1000;
+	end.tv_usec += timeout_ms % 1000 * 1000;
+	if (end.tv_usec >= 1000000) {
+		end.tv_sec++;
+		end.tv_usec -= 1000000;
+	}
+	while (1) {
+		n = epoll_wait(sctx->epfd, &ev, 1, timeout_ms);
+		if (n < 0 && errno != EINTR)
+			return -1;
+		if (n > 0) {
+			if (ev.events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				return 1;
+			if (ev.events & EPOLLOUT) {
+				bool ok;
+				pthread_mutex_lock(&sctx->sock_lock);
+				ok = stratum_flush(sctx);
+				pthread_mutex_unlock(&sctx->sock_lock);
+				if (!ok)
+					return -1;
+			}
+		}
+		gettimeofday(&now, NULL);
+		timeout_ms = (end.tv_sec - now.tv_sec) * 1000
+		           + (end.tv_usec - now.tv_usec) / 1000;
+		if (timeout_ms <= 0)
+			return 0;
+	}
+#else
+	return socket_wait(sctx->sock, false, timeout_ms) ? 1 : 0;
+#endif
+}
 
-	FD_ZERO(&rd);
-	FD_SET(sock, &rd);
-	tv.tv_sec = timeout;
-	tv.tv_usec = 0;
-	if (select(sock + 1, &rd, NULL, NULL, &tv) > 0)
-		return true;
-	return false;
+/* Looks for a complete line among the bytes not searched yet */
+static char *stratum_find_line(struct stratum_ctx *sctx)
+{
+	char *nl;
+
+	nl = memchr(sctx->sockbuf + sctx->sockbuf_scan, '\n',
+	            sctx->sockbuf_end - sctx->sockbuf_scan);
+	sctx->sockbuf_scan = nl ? nl - sctx->sockbuf : sctx->sockbuf_end;
+	return nl;
 }
 
 bool stratum_socket_full(struct stratum_ctx *sctx, int timeout)
 {
-	return strlen(sctx->sockbuf) || socket_full(sctx->sock, timeout);
+	return stratum_find_line(sctx) || stratum_wait(sctx, timeout * 1000) > 0;
 }
 
-#define RBUFSIZE 2048
-#define RECVSIZE (RBUFSIZE - 4)
-
-static void stratum_buffer_append(struct stratum_ctx *sctx, const char *s)
+/* Reads whatever the socket has available.  Consumed lines are reclaimed
+ * by sliding the partial line at the end down to the start of the buffer,
+ * which only happens when the buffer is full; it grows if a single line
+ * does not fit. */
+static bool stratum_fill(struct stratum_ctx *sctx)
 {
-	size_t old, new;
+	while (1) {
+		ssize_t n;
 
-	old = strlen(sctx->sockbuf);
-	new = old + strlen(s) + 1;
-	if (new >= sctx->sockbuf_size) {
-		sctx->sockbuf_size = new + (RBUFSIZE - (new % RBUFSIZE));
-		sctx->sockbuf = realloc(sctx->sockbuf, sctx->sockbuf_size);
+		if (sctx->sockbuf_end == sctx->sockbuf_size) {
+			if (sctx->sockbuf_start) {
+				sctx->sockbuf_end -= sctx->sockbuf_start;
+				sctx->sockbuf_scan -= sctx->sockbuf_start;
+				memmove(sctx->sockbuf, sctx->sockbuf + sctx->sockbuf_start,
+				        sctx->sockbuf_end);
+				sctx->sockbuf_start = 0;
+			} else {
+				char *buf = realloc(sctx->sockbuf, 2 * sctx->sockbuf_size);
+				if (!buf)
+					return false;
+				sctx->sockbuf = buf;
+				sctx->sockbuf_size *= 2;
+			}
+		}
+#if LIBCURL_VERSION_NUM >= 0x071202
+		CURLcode rc = curl_easy_recv(sctx->curl, sctx->sockbuf + sctx->sockbuf_end,
+		                             sctx->sockbuf_size - sctx->sockbuf_end, (size_t *)&n);
+		if (rc == CURLE_OK && !n)
+			return false;
+		if (rc != CURLE_OK)
+			return rc == CURLE_AGAIN;
+#else
+		n = recv(sctx->sock, sctx->sockbuf + sctx->sockbuf_end,
+		         sctx->sockbuf_size - sctx->sockbuf_end, 0);
+		if (!n)
+			return false;
+		if (n < 0)
+			return socket_blocks();
+#endif
+		sctx->sockbuf_end += n;
 	}
-	strcpy(sctx->sockbuf + old, s);
 }
 
+/* Returns the next line, NUL-terminated in place.  The string points into
+ * the receive buffer and stays valid until the next call. */
 char *stratum_recv_line(struct stratum_ctx *sctx)
 {
-	ssize_t len, buflen;
-	char *tok, *sret = NULL;
-
-	if (!strstr(sctx->sockbuf, "\n")) {
-		bool ret = true;
-		time_t rstart;
-
-		time(&rstart);
-		if (!socket_full(sctx->sock, 60)) {
-			applog(LOG_ERR, "stratum_recv_line timed out");
-			goto out;
-		}
-		do {
-			char s[RBUFSIZE];
-			ssize_t n;
-
-			memset(s, 0, RBUFSIZE);
-#if LIBCURL_VERSION_NUM >= 0x071202
-			CURLcode rc = curl_easy_recv(sctx->curl, s, RECVSIZE, (size_t *)&n);
-			if (rc == CURLE_OK && !n) {
-				ret = false;
-				break;
-			}
-			if (rc != CURLE_OK) {
-				if (rc != CURLE_AGAIN || !socket_full(sctx->sock, 1)) {
-#else
-			n = recv(sctx->sock, s, RECVSIZE, 0);
+	char *nl, *sret;
+	time_t rstart;
+	int n;
+
+	time(&rstart);
+	do {
+		while (!(nl = stratum_find_line(sctx))) {
+			int timeout = 60 - (time(NULL) - rstart);
+			n = timeout > 0 ? stratum_wait(sctx, timeout * 1000) : 0;
 			if (!n) {
-				ret = false;
-				break;
+				applog(LOG_ERR, "stratum_recv_line timed out");
+				return NULL;
+			}
+			if (n < 0 || !stratum_fill(sctx)) {
+				applog(LOG_ERR, "stratum_recv_line failed");
+				return NULL;
 			}
-			if (n < 0) {
-				if (!socket_blocks() || !socket_full(sctx->sock, 1)) {
-#endif
-					ret = false;
-					break;
-				}
-			} else
-				stratum_buffer_append(sctx, s);
-		} while (time(NULL) - rstart < 60 && !strstr(sctx->sockbuf, "\n"));
-
-		if (!ret) {
-			applog(LOG_ERR, "stratum_recv_line failed");
-			goto out;
 		}
-	}
+		*nl = '\0';
+		sret = sctx->sockbuf + sctx->sockbuf_start;
+		sctx->sockbuf_start = sctx->sockbuf_scan = nl - sctx->sockbuf + 1;
+		if (sctx->sockbuf_start == sctx->sockbuf_end)
+			sctx->sockbuf_start = sctx->sockbuf_end = sctx->sockbuf_scan = 0;
+	} while (!*sret);
 
-	buflen = strlen(sctx->sockbuf);
-	tok = strtok(sctx->sockbuf, "\n");
-	if (!tok) {
-		applog(LOG_ERR, "stratum_recv_line failed to parse a newline-terminated string");
-		goto out;
-	}
-	sret = strdup(tok);
-	len = strlen(sret);
-
-	if (buflen > len + 1)
-		memmove(sctx->sockbuf, sctx->sockbuf + len + 1, buflen - len + 1);
-	else
-		sctx->sockbuf[0] = '\0';
-
-out:
-	if (sret && opt_protocol)
+	if (opt_protocol)
 		applog(LOG_DEBUG, "< %s", sret);
 	return sret;
 }
@@ -1060,14 +1191,249 @@ static curl_socket_t opensocket_grab_cb(void *clientp, curlsocktype purpose,
 }
 #endif
 
+#if !defined(WIN32) && LIBCURL_VERSION_NUM >= 0x071505
+#define STRATUM_RACE
+#define RACE_MAX_ADDRS	16
+
+static curl_socket_t opensocket_raced_cb(void *clientp, curlsocktype purpose,
+	struct curl_sockaddr *addr)
+{
+	curl_socket_t *sock = clientp;
+	curl_socket_t fd = *sock;
+
+	*sock = CURL_SOCKET_BAD;	/* curl owns it from now on */
+	return fd;
+}
+
+static int sockopt_connected_cb(void *userdata, curl_socket_t fd,
+	curlsocktype purpose)
+{
+	if (sockopt_keepalive_cb(userdata, fd, purpose))
+		return CURL_SOCKOPT_ERROR;
+	return CURL_SOCKOPT_ALREADY_CONNECTED;
+}
+
+/* Splits "stratum+tcp://host:port" into its host and port;
+ * IPv6 literals are written in brackets. */
+static bool url_host_port(const char *url, char *host, size_t host_size,
+	char *port, size_t port_size)
+{
+	const char *p, *end;
+	size_t len;
+
+	p = strstr(url, "://");
+	p = p ? p + 3 : url;
+	if (*p == '[') {
+		end = strchr(++p, ']');
+		if (!end)
+			return false;
+	} else
+		end = p + strcspn(p, ":/");
+	len = end - p;
+	if (!len || len >= host_size)
+		return false;
+	memcpy(host, p, len);
+	host[len] = '\0';
+	p = end + (*end == ']');
+	if (*p++ != ':')
+		return false;
+	len = strcspn(p, "/");
+	if (!len || len >= port_size)
+		return false;
+	memcpy(port, p, len);
+	port[len] = '\0';
+	return true;
+}
+
+static int race_start(const struct addrinfo *ai)
+{
+	int fd;
+
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd < 0)
+		return -1;
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+	    (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Waits for one of the n pending attempts to complete.  Failed attempts
+ * are closed and dropped from the arrays; returns the index of an attempt
+ * that connected, or -1. */
+static int race_wait(struct pollfd *pfd, const struct addrinfo **ai, int *n,
+	int timeout_ms)
+{
+	socklen_t len;
+	int i, err;
+
+	if (poll(pfd, *n, timeout_ms) <= 0)
+		return -1;
+	for (i = 0; i < *n; ) {
+		if (!pfd[i].revents) {
+			i++;
+			continue;
+		}
+		err = 0;
+		len = sizeof(err);
+		if (!getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) && !err)
+			return i;
+		close(pfd[i].fd);
+		--*n;
+		pfd[i] = pfd[*n];
+		ai[i] = ai[*n];
+	}
+	return -1;
+}
+
+static int elapsed_ms(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000
+	     + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+/* Happy Eyeballs (RFC 8305): attempts to the resolved addresses start
+ * CONNECT_ATTEMPT_DELAY ms apart, or as soon as the previous one fails,
+ * with the address families interleaved; the first to connect wins.
+ * The address that worked last time gets a head start of one delay
+ * before the name is even looked up. */
+static curl_socket_t stratum_race(struct stratum_ctx *sctx, const char *host,
+	const char *port)
+{
+	struct addrinfo hints, *cached = NULL, *res = NULL, *ai;
+	const struct addrinfo *cand[RACE_MAX_ADDRS], *pend[RACE_MAX_ADDRS];
+	const struct addrinfo *first[RACE_MAX_ADDRS], *other[RACE_MAX_ADDRS];
+	struct pollfd pfd[RACE_MAX_ADDRS];
+	struct timeval start;
+	int n_cand = 0, n_first = 0, n_other = 0, next, next_at, n = 0;
+	int i, j, err, fd, now, timeout;
+	curl_socket_t sock = CURL_SOCKET_BAD;
+
+	gettimeofday(&start, NULL);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (sctx->last_addr[0]) {
+		hints.ai_flags = AI_NUMERICHOST;
+		if (!getaddrinfo(sctx->last_addr, port, &hints, &cached)) {
+			cand[n_cand++] = cached;
+			fd = race_start(cached);
+			if (fd >= 0) {
+				pfd[0].fd = fd;
+				pfd[0].events = POLLOUT;
+				pend[n++] = cached;
+				i = race_wait(pfd, pend, &n, CONNECT_ATTEMPT_DELAY);
+				if (i >= 0)
+					goto won;
+			}
+		}
+		hints.ai_flags = 0;
+	}
+
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err)
+		applog(LOG_ERR, "Stratum: cannot resolve %s: %s", host, gai_strerror(err));
+	for (ai = err ? NULL : res;
+	     ai && n_first + n_other < RACE_MAX_ADDRS - n_cand; ai = ai->ai_next) {
+		if (cached && ai->ai_addrlen == cached->ai_addrlen &&
+		    !memcmp(ai->ai_addr, cached->ai_addr, ai->ai_addrlen))
+			continue;
+		if (ai->ai_family == res->ai_family)
+			first[n_first++] = ai;
+		else
+			other[n_other++] = ai;
+	}
+	/* interleave the address families: A1 B1 A2 B2 ... */
+	for (i = j = 0; i < n_first || j < n_other; ) {
+		if (i < n_first)
+			cand[n_cand++] = first[i++];
+		if (j < n_other)
+			cand[n_cand++] = other[j++];
+	}
+	next = n_cand - n_first - n_other;
+	next_at = elapsed_ms(&start);
+
+	while (next < n_cand || n) {
+		now = elapsed_ms(&start);
+		if (now >= CONNECT_TIMEOUT * 1000)
+			break;
+		if (next < n_cand && (!n || now >= next_at)) {
+			fd = race_start(cand[next]);
+			if (fd >= 0) {
+				pfd[n].fd = fd;
+				pfd[n].events = POLLOUT;
+				pend[n++] = cand[next];
+			}
+			next++;
+			next_at = now + CONNECT_ATTEMPT_DELAY;
+			continue;
+		}
+		timeout = CONNECT_TIMEOUT * 1000 - now;
+		if (next < n_cand && next_at - now < timeout)
+			timeout = next_at - now;
+		j = n;
+		i = race_wait(pfd, pend, &n, timeout);
+		if (i >= 0)
+			goto won;
+		if (n < j)
+			next_at = now;	/* an attempt failed: start the next one */
+	}
+	applog(LOG_ERR, "Stratum: no address of %s accepted a connection", host);
+	goto out;
+
+won:
+	sock = pfd[i].fd;
+	if (getnameinfo(pend[i]->ai_addr, pend[i]->ai_addrlen, sctx->last_addr,
+			sizeof(sctx->last_addr), NULL, 0, NI_NUMERICHOST))
+		sctx->last_addr[0] = '\0';
+	pfd[i] = pfd[--n];
+out:
+	for (i = 0; i < n; i++)
+		close(pfd[i].fd);
+	if (res)
+		freeaddrinfo(res);
+	if (cached)
+		freeaddrinfo(cached);
+	return sock;
+}
+#endif /* STRATUM_RACE */
+
+/* Called with sock_lock held */
+static void stratum_close(struct stratum_ctx *sctx)
+{
+	if (sctx->curl) {
+#ifdef HAVE_SYS_EPOLL_H
+		if (sctx->epfd >= 0)
+			close(sctx->epfd);
+		sctx->epfd = -1;
+		sctx->want_write = false;
+#endif
+		curl_easy_cleanup(sctx->curl);
+		sctx->curl = NULL;
+	}
+	sctx->sockbuf_start = sctx->sockbuf_end = sctx->sockbuf_scan = 0;
+	sctx->sendbuf_len = 0;
+}
+
 bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 {
 	CURL *curl;
 	int rc;
+#ifdef STRATUM_RACE
+	struct curl_slist *resolve = NULL;
+	curl_socket_t raced = CURL_SOCKET_BAD;
+	char host[256], port[16], entry[sizeof(host) + sizeof(port) + 64];
+#endif
+	struct timeval start, end, diff;
 
+	gettimeofday(&start, NULL);
 	pthread_mutex_lock(&sctx->sock_lock);
-	if (sctx->curl)
-		curl_easy_cleanup(sctx->curl);
+	stratum_close(sctx);
 	sctx->curl = curl_easy_init();
 	if (!sctx->curl) {
 		applog(LOG_ERR, "CURL initialization failed");
@@ -1076,10 +1442,9 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 	}
 	curl = sctx->curl;
 	if (!sctx->sockbuf) {
-		sctx->sockbuf = calloc(RBUFSIZE, 1);
+		sctx->sockbuf = malloc(RBUFSIZE);
 		sctx->sockbuf_size = RBUFSIZE;
 	}
-	sctx->sockbuf[0] = '\0';
 	pthread_mutex_unlock(&sctx->sock_lock);
 
 	if (url != sctx->url) {
@@ -1096,7 +1461,7 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 	if (opt_cert)
 		curl_easy_setopt(curl, CURLOPT_CAINFO, opt_cert);
 	curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
-	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
 	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, sctx->curl_err_str);
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
 	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
@@ -1113,8 +1478,34 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 	curl_easy_setopt(curl, CURLOPT_OPENSOCKETDATA, &sctx->sock);
 #endif
 	curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1);
+#ifdef STRATUM_RACE
+	/* Connect ourselves and hand curl the winning socket */
+	if (!opt_proxy && url_host_port(url, host, sizeof(host), port, sizeof(port))) {
+		raced = stratum_race(sctx, host, port);
+		if (raced == CURL_SOCKET_BAD) {
+			applog(LOG_ERR, "Stratum connection failed: %s", sctx->url);
+			curl_easy_cleanup(curl);
+			sctx->curl = NULL;
+			return false;
+		}
+		sctx->sock = raced;
+		if (!strchr(host, ':')) {
+			snprintf(entry, sizeof(entry), "%s:%s:%s", host, port, sctx->last_addr);
+			resolve = curl_slist_append(NULL, entry);
+			curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+		}
+		curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, opensocket_raced_cb);
+		curl_easy_setopt(curl, CURLOPT_OPENSOCKETDATA, &raced);
+		curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockopt_connected_cb);
+	}
+#endif
 
 	rc = curl_easy_perform(curl);
+#ifdef STRATUM_RACE
+	curl_slist_free_all(resolve);
+	if (raced != CURL_SOCKET_BAD)
+		close(raced);
+#endif
 	if (rc) {
 		applog(LOG_ERR, "Stratum connection failed: %s", sctx->curl_err_str);
 		curl_easy_cleanup(curl);
@@ -1129,17 +1520,43 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 	curl_easy_getinfo(curl, CURLINFO_LASTSOCKET, (long *)&sctx->sock);
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+	{
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = sctx;
+		sctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (sctx->epfd < 0 ||
+		    epoll_ctl(sctx->epfd, EPOLL_CTL_ADD, sctx->sock, &ev) < 0) {
+			applog(LOG_ERR, "Stratum epoll setup failed (errno = %d)", errno);
+			pthread_mutex_lock(&sctx->sock_lock);
+			stratum_close(sctx);
+			pthread_mutex_unlock(&sctx->sock_lock);
+			return false;
+		}
+	}
+#endif
+
+	gettimeofday(&end, NULL);
+	timeval_subtract(&diff, &end, &start);
+	pthread_mutex_lock(&sctx->sock_lock);
+	sctx->connect_ms = 1e3 * diff.tv_sec + 1e-3 * diff.tv_usec;
+	sctx->connect_ms_sum += sctx->connect_ms;
+	sctx->connects++;
+	pthread_mutex_unlock(&sctx->sock_lock);
+	if (opt_debug)
+		applog(LOG_DEBUG, "DEBUG: connected to %s%s%s%s in %.1f ms", sctx->url,
+		       sctx->last_addr[0] ? " (" : "", sctx->last_addr,
+		       sctx->last_addr[0] ? ")" : "", sctx->connect_ms);
+
 	return true;
 }
 
 void stratum_disconnect(struct stratum_ctx *sctx)
 {
 	pthread_mutex_lock(&sctx->sock_lock);
-	if (sctx->curl) {
-		curl_easy_cleanup(sctx->curl);
-		sctx->curl = NULL;
-		sctx->sockbuf[0] = '\0';
-	}
+	stratum_close(sctx);
 	pthread_mutex_unlock(&sctx->sock_lock);
 }
 
@@ -1167,10 +1584,73 @@ static const char *get_stratum_session_id(json_t *val)
 	return NULL;
 }
 
+/* BIP 310: asks for the general purpose version bits (BIP 320).  Pools
+ * that do not know the method answer with an error or not at all, which
+ * only leaves version rolling off; false means the connection failed. */
+bool stratum_configure(struct stratum_ctx *sctx)
+{
+	char s[] = "{\"id\": 3, \"method\": \"mining.configure\", \"params\": "
+		"[[\"version-rolling\"], {\"version-rolling.mask\": \"1fffe000\", "
+		"\"version-rolling.min-bit-count\": 2}]}";
+	char *sret;
+	json_t *val, *res_val;
+	json_error_t err;
+	const char *mask;
+
+	pthread_mutex_lock(&sctx->work_lock);
+	sctx->version_rolling = false;
+	sctx->version_mask = 0;
+	pthread_mutex_unlock(&sctx->work_lock);
+
+	if (!stratum_send_line(sctx, s))
+		return false;
+
+	while (1) {
+		if (!stratum_socket_full(sctx, 5)) {
+			if (opt_debug)
+				applog(LOG_DEBUG, "DEBUG: no reply to mining.configure");
+			return true;
+		}
+		sret = stratum_recv_line(sctx);
+		if (!sret)
+			return false;
+		if (!stratum_handle_method(sctx, sret))
+			break;
+	}
+
+	val = JSON_LOADS(sret, &err);
+	if (!val) {
+		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
+		return true;
+	}
+	res_val = json_object_get(val, "result");
+	mask = json_string_value(json_object_get(res_val, "version-rolling.mask"));
+	if (json_integer_value(json_object_get(val, "id")) == 3 &&
+	    json_is_true(json_object_get(res_val, "version-rolling")) && mask) {
+		pthread_mutex_lock(&sctx->work_lock);
+		sctx->version_rolling = true;
+		sctx->version_mask = strtoul(mask, NULL, 16) & 0x1fffe000;
+		pthread_mutex_unlock(&sctx->work_lock);
+		applog(LOG_INFO, "Stratum version rolling enabled, mask %08x",
+		       sctx->version_mask);
+	}
+	json_decref(val);
+
+	return true;
+}
+
+/* Bytes of extranonce2 a proxy prefixes to its clients' extranonce1 */
+int stratum_proxy_prefix(size_t xnonce2_size)
+{
+	return xnonce2_size >= 4 ? 2 : xnonce2_size >= 2 ? 1 : 0;
+}
+
 bool stratum_subscribe(struct stratum_ctx *sctx)
 {
 	char *s, *sret = NULL;
 	const char *sid, *xnonce1;
+	unsigned char *xn1;
+	size_t xn1_size;
 	int xn2_size;
 	json_t *val = NULL, *res_val, *err_val;
 	json_error_t err;
@@ -1190,20 +1670,28 @@ start:
 		goto out;
 	}
 
-	if (!socket_full(sctx->sock, 30)) {
+	if (!stratum_socket_full(sctx, 30)) {
 		applog(LOG_ERR, "stratum_subscribe timed out");
 		goto out;
 	}
 
-	sret = stratum_recv_line(sctx);
-	if (!sret)
-		goto out;
-
-	val = JSON_LOADS(sret, &err);
-	free(sret);
-	if (!val) {
-		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
-		goto out;
+	/* skip notifications and a reply to mining.configure that came
+	 * after stratum_configure stopped waiting */
+	while (1) {
+		sret = stratum_recv_line(sctx);
+		if (!sret)
+			goto out;
+		if (stratum_handle_method(sctx, sret))
+			continue;
+		val = JSON_LOADS(sret, &err);
+		if (!val) {
+			applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
+			goto out;
+		}
+		if (json_integer_value(json_object_get(val, "id")) == 1)
+			break;
+		json_decref(val);
+		val = NULL;
 	}
 
 	res_val = json_object_get(val, "result");
@@ -1240,14 +1728,28 @@ start:
 		goto out;
 	}
 
+	xn1_size = strlen(xnonce1) / 2;
+	xn1 = malloc(xn1_size);
+	hex2bin(xn1, xnonce1, xn1_size);
+
 	pthread_mutex_lock(&sctx->work_lock);
 	free(sctx->session_id);
-	free(sctx->xnonce1);
 	sctx->session_id = sid ? strdup(sid) : NULL;
-	sctx->xnonce1_size = strlen(xnonce1) / 2;
-	sctx->xnonce1 = malloc(sctx->xnonce1_size);
-	hex2bin(sctx->xnonce1, xnonce1, sctx->xnonce1_size);
+	/* a resumed session keeps its extranonce, and so does work built on it */
+	if (!sctx->xnonce1 || sctx->xnonce1_size != xn1_size ||
+	    memcmp(sctx->xnonce1, xn1, xn1_size) || sctx->xnonce2_size != xn2_size)
+		sctx->session_seq++;
+	else
+		applog(LOG_INFO, "Stratum session resumed");
+	free(sctx->xnonce1);
+	sctx->xnonce1_size = xn1_size;
+	sctx->xnonce1 = xn1;
 	sctx->xnonce2_size = xn2_size;
+	sctx->xnonce2_fixed = sctx->proxied ? stratum_proxy_prefix(xn2_size) : 0;
+	if (sctx->job.xnonce2) {
+		memset(sctx->job.xnonce2, 0, sctx->xnonce2_fixed);
+		sctx->job.roots_next = sctx->job.roots_ready = 0;
+	}
 	sctx->next_diff = 1.0;
 	pthread_mutex_unlock(&sctx->work_lock);
 
@@ -1260,6 +1762,7 @@ out:
 	free(s);
 	if (val)
 		json_decref(val);
+	val = NULL;
 
 	if (!ret) {
 		if (sret && !retry) {
@@ -1271,6 +1774,17 @@ out:
 	return ret;
 }
 
+/* Asks for mining.set_extranonce instead of a reconnect when the server
+ * moves us to another extranonce1.  The reply is not waited for: servers
+ * without support just never send the notification, and stratum_authorize
+ * skips the reply, whether it is true or an error. */
+bool stratum_extranonce_subscribe(struct stratum_ctx *sctx)
+{
+	char s[] = "{\"id\": 5, \"method\": \"mining.extranonce.subscribe\", \"params\": []}";
+
+	return stratum_send_line(sctx, s);
+}
+
 bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *pass)
 {
 	json_t *val = NULL, *res_val, *err_val;
@@ -1285,20 +1799,23 @@ bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *p
 	if (!stratum_send_line(sctx, s))
 		goto out;
 
+	/* skip notifications and replies to other requests, such as an
+	 * error for mining.extranonce.subscribe */
 	while (1) {
 		sret = stratum_recv_line(sctx);
 		if (!sret)
 			goto out;
-		if (!stratum_handle_method(sctx, sret))
+		if (stratum_handle_method(sctx, sret))
+			continue;
+		val = JSON_LOADS(sret, &err);
+		if (!val) {
+			applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
+			goto out;
+		}
+		if (json_integer_value(json_object_get(val, "id")) == 2)
 			break;
-		free(sret);
-	}
-
-	val = JSON_LOADS(sret, &err);
-	free(sret);
-	if (!val) {
-		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
-		goto out;
+		json_decref(val);
+		val = NULL;
 	}
 
 	res_val = json_object_get(val, "result");
@@ -1320,102 +1837,484 @@ out:
 	return ret;
 }
 
-static bool stratum_notify(struct stratum_ctx *sctx, json_t *params)
+/* Decodes exactly len bytes; unlike hex2bin() the input need not end there */
+static bool hex_decode(unsigned char *p, const char *hex, size_t len)
 {
+	while (len--) {
+		int i, v = 0;
+		for (i = 0; i < 2; i++, hex++) {
+			v <<= 4;
+			if (*hex >= '0' && *hex <= '9')
+				v |= *hex - '0';
+			else if (*hex >= 'a' && *hex <= 'f')
+				v |= *hex - 'a' + 10;
+			else if (*hex >= 'A' && *hex <= 'F')
+				v |= *hex - 'A' + 10;
+			else
+				return false;
+		}
+		*p++ = v;
+	}
+	return true;
+}
+
+struct stratum_notify {
 	const char *job_id, *prevhash, *coinb1, *coinb2, *version, *nbits, *ntime;
-	size_t coinb1_size, coinb2_size;
-	bool clean, ret = false;
-	int merkle_count, i;
+	size_t job_id_len, prevhash_len, coinb1_len, coinb2_len;
+	size_t version_len, nbits_len, ntime_len;
+	int merkle_count;
+	const char **merkle;	/* 64 hex digits each */
+	bool clean;
+};
+
+/* The coinbase blocks before xnonce2 are the same for every roll, so
+ * their hash state is kept; prefix_len is the offset of xnonce2 */
+static void stratum_job_midstate(struct stratum_job *job, size_t prefix_len)
+{
+	int i, j;
+
+	job->cb_prefix = prefix_len / 64 * 64;
+	sha256_init(job->cb_midstate);
+	for (i = 0; i < job->cb_prefix; i += 64) {
+		uint32_t W[16];
+		for (j = 0; j < 16; j++)
+			W[j] = be32dec(job->coinbase + i + 4 * j);
+		sha256_transform(job->cb_midstate, W, 0);
+	}
+	job->roots_next = job->roots_ready = 0;
+}
+
+/* Decodes a notification into sctx->job, reusing its buffers */
+static bool stratum_set_job(struct stratum_ctx *sctx, const struct stratum_notify *n)
+{
+	size_t coinb1_size, coinb2_size, coinbase_size;
+	bool new_job, ret = false;
+	uint32_t odo_key;
+	int i;
+
+	if (n->prevhash_len != 64 || n->version_len != 8 || n->nbits_len != 8 ||
+	    n->ntime_len != 8 || n->coinb1_len % 2 || n->coinb2_len % 2) {
+		applog(LOG_ERR, "Stratum notify: invalid parameters");
+		return false;
+	}
+
+	pthread_mutex_lock(&sctx->work_lock);
+
+	coinb1_size = n->coinb1_len / 2;
+	coinb2_size = n->coinb2_len / 2;
+	coinbase_size = coinb1_size + sctx->xnonce1_size +
+	                sctx->xnonce2_size + coinb2_size;
+	if (coinbase_size > sctx->job.coinbase_alloc) {
+		unsigned char *cb = realloc(sctx->job.coinbase, coinbase_size);
+		if (!cb)
+			goto out;
+		sctx->job.coinbase = cb;
+		sctx->job.coinbase_alloc = coinbase_size;
+	}
+	if (n->merkle_count > sctx->job.merkle_alloc) {
+		void *m = realloc(sctx->job.merkle, n->merkle_count * 32);
+		if (!m)
+			goto out;
+		sctx->job.merkle = m;
+		sctx->job.merkle_alloc = n->merkle_count;
+	}
+	if (n->job_id_len >= sctx->job.job_id_size) {
+		char *id = realloc(sctx->job.job_id, n->job_id_len + 1);
+		if (!id)
+			goto out;
+		if (!sctx->job.job_id)
+			id[0] = '\0';
+		sctx->job.job_id = id;
+		sctx->job.job_id_size = n->job_id_len + 1;
+	}
+	new_job = strlen(sctx->job.job_id) != n->job_id_len ||
+	          memcmp(sctx->job.job_id, n->job_id, n->job_id_len);
+
+	sctx->job.coinbase_size = coinbase_size;
+	sctx->job.xnonce2 = sctx->job.coinbase + coinb1_size + sctx->xnonce1_size;
+	hex_decode(sctx->job.coinbase, n->coinb1, coinb1_size);
+	memcpy(sctx->job.coinbase + coinb1_size, sctx->xnonce1, sctx->xnonce1_size);
+	if (new_job)
+		memset(sctx->job.xnonce2, 0, sctx->xnonce2_size);
+	hex_decode(sctx->job.xnonce2 + sctx->xnonce2_size, n->coinb2, coinb2_size);
+
+	stratum_job_midstate(&sctx->job, coinb1_size + sctx->xnonce1_size);
+
+	memcpy(sctx->job.job_id, n->job_id, n->job_id_len);
+	sctx->job.job_id[n->job_id_len] = '\0';
+	hex_decode(sctx->job.prevhash, n->prevhash, 32);
+
+	for (i = 0; i < n->merkle_count; i++)
+		hex_decode(sctx->job.merkle[i], n->merkle[i], 32);
+	sctx->job.merkle_count = n->merkle_count;
+
+	hex_decode(sctx->job.version, n->version, 4);
+	hex_decode(sctx->job.nbits, n->nbits, 4);
+	hex_decode(sctx->job.ntime, n->ntime, 4);
+	sctx->job.clean = n->clean;
+
+	/* Derive the key from ntime; a key sent by the pool takes precedence */
+	odo_key = odo_key_at(be32dec(sctx->job.ntime));
+	if (sctx->odo_key_sent) {
+		if (sctx->odo_key != odo_key &&
+		    (sctx->odo_key != sctx->job.odo_key || odo_key != sctx->odo_key_local))
+			applog(LOG_WARNING, "Pool Odo key %u differs from key %u for ntime %08x",
+			       sctx->odo_key, odo_key, be32dec(sctx->job.ntime));
+		sctx->odo_key_local = odo_key;
+		odo_key = sctx->odo_key;
+	} else
+		sctx->odo_key_local = odo_key;
+	if (odo_key != sctx->job.odo_key) {
+		applog(LOG_INFO, "Odo key changed to %u", odo_key);
+		sctx->job.odo_key = odo_key;
+		sctx->job.clean = true;
+	}
+	if (sctx->job.clean)
+		sctx->clean_seq++;
+
+	sctx->job.diff = sctx->next_diff;
+	sctx->job_seq++;
+	ret = true;
+
+out:
+	pthread_mutex_unlock(&sctx->work_lock);
+	return ret;
+}
+
+static bool stratum_notify(struct stratum_ctx *sctx, json_t *params)
+{
+	struct stratum_notify n;
 	json_t *merkle_arr;
-	unsigned char **merkle;
+	bool ret = false;
+	int i;
 
-	job_id = json_string_value(json_array_get(params, 0));
-	prevhash = json_string_value(json_array_get(params, 1));
-	coinb1 = json_string_value(json_array_get(params, 2));
-	coinb2 = json_string_value(json_array_get(params, 3));
+	n.job_id = json_string_value(json_array_get(params, 0));
+	n.prevhash = json_string_value(json_array_get(params, 1));
+	n.coinb1 = json_string_value(json_array_get(params, 2));
+	n.coinb2 = json_string_value(json_array_get(params, 3));
 	merkle_arr = json_array_get(params, 4);
 	if (!merkle_arr || !json_is_array(merkle_arr))
 		goto out;
-	merkle_count = json_array_size(merkle_arr);
-	version = json_string_value(json_array_get(params, 5));
-	nbits = json_string_value(json_array_get(params, 6));
-	ntime = json_string_value(json_array_get(params, 7));
-	clean = json_is_true(json_array_get(params, 8));
-
-	if (!job_id || !prevhash || !coinb1 || !coinb2 || !version || !nbits || !ntime ||
-	    strlen(prevhash) != 64 || strlen(version) != 8 ||
-	    strlen(nbits) != 8 || strlen(ntime) != 8) {
+	n.merkle_count = json_array_size(merkle_arr);
+	n.version = json_string_value(json_array_get(params, 5));
+	n.nbits = json_string_value(json_array_get(params, 6));
+	n.ntime = json_string_value(json_array_get(params, 7));
+	n.clean = json_is_true(json_array_get(params, 8));
+
+	if (!n.job_id || !n.prevhash || !n.coinb1 || !n.coinb2 ||
+	    !n.version || !n.nbits || !n.ntime) {
 		applog(LOG_ERR, "Stratum notify: invalid parameters");
 		goto out;
 	}
-	merkle = malloc(merkle_count * sizeof(char *));
-	for (i = 0; i < merkle_count; i++) {
-		const char *s = json_string_value(json_array_get(merkle_arr, i));
-		if (!s || strlen(s) != 64) {
-			while (i--)
-				free(merkle[i]);
-			free(merkle);
+	n.job_id_len = strlen(n.job_id);
+	n.prevhash_len = strlen(n.prevhash);
+	n.coinb1_len = strlen(n.coinb1);
+	n.coinb2_len = strlen(n.coinb2);
+	n.version_len = strlen(n.version);
+	n.nbits_len = strlen(n.nbits);
+	n.ntime_len = strlen(n.ntime);
+
+	n.merkle = malloc(n.merkle_count * sizeof(char *) + 1);
+	for (i = 0; i < n.merkle_count; i++) {
+		n.merkle[i] = json_string_value(json_array_get(merkle_arr, i));
+		if (!n.merkle[i] || strlen(n.merkle[i]) != 64) {
 			applog(LOG_ERR, "Stratum notify: invalid Merkle branch");
-			goto out;
+			break;
 		}
-		merkle[i] = malloc(32);
-		hex2bin(merkle[i], s, 32);
 	}
+	if (i == n.merkle_count)
+		ret = stratum_set_job(sctx, &n);
+	free(n.merkle);
+
+out:
+	return ret;
+}
+
+static bool stratum_set_diff(struct stratum_ctx *sctx, double diff)
+{
+	if (diff == 0)
+		return false;
 
 	pthread_mutex_lock(&sctx->work_lock);
+	sctx->next_diff = diff;
+	pthread_mutex_unlock(&sctx->work_lock);
 
-	coinb1_size = strlen(coinb1) / 2;
-	coinb2_size = strlen(coinb2) / 2;
-	sctx->job.coinbase_size = coinb1_size + sctx->xnonce1_size +
-	                          sctx->xnonce2_size + coinb2_size;
-	sctx->job.coinbase = realloc(sctx->job.coinbase, sctx->job.coinbase_size);
-	sctx->job.xnonce2 = sctx->job.coinbase + coinb1_size + sctx->xnonce1_size;
-	hex2bin(sctx->job.coinbase, coinb1, coinb1_size);
-	memcpy(sctx->job.coinbase + coinb1_size, sctx->xnonce1, sctx->xnonce1_size);
-	if (!sctx->job.job_id || strcmp(sctx->job.job_id, job_id))
-		memset(sctx->job.xnonce2, 0, sctx->xnonce2_size);
-	hex2bin(sctx->job.xnonce2 + sctx->xnonce2_size, coinb2, coinb2_size);
+	if (opt_debug)
+		applog(LOG_DEBUG, "Stratum difficulty set to %g", diff);
 
-	free(sctx->job.job_id);
-	sctx->job.job_id = strdup(job_id);
-	hex2bin(sctx->job.prevhash, prevhash, 32);
+	return true;
+}
 
-	for (i = 0; i < sctx->job.merkle_count; i++)
-		free(sctx->job.merkle[i]);
-	free(sctx->job.merkle);
-	sctx->job.merkle = merkle;
-	sctx->job.merkle_count = merkle_count;
+static bool stratum_set_difficulty(struct stratum_ctx *sctx, json_t *params)
+{
+	return stratum_set_diff(sctx, json_number_value(json_array_get(params, 0)));
+}
 
-	hex2bin(sctx->job.version, version, 4);
-	hex2bin(sctx->job.nbits, nbits, 4);
-	hex2bin(sctx->job.ntime, ntime, 4);
-	sctx->job.clean = clean;
+/*
+ * In-place scanner for the hot Stratum messages.  It understands just
+ * enough JSON to pick out the fields the fast paths need; escapes,
+ * unexpected types and anything else unusual make it give up, and the
+ * caller falls back to jansson.  All helpers propagate a NULL position.
+ */
+#define STRATUM_FAST_MERKLE 32
 
-	sctx->job.diff = sctx->next_diff;
+struct stratum_msg {
+	const char *method, *id, *params, *result, *error, *odokey;
+	size_t method_len;
+};
 
-	pthread_mutex_unlock(&sctx->work_lock);
+static const char *js_ws(const char *p)
+{
+	if (p)
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+			p++;
+	return p;
+}
 
-	ret = true;
+/* Expects character c, then skips any whitespace after it */
+static const char *js_sep(const char *p, char c)
+{
+	p = js_ws(p);
+	return p && *p == c ? js_ws(p + 1) : NULL;
+}
 
-out:
-	return ret;
+/* Reads a string that contains no escapes */
+static const char *js_str(const char *p, const char **s, size_t *len)
+{
+	const char *q;
+
+	if (!p || *p != '"')
+		return NULL;
+	q = p + 1 + strcspn(p + 1, "\"\\");
+	if (*q != '"')
+		return NULL;
+	*s = p + 1;
+	*len = q - p - 1;
+	return q + 1;
 }
 
-static bool stratum_set_difficulty(struct stratum_ctx *sctx, json_t *params)
+static const char *js_skip(const char *p)
 {
-	double diff;
+	int depth = 0;
+
+	do {
+		p = js_ws(p);
+		if (!p)
+			return NULL;
+		switch (*p) {
+		case '"':
+			for (p++; *p != '"'; p++)
+				if (!*p || (*p == '\\' && !*++p))
+					return NULL;
+			p++;
+			break;
+		case '[':
+		case '{':
+			depth++;
+			p++;
+			continue;
+		case ']':
+		case '}':
+			if (!depth)
+				return NULL;
+			depth--;
+			p++;
+			break;
+		case ',':
+		case ':':
+			if (!depth)
+				return NULL;
+			p++;
+			continue;
+		case '\0':
+			return NULL;
+		default:
+			p += strcspn(p, ",:]} \t\r\n");
+		}
+	} while (depth);
 
-	diff = json_number_value(json_array_get(params, 0));
-	if (diff == 0)
+	return p;
+}
+
+static bool js_is(const char *p, const char *lit)
+{
+	return p && !strncmp(p, lit, strlen(lit));
+}
+
+static bool stratum_scan(const char *s, struct stratum_msg *m)
+{
+	const char *p, *key = NULL;
+	size_t len = 0;
+
+	memset(m, 0, sizeof(*m));
+	p = js_sep(s, '{');
+	while (p && *p != '}') {
+		p = js_sep(js_str(p, &key, &len), ':');
+		if (!p)
+			return false;
+		if (len == 6 && !memcmp(key, "method", 6)) {
+			p = js_str(p, &m->method, &m->method_len);
+		} else {
+			if (len == 2 && !memcmp(key, "id", 2))
+				m->id = p;
+			else if (len == 6 && !memcmp(key, "params", 6))
+				m->params = p;
+			else if (len == 6 && !memcmp(key, "result", 6))
+				m->result = p;
+			else if (len == 5 && !memcmp(key, "error", 5))
+				m->error = p;
+			else if (len == 6 && !memcmp(key, "odokey", 6))
+				m->odokey = p;
+			p = js_skip(p);
+		}
+		p = js_ws(p);
+		if (p && *p == ',')
+			p = js_ws(p + 1);
+		else if (p && *p != '}')
+			return false;
+	}
+	return p != NULL;
+}
+
+static bool stratum_notify_fast(struct stratum_ctx *sctx, const char *p)
+{
+	const char *merkle[STRATUM_FAST_MERKLE];
+	struct stratum_notify n;
+	size_t len;
+
+	p = js_sep(p, '[');
+	p = js_sep(js_str(p, &n.job_id, &n.job_id_len), ',');
+	p = js_sep(js_str(p, &n.prevhash, &n.prevhash_len), ',');
+	p = js_sep(js_str(p, &n.coinb1, &n.coinb1_len), ',');
+	p = js_sep(js_str(p, &n.coinb2, &n.coinb2_len), ',');
+	p = js_sep(p, '[');
+	n.merkle = merkle;
+	for (n.merkle_count = 0; p && *p != ']'; n.merkle_count++) {
+		if (n.merkle_count == STRATUM_FAST_MERKLE)
+			return false;
+		p = js_ws(js_str(p, &merkle[n.merkle_count], &len));
+		if (!p || len != 64)
+			return false;
+		if (*p == ',')
+			p = js_ws(p + 1);
+		else if (*p != ']')
+			return false;
+	}
+	p = js_sep(js_sep(p, ']'), ',');
+	p = js_sep(js_str(p, &n.version, &n.version_len), ',');
+	p = js_sep(js_str(p, &n.nbits, &n.nbits_len), ',');
+	p = js_sep(js_str(p, &n.ntime, &n.ntime_len), ',');
+	if (js_is(p, "true"))
+		n.clean = true;
+	else if (js_is(p, "false"))
+		n.clean = false;
+	else
 		return false;
 
+	return stratum_set_job(sctx, &n);
+}
+
+/* Handles replies to our own requests without building a jansson tree.
+ * Returns 0 if s is not a reply, 1 if it was parsed, -1 if the generic
+ * parser is needed.  A rejection reason is NUL-terminated in place. */
+int stratum_parse_reply(char *s, int *id, bool *result, const char **reason)
+{
+	struct stratum_msg m;
+	const char *p;
+	size_t len;
+
+	if (!stratum_scan(s, &m))
+		return -1;
+	if (m.method || !m.id || js_is(m.id, "null") || !m.result)
+		return 0;
+
+	*id = strtol(m.id + (*m.id == '"'), NULL, 10);
+	*result = js_is(m.result, "true");
+	*reason = NULL;
+	if (m.error && *m.error == '[') {
+		p = js_sep(js_skip(js_sep(m.error, '[')), ',');
+		if (p && *p == '"') {
+			if (!js_str(p, reason, &len))
+				return -1;
+			s[*reason - s + len] = '\0';
+		}
+	}
+	return 1;
+}
+
+static bool stratum_set_version_mask(struct stratum_ctx *sctx, json_t *params)
+{
+	const char *mask = json_string_value(json_array_get(params, 0));
+
+	if (!mask || !sctx->version_rolling)
+		return false;
 	pthread_mutex_lock(&sctx->work_lock);
-	sctx->next_diff = diff;
+	sctx->version_mask = strtoul(mask, NULL, 16) & 0x1fffe000;
 	pthread_mutex_unlock(&sctx->work_lock);
+	applog(LOG_INFO, "Stratum version rolling mask set to %08x",
+	       sctx->version_mask);
+	return true;
+}
 
-	if (opt_debug)
-		applog(LOG_DEBUG, "Stratum difficulty set to %g", diff);
+/* Takes a new extranonce without reconnecting: the current job's
+ * coinbase is rebuilt around it, and the new session_seq moves miners
+ * off work built on the old one */
+static bool stratum_set_extranonce(struct stratum_ctx *sctx, json_t *params)
+{
+	struct stratum_job *job = &sctx->job;
+	const char *xnonce1 = json_string_value(json_array_get(params, 0));
+	int xn2_size = json_integer_value(json_array_get(params, 1));
+	size_t xn1_size, coinb1_size, coinb2_size, size;
+	unsigned char *xn1, *cb = NULL;
+
+	if (!xnonce1 || strlen(xnonce1) % 2 || xn2_size < 1 || xn2_size > 100) {
+		applog(LOG_ERR, "Stratum set_extranonce: invalid parameters");
+		return false;
+	}
+	xn1_size = strlen(xnonce1) / 2;
+	xn1 = malloc(xn1_size + 1);
+	if (!xn1 || !hex2bin(xn1, xnonce1, xn1_size)) {
+		free(xn1);
+		return false;
+	}
 
+	pthread_mutex_lock(&sctx->work_lock);
+	if (job->coinbase) {
+		coinb1_size = job->xnonce2 - job->coinbase - sctx->xnonce1_size;
+		coinb2_size = job->coinbase_size - (job->xnonce2 - job->coinbase) -
+		              sctx->xnonce2_size;
+		size = coinb1_size + xn1_size + xn2_size + coinb2_size;
+		cb = malloc(size > job->coinbase_alloc ? size : job->coinbase_alloc);
+		if (!cb) {
+			pthread_mutex_unlock(&sctx->work_lock);
+			free(xn1);
+			return false;
+		}
+		memcpy(cb, job->coinbase, coinb1_size);
+		memcpy(cb + coinb1_size, xn1, xn1_size);
+		memset(cb + coinb1_size + xn1_size, 0, xn2_size);
+		memcpy(cb + coinb1_size + xn1_size + xn2_size,
+		       job->xnonce2 + sctx->xnonce2_size, coinb2_size);
+		if (size > job->coinbase_alloc)
+			job->coinbase_alloc = size;
+		free(job->coinbase);
+		job->coinbase = cb;
+		job->coinbase_size = size;
+		job->xnonce2 = cb + coinb1_size + xn1_size;
+		stratum_job_midstate(job, coinb1_size + xn1_size);
+	}
+	free(sctx->xnonce1);
+	sctx->xnonce1 = xn1;
+	sctx->xnonce1_size = xn1_size;
+	sctx->xnonce2_size = xn2_size;
+	/* set with session_seq, so that the proxy never sees a new session
+	 * with the old prefix */
+	sctx->xnonce2_fixed = sctx->proxied ? stratum_proxy_prefix(xn2_size) : 0;
+	sctx->session_seq++;
+	pthread_mutex_unlock(&sctx->work_lock);
+
+	applog(LOG_INFO, "Stratum extranonce1 set to %s, extranonce2 size %d",
+	       xnonce1, xn2_size);
 	return true;
 }
 
@@ -1503,27 +2402,50 @@ static bool stratum_show_message(struct stratum_ctx *sctx, json_t *id, json_t *p
 
 bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
 {
-	json_t *val, *id, *params;
+	struct stratum_msg m;
+	json_t *val, *id, *params, *odokey;
 	json_error_t err;
 	const char *method;
 	bool ret = false;
 
+	if (stratum_scan(s, &m)) {
+		if (!m.method)
+			return false;
+		if (m.odokey && (*m.odokey == '"' || isdigit(*m.odokey))) {
+			sctx->odo_key = strtoul(m.odokey + (*m.odokey == '"'), NULL, 10);
+			sctx->odo_key_sent = true;
+		}
+		if (m.method_len == 13 && !strncasecmp(m.method, "mining.notify", 13) &&
+		    stratum_notify_fast(sctx, m.params))
+			return true;
+		if (m.method_len == 21 && !strncasecmp(m.method, "mining.set_difficulty", 21)) {
+			const char *p = js_sep(m.params, '[');
+			char *end;
+			double diff = p ? strtod(p, &end) : 0;
+			if (p && end != p && js_sep(end, ']'))
+				return stratum_set_diff(sctx, diff);
+		}
+	}
+
 	val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
 	}
 
-	applog(LOG_ERR, "method:%s", s);
 	method = json_string_value(json_object_get(val, "method"));
 	if (!method)
 		goto out;
 	id = json_object_get(val, "id");
 	params = json_object_get(val, "params");
 
-	g_odo_key = (uint32_t)json_integer_value(json_object_get(val, "odokey"));
-
-	applog(LOG_ERR, "odoKey:%u", g_odo_key);
+	/* the key for the jobs that follow; other methods leave it alone */
+	odokey = json_object_get(val, "odokey");
+	if (json_is_integer(odokey))
+		sctx->odo_key = json_integer_value(odokey);
+	else if (json_is_string(odokey))
+		sctx->odo_key = strtoul(json_string_value(odokey), NULL, 10);
+	sctx->odo_key_sent |= json_is_integer(odokey) || json_is_string(odokey);
 
 	if (!strcasecmp(method, "mining.notify")) {
 		ret = stratum_notify(sctx, params);
@@ -1533,6 +2455,14 @@ bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
 		ret = stratum_set_difficulty(sctx, params);
 		goto out;
 	}
+	if (!strcasecmp(method, "mining.set_version_mask")) {
+		ret = stratum_set_version_mask(sctx, params);
+		goto out;
+	}
+	if (!strcasecmp(method, "mining.set_extranonce")) {
+		ret = stratum_set_extranonce(sctx, params);
+		goto out;
+	}
 	if (!strcasecmp(method, "client.reconnect")) {
 		ret = stratum_reconnect(sctx, params);
 		goto out;
@@ -1553,115 +2483,3 @@ out:
 	return ret;
 }
 
-struct thread_q *tq_new(void)
-{
-	struct thread_q *tq;
-
-	tq = calloc(1, sizeof(*tq));
-	if (!tq)
-		return NULL;
-
-	INIT_LIST_HEAD(&tq->q);
-	pthread_mutex_init(&tq->mutex, NULL);
-	pthread_cond_init(&tq->cond, NULL);
-
-	return tq;
-}
-
-void tq_free(struct thread_q *tq)
-{
-	struct tq_ent *ent, *iter;
-
-	if (!tq)
-		return;
-
-	list_for_each_entry_safe(ent, iter, &tq->q, q_node, struct tq_ent) {
-		list_del(&ent->q_node);
-		free(ent);
-	}
-
-	pthread_cond_destroy(&tq->cond);
-	pthread_mutex_destroy(&tq->mutex);
-
-	memset(tq, 0, sizeof(*tq));	/* poison */
-	free(tq);
-}
-
-static void tq_freezethaw(struct thread_q *tq, bool frozen)
-{
-	pthread_mutex_lock(&tq->mutex);
-
-	tq->frozen = frozen;
-
-	pthread_cond_signal(&tq->cond);
-	pthread_mutex_unlock(&tq->mutex);
-}
-
-void tq_freeze(struct thread_q *tq)
-{
-	tq_freezethaw(tq, true);
-}
-
-void tq_thaw(struct thread_q *tq)
-{
-	tq_freezethaw(tq, false);
-}
-
-bool tq_push(struct thread_q *tq, void *data)
-{
-	struct tq_ent *ent;
-	bool rc = true;
-
-	ent = calloc(1, sizeof(*ent));
-	if (!ent)
-		return false;
-
-	ent->data = data;
-	INIT_LIST_HEAD(&ent->q_node);
-
-	pthread_mutex_lock(&tq->mutex);
-
-	if (!tq->frozen) {
-		list_add_tail(&ent->q_node, &tq->q);
-	} else {
-		free(ent);
-		rc = false;
-	}
-
-	pthread_cond_signal(&tq->cond);
-	pthread_mutex_unlock(&tq->mutex);
-
-	return rc;
-}
-
-void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
-{
-	struct tq_ent *ent;
-	void *rval = NULL;
-	int rc;
-
-	pthread_mutex_lock(&tq->mutex);
-
-	if (!list_empty(&tq->q))
-		goto pop;
-
-	if (abstime)
-		rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
-	else
-		rc = pthread_cond_wait(&tq->cond, &tq->mutex);
-	if (rc)
-		goto out;
-	if (list_empty(&tq->q))
-		goto out;
-
-pop:
-	ent = list_entry(tq->q.next, struct tq_ent, q_node);
-	rval = ent->data;
-
-	list_del(&ent->q_node);
-	free(ent);
-
-out:
-	pthread_mutex_unlock(&tq->mutex);
-	return rval;
-}